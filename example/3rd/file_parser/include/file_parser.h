@@ -31,36 +31,181 @@ typedef enum {
   MEDIA_FILE_TYPE_G722,
   MEDIA_FILE_TYPE_AACLC,
   MEDIA_FILE_TYPE_HEAAC,
+  // VP8 in an IVF container
+  MEDIA_FILE_TYPE_VP8,
 } media_file_type_e;
 
+// What depends on a video frame, for picking frames to drop
+typedef enum {
+  VIDEO_FRAME_CLASS_KEY,
+  // later frames may predict from it
+  VIDEO_FRAME_CLASS_REFERENCE,
+  // nothing predicts from it (H.264 nal_ref_idc 0, H.265 sub-layer
+  // non-reference), or it sits above the base temporal layer. VP8 frames
+  // are never classed as disposable.
+  VIDEO_FRAME_CLASS_DISPOSABLE,
+} video_frame_class_e;
+
 typedef struct {
   union {
     struct {
       int sampleRateHz;
       int numberOfChannels;
       int framePeriodMs;
+      // WAV: hand out 24-bit, 32-bit and float samples as int16
+      bool convertToInt16;
+      // G.711: the samples are u-law (PCMU) rather than A-law (PCMA). A WAV
+      // header sets it, through file_parser_probe_audio too.
+      bool g711Ulaw;
     } audio_cfg;
+    struct {
+      // used when the stream carries no timing of its own; 0 means 25
+      int fps;
+      // raw YUV 4:2:0: the picture size, which sets the frame size. A Y4M
+      // file carries its own.
+      int width;
+      int height;
+      // H.264/H.265: list the NAL units of each frame in frame_t.ext. The
+      // two options below and MP4 sources imply it.
+      bool list_nals;
+      // H.264/H.265: put the last seen VPS/SPS/PPS in front of key frames
+      // that don't carry their own, through frame_t.ext->iov
+      bool prepend_param_sets;
+      // H.264/H.265: hand out frames with a 4-byte big-endian length in
+      // front of each NAL unit (AVCC/HVCC) through frame_t.ext->iov instead
+      // of Annex-B start codes. The payloads aren't copied.
+      bool length_prefixed;
+    } video_cfg;
   } u;
 } parser_cfg_t;
 
+typedef struct {
+  // picture size after cropping, 0 when unknown
+  int width;
+  int height;
+  // frame rate as a fraction
+  uint32_t fps_num;
+  uint32_t fps_den;
+} video_stream_info_t;
+
+typedef struct {
+  const uint8_t *ptr;
+  uint32_t len;
+} frame_iov_t;
+
+typedef struct {
+  uint32_t offset; // of the nal header, from frame_t.ptr
+  uint32_t len;    // without the start code
+  uint8_t type;    // nal_unit_type
+} frame_nal_t;
+
+// H.264/H.265 extras of a frame, kept out of frame_t so that frames stay
+// small and can be copied. Owned by the parser like the payload: valid
+// until the frame is released, whatever copy of the frame_t is used.
+typedef struct {
+  // When iov_cnt > 0 the frame to send is the concatenation of iov[], which
+  // points into memory owned by the parser; frame_t.ptr/len is then only
+  // the part read from the file, as stored there: Annex-B, or length
+  // prefixed nals for MP4, whose frames always come through iov.
+  frame_iov_t *iov;
+  int iov_cnt;
+  // iov[] holds the frame with length prefixed nals. Not set when the nal
+  // list isn't available; the frame is Annex-B then.
+  bool length_prefixed;
+  // the NAL units of ptr/len, found while parsing the access unit so that
+  // nobody has to scan for start codes again. Parameter sets prepended
+  // through iov are not listed.
+  frame_nal_t *nals;
+  int nal_cnt;
+} frame_ext_t;
+
 typedef struct {
   int type;
   uint8_t *ptr;
   uint32_t len;
+  uint64_t offset; // byte offset of the frame in the source file
+  void *p_priv;    // owned by the parser until the frame is released
+  int64_t pts_us;       // presentation time from the start of the source, continuous across rewinds
+  uint32_t duration_us; // how long the frame plays
+  // H.264/H.265: the nal list and iov, NULL unless video_cfg asks for one
+  // of them or the source is MP4
+  frame_ext_t *ext;
 
   union {
     struct {
       bool is_key_frame;
+      // the access unit carries its own SPS
+      bool has_param_sets;
+      // a video_frame_class_e
+      uint8_t frame_class;
+      // H.265 TemporalId, 0 for the base layer and other codecs
+      uint8_t temporal_id;
+      // YUV 4:2:0: the Y, U and V planes inside ptr/len, each stride bytes
+      // per row; NULL for compressed video
+      const uint8_t *planes[3];
+      int strides[3];
     } video;
 
     struct {
+      // set by parsers that know it, e.g. from the Opus TOC byte; else 0
+      uint32_t samples_per_channel;
+      // PCM sample format of ptr/len when known (WAV), else 0
+      uint8_t bits_per_sample;
+      bool is_float;
+      // AAC in ADTS: the frame's header, all 0 for other sources
+      struct {
+        // audio object type - 1, e.g. 1 for AAC LC
+        uint8_t profile;
+        // into 96000, 88200, 64000, 48000, 44100, 32000, ... 7350
+        uint8_t sampling_index;
+        // 0 when the channel layout is given in the payload
+        uint8_t channel_config;
+        // a CRC follows the 7 byte header
+        bool has_crc;
+        // raw data blocks in the frame, of 1024 samples each
+        uint8_t raw_blocks;
+      } adts;
     } audio;
   } u;
 } frame_t;
 
+/* path may also be a pipe or FIFO, or "-" for stdin. Such a stream is read
+   once: at its end obtain returns -2 instead of rewinding. An MP4 file is
+   recognized by its content and read through its first track of the given
+   type, in which case the frame index comes from the MP4 sample table.
+   A WAV file opened as PCM or G.711 takes its format from its header. */
 void *create_file_parser(media_file_type_e type, const char *path, parser_cfg_t *p_parser_cfg);
+/* Detect the format of a regular file from its first bytes: Annex-B
+   H.264/H.265, IVF VP8, MP4, ADTS AAC, Ogg Opus, WAV, Y4M and JPEG. The audio
+   config and the Y4M picture size and frame rate come from the stream
+   headers. Returns -1 for anything else, such as headerless PCM/G.711/G.722,
+   and for streams, which can't be read twice. An MP4 file reports its first
+   video track, or its first audio track if it has none. */
+int file_parser_probe(const char *path, media_file_type_e *p_type, parser_cfg_t *p_cfg);
+/* Like file_parser_probe, but an MP4 file reports its first audio track */
+int file_parser_probe_audio(const char *path, media_file_type_e *p_type, parser_cfg_t *p_cfg);
+/* Stream properties of a video source, from the parameter sets at its start
+   (H.264 SPS, H.265 VPS/SPS). The frame rate falls back to the configured
+   one. Returns -1 if the picture size is unknown. */
+int file_parser_get_video_info(void *p_parser, video_stream_info_t *p_info);
+/* Decoder config the container carries out of band: the avcC/hvcC record,
+   AudioSpecificConfig or Opus dOps body of an MP4 track. Valid until the
+   parser is destroyed; -1 if the source has none. */
+int file_parser_get_codec_config(void *p_parser, const uint8_t **pp_data, uint32_t *p_len);
 int file_parser_obtain_frame(void *p_parser, frame_t *p_frame);
 int file_parser_release_frame(void *p_parser, frame_t *p_frame);
+/* Fetch up to max consecutive frames (rewinding at the end of a file) in one call. Stops
+   early once budget_us has elapsed; 0 means no time limit. Returns the
+   number of frames obtained, or -1 if none. */
+int file_parser_obtain_frames(void *p_parser, frame_t *p_frames, int max, uint64_t budget_us);
+int file_parser_release_frames(void *p_parser, frame_t *p_frames, int count);
+/* Random access through the frame index; -1 if the parser has no index */
+int file_parser_seek(void *p_parser, uint32_t frame_no);
+int64_t file_parser_frame_count(void *p_parser);
+/* Run the parser up to depth frames ahead on a background thread; obtain
+   calls then pop from the read-ahead ring. Stopped by destroy_file_parser. */
+int file_parser_start_prefetch(void *p_parser, int depth);
+void file_parser_stop_prefetch(void *p_parser);
 void destroy_file_parser(void *p_parser);
 
 #endif /* __MEDIA_PARSER_H__ */
\ No newline at end of file
@@ -10,21 +10,32 @@
  *
  *************************************************************/
 
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include <string.h>
 
 #include "file_parser.h"
 #include "file_parser_priv.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define FP_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 #define ADTS_HEADER_SIZE (7)
+// followed by a 16 bit CRC when protection_absent is clear
+#define ADTS_CRC_SIZE (2)
+// bytes looked at per step of a resync
+#define ADTS_RESYNC_CHUNK (64 * 1024)
 
 typedef struct {
-  int data_offset_;
-  int data_size_;
-  uint8_t *data_buffer_;
-  int fd_;
+  uint64_t data_offset_;
+  fp_map_t map_;
+  // samples since the start, counted at rate_; a rate change folds them into time_base_us_
+  uint64_t samples_;
+  uint32_t rate_;
+  int64_t time_base_us_;
+  // header of the last good frame; one that doesn't match it starts a resync
+  uint8_t last_hdr_[ADTS_HEADER_SIZE];
+  bool have_last_hdr_;
 } ctx_t;
 
 typedef struct AACAudioFrame_ {
@@ -46,48 +57,246 @@ typedef struct AACAudioFrame_ {
   uint8_t number_of_raw_data_blocks_in_frame;
 } AACAudioFrame;
 
-/* static const uint32_t AacFrameSampleRateMap[] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000,
-												  22000, 16000, 12000, 11025, 8000,	 7350 }; */
+static const uint32_t AacFrameSampleRateMap[16] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+                                                    16000, 12000, 11025, 8000,  7350,  0,     0,     0 };
 
-static int aac_open(media_parser_t *h, const char *path)
+#define AAC_SAMPLES_PER_BLOCK 1024
+
+typedef const uint8_t *(*adts_scan_fn)(const uint8_t *p, const uint8_t *end);
+
+// Decode the 7 byte header at hdr; -1 if it can't be one: no syncword, a
+// layer other than 0, a reserved sampling index or a frame too short for
+// its own header
+static int aac_parse_adts(const uint8_t *hdr, AACAudioFrame *f)
 {
-  int rval = -1;
+  // adts_fixed_header()
+  f->syncword = (hdr[0] << 4) | (hdr[1] >> 4);
+  f->id = (hdr[1] >> 3) & 0x01;
+  f->layer = (hdr[1] >> 1) & 0x03;
+  f->protection_absent = hdr[1] & 0x01;
+  f->profile = (hdr[2] >> 6) & 0x03;
+  f->sampling_frequency_index = (hdr[2] >> 2) & 0x0f;
+  f->private_bit = (hdr[2] >> 1) & 0x01;
+  f->channel_configuration = ((hdr[2] & 0x1) << 2) | (hdr[3] >> 6);
+  f->original_copy = (hdr[3] >> 5) & 0x01;
+  f->home = (hdr[3] >> 4) & 0x01;
+  // adts_variable_header()
+  f->copyrighted_id_bit = (hdr[3] >> 3) & 0x01;
+  f->copyrighted_id_start = (hdr[3] >> 2) & 0x01;
+  f->aac_frame_length = ((hdr[3] & 0x3) << 11) | (hdr[4] << 3) | (hdr[5] >> 5);
+  f->adts_buffer_fullness = ((hdr[5] & 0x1f) << 6) | (hdr[6] >> 2);
+  f->number_of_raw_data_blocks_in_frame = hdr[6] & 0x03;
+
+  if (f->syncword != 0xfff || f->layer != 0 || AacFrameSampleRateMap[f->sampling_frequency_index] == 0 ||
+      f->aac_frame_length < ADTS_HEADER_SIZE + (f->protection_absent ? 0 : ADTS_CRC_SIZE)) {
+    return -1;
+  }
+  return 0;
+}
 
-  int fd = -1;
-  do {
-    struct stat sb;
-    void *mapped;
+// Two headers of the same stream: the fixed header bits other than
+// private_bit agree
+static bool aac_same_stream(const uint8_t *a, const uint8_t *b)
+{
+  return a[1] == b[1] && (a[2] & 0xfd) == (b[2] & 0xfd) && (a[3] & 0xf0) == (b[3] & 0xf0);
+}
 
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-      AGO_LOGD("parser: invalid fd, path=%s", path);
+static void aac_frame_info(frame_t *p_frame, const AACAudioFrame *f)
+{
+  p_frame->u.audio.samples_per_channel = AAC_SAMPLES_PER_BLOCK * (f->number_of_raw_data_blocks_in_frame + 1);
+  p_frame->u.audio.adts.profile = f->profile;
+  p_frame->u.audio.adts.sampling_index = f->sampling_frequency_index;
+  p_frame->u.audio.adts.channel_config = f->channel_configuration;
+  p_frame->u.audio.adts.has_crc = !f->protection_absent;
+  p_frame->u.audio.adts.raw_blocks = f->number_of_raw_data_blocks_in_frame + 1;
+}
+
+// The first ff fx in [p, end - 1) whose second byte has layer 0, i.e. a
+// possible syncword; end if there is none
+static const uint8_t *aac_find_sync_c(const uint8_t *p, const uint8_t *end)
+{
+  for (; end - p >= 2; p++) {
+    p = memchr(p, 0xff, end - 1 - p);
+    if (!p) {
       break;
     }
-    AGO_LOGI("Open audio file %s successfully", path);
+    if ((p[1] & 0xf6) == 0xf0) {
+      return p;
+    }
+  }
+  return end;
+}
 
-    if ((fstat(fd, &sb)) == -1) {
-      break;
+#ifdef FP_HAVE_X86_SIMD
+__attribute__((target("sse2"))) static const uint8_t *aac_find_sync_sse2(const uint8_t *p, const uint8_t *end)
+{
+  const __m128i ff = _mm_set1_epi8((char)0xff);
+  const __m128i sync_mask = _mm_set1_epi8((char)0xf6);
+  const __m128i sync = _mm_set1_epi8((char)0xf0);
+
+  while (end - p >= 17) {
+    __m128i b0 = _mm_loadu_si128((const __m128i *)p);
+    __m128i b1 = _mm_loadu_si128((const __m128i *)(p + 1));
+    __m128i m = _mm_and_si128(_mm_cmpeq_epi8(b0, ff), _mm_cmpeq_epi8(_mm_and_si128(b1, sync_mask), sync));
+    int mask = _mm_movemask_epi8(m);
+    if (mask) {
+      return p + __builtin_ctz(mask);
     }
+    p += 16;
+  }
+
+  return aac_find_sync_c(p, end);
+}
+
+__attribute__((target("avx2"))) static const uint8_t *aac_find_sync_avx2(const uint8_t *p, const uint8_t *end)
+{
+  const __m256i ff = _mm256_set1_epi8((char)0xff);
+  const __m256i sync_mask = _mm256_set1_epi8((char)0xf6);
+  const __m256i sync = _mm256_set1_epi8((char)0xf0);
+
+  while (end - p >= 33) {
+    __m256i b0 = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+    __m256i m =
+      _mm256_and_si256(_mm256_cmpeq_epi8(b0, ff), _mm256_cmpeq_epi8(_mm256_and_si256(b1, sync_mask), sync));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(m);
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 32;
+  }
+
+  return aac_find_sync_sse2(p, end);
+}
+#endif
+
+static adts_scan_fn aac_scan_select(void)
+{
+#ifdef FP_HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return aac_find_sync_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return aac_find_sync_sse2;
+  }
+#endif
+  return aac_find_sync_c;
+}
+
+static const uint8_t *aac_find_sync_resolve(const uint8_t *p, const uint8_t *end);
+
+// Resolved on first use, like the start code scanner
+static adts_scan_fn gs_aac_find_sync = aac_find_sync_resolve;
+
+static const uint8_t *aac_find_sync_resolve(const uint8_t *p, const uint8_t *end)
+{
+  gs_aac_find_sync = aac_scan_select();
+  return gs_aac_find_sync(p, end);
+}
+
+// A header at offset that decodes, and is followed either by the end of
+// file or by another header of the same stream. 1 if it checks out, 0 if
+// not, < 0 on a map error. The view stays anchored at offset: on a stream
+// a view further on would drop the candidate, and with it everything the
+// resync still has to look at.
+static int aac_check_sync(ctx_t *p_ctx, uint64_t offset)
+{
+  uint8_t hdr[ADTS_HEADER_SIZE];
+  const uint8_t *next;
+  AACAudioFrame f;
+  int ret;
+
+  ret = fp_map_view(&p_ctx->map_, offset, ADTS_HEADER_SIZE);
+  if (ret < 0) {
+    return ret;
+  }
+  if (offset + ADTS_HEADER_SIZE > p_ctx->map_.size) {
+    return 0;
+  }
+  memcpy(hdr, p_ctx->map_.view + (offset - p_ctx->map_.view_offset), ADTS_HEADER_SIZE);
+  if (aac_parse_adts(hdr, &f) < 0) {
+    return 0;
+  }
+
+  ret = fp_map_view(&p_ctx->map_, offset, f.aac_frame_length + ADTS_HEADER_SIZE);
+  if (ret < 0) {
+    return ret;
+  }
+  if (offset + f.aac_frame_length + ADTS_HEADER_SIZE > p_ctx->map_.size) {
+    // a truncated frame at the end is dropped anyway
+    return 1;
+  }
+  next = p_ctx->map_.view + (offset + f.aac_frame_length - p_ctx->map_.view_offset);
+  return next[0] == 0xff && aac_same_stream(hdr, next);
+}
 
-    mapped = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mapped == (void *)-1) {
+// Find the next good header after a bad one at data_offset_, one log line
+// per loss of sync. -2 if there is none before the end of file.
+static int aac_resync(ctx_t *p_ctx)
+{
+  uint64_t lost = p_ctx->data_offset_;
+  uint64_t pos = lost + 1;
+  int ret;
+
+  while (1) {
+    const uint8_t *view, *end, *sync;
+
+    ret = fp_map_view(&p_ctx->map_, pos, ADTS_RESYNC_CHUNK);
+    if (ret < 0) {
       break;
     }
+    view = p_ctx->map_.view + (pos - p_ctx->map_.view_offset);
+    end = p_ctx->map_.view + p_ctx->map_.view_len;
+    sync = gs_aac_find_sync(view, end);
+    if (sync == end) {
+      // keep a trailing 0xff, which may start a syncword
+      pos += (end - view) - 1;
+      if (pos + ADTS_HEADER_SIZE > p_ctx->map_.size) {
+        ret = -2;
+        break;
+      }
+      continue;
+    }
+    pos += sync - view;
 
-    ctx_t *p_ctx = (ctx_t *)malloc(sizeof(ctx_t));
-    if (!p_ctx) {
+    ret = aac_check_sync(p_ctx, pos);
+    if (ret < 0) {
       break;
     }
-    p_ctx->data_size_ = sb.st_size;
-    p_ctx->data_buffer_ = (uint8_t *)mapped;
-    p_ctx->data_offset_ = 0;
-    p_ctx->fd_ = fd;
+    if (ret == 1) {
+      AGO_LOGW("parser: lost AAC sync at 0x%llx, skipped %llu bytes", (unsigned long long)lost,
+               (unsigned long long)(pos - lost));
+      p_ctx->data_offset_ = pos;
+      return 0;
+    }
+    pos++;
+  }
 
-    h->p_ctx = (void *)p_ctx;
-    rval = 0;
-  } while (0);
+  AGO_LOGW("parser: lost AAC sync at 0x%llx, no frame after it", (unsigned long long)lost);
+  p_ctx->data_offset_ = pos;
+  return ret;
+}
 
-  return rval;
+static int aac_open(media_parser_t *h, const char *path)
+{
+  ctx_t *p_ctx = (ctx_t *)malloc(sizeof(ctx_t));
+  if (!p_ctx) {
+    return -1;
+  }
+
+  if (fp_map_open(&p_ctx->map_, path, FP_MAP_WINDOW_SIZE) < 0) {
+    free(p_ctx);
+    return -1;
+  }
+  p_ctx->data_offset_ = 0;
+  p_ctx->samples_ = 0;
+  p_ctx->rate_ = 0;
+  p_ctx->time_base_us_ = 0;
+  p_ctx->have_last_hdr_ = false;
+
+  h->p_ctx = (void *)p_ctx;
+  return 0;
 }
 
 static int aac_obtain_frame(media_parser_t *h, frame_t *p_frame)
@@ -101,9 +310,16 @@ static int aac_obtain_frame(media_parser_t *h, frame_t *p_frame)
       break;
     }
 
+    // On a stream the view waits for the header, so the end of input is
+    // only known after it
+    int ret = fp_map_view(&p_ctx->map_, p_ctx->data_offset_, ADTS_HEADER_SIZE);
+    if (ret < 0) {
+      rval = ret;
+      break;
+    }
+
     // Check data offset and rewind to the file start if necessary
-    if (p_ctx->data_offset_ + ADTS_HEADER_SIZE > p_ctx->data_size_) {
-      // p_ctx->data_offset_ = 0;
+    if (p_ctx->data_offset_ + ADTS_HEADER_SIZE > p_ctx->map_.size) {
       rval = -2;
       break;
     }
@@ -111,37 +327,48 @@ static int aac_obtain_frame(media_parser_t *h, frame_t *p_frame)
     AACAudioFrame aacframe;
 
     // Begin by reading the 7-byte fixed_variable headers
-    unsigned char *hdr = &p_ctx->data_buffer_[p_ctx->data_offset_];
-
-    // parse adts_fixed_header()
-    aacframe.syncword = (hdr[0] << 4) | (hdr[1] >> 4);
-    if (aacframe.syncword != 0xfff) {
-      AGO_LOGE("parser: Invalid AAC syncword 0x%x at 0x%x", aacframe.syncword, p_ctx->data_offset_);
-      p_ctx->data_offset_ += 1;
+    unsigned char *hdr = p_ctx->map_.view + (p_ctx->data_offset_ - p_ctx->map_.view_offset);
+    // a header that decodes but doesn't belong to the stream is most likely
+    // a false syncword in damaged data
+    if (aac_parse_adts(hdr, &aacframe) < 0 || (p_ctx->have_last_hdr_ && !aac_same_stream(p_ctx->last_hdr_, hdr))) {
+      ret = aac_resync(p_ctx);
+      if (ret < 0) {
+        rval = ret;
+        break;
+      }
       continue;
     }
 
-    /* 		aacframe.id = (hdr[1] >> 3) & 0x01;
-		aacframe.layer = (hdr[1] >> 1) & 0x03;
-		aacframe.protection_absent = hdr[1] & 0x01;
-		aacframe.profile = (hdr[2] >> 6) & 0x03;
-		aacframe.sampling_frequency_index = (hdr[2] >> 2) & 0x0f;
-		aacframe.private_bit = (hdr[2] >> 1) & 0x01;
-		aacframe.channel_configuration = ((hdr[2] & 0x1) << 2) | (hdr[3] >> 6);
-		aacframe.original_copy = (hdr[3] >> 5) & 0x01;
-		aacframe.home = (hdr[3] >> 4) & 0x01;
-		// parse adts_variable_header()
-		aacframe.copyrighted_id_bit = (hdr[3] >> 3) & 0x01;
-		aacframe.copyrighted_id_start = (hdr[3] >> 2) & 0x01; */
-    aacframe.aac_frame_length = ((hdr[3] & 0x3) << 11) | (hdr[4] << 3) | (hdr[5] >> 5);
-    /* 		aacframe.adts_buffer_fullness = ((hdr[5] & 0x1f) << 6) | (hdr[6] >> 2);
-		aacframe.number_of_raw_data_blocks_in_frame = hdr[6] & 0x03; */
+    if (fp_map_view(&p_ctx->map_, p_ctx->data_offset_, aacframe.aac_frame_length) < 0) {
+      break;
+    }
+    if (p_ctx->data_offset_ + aacframe.aac_frame_length > p_ctx->map_.size) {
+      // truncated last frame
+      rval = -2;
+      break;
+    }
 
     p_frame->type = h->type;
-    p_frame->ptr = p_ctx->data_buffer_ + p_ctx->data_offset_;
+    p_frame->ptr = p_ctx->map_.view + (p_ctx->data_offset_ - p_ctx->map_.view_offset);
+    p_frame->offset = p_ctx->data_offset_;
     p_frame->len = aacframe.aac_frame_length;
-
-    /* 		p_frame->u.audio.sampleRateHz = AacFrameSampleRateMap[aacframe.sampling_frequency_index]; */
+    p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+    aac_frame_info(p_frame, &aacframe);
+    memcpy(p_ctx->last_hdr_, p_frame->ptr, ADTS_HEADER_SIZE);
+    p_ctx->have_last_hdr_ = true;
+
+    uint32_t rate = AacFrameSampleRateMap[aacframe.sampling_frequency_index];
+    uint32_t samples = p_frame->u.audio.samples_per_channel;
+    if (rate != p_ctx->rate_) {
+      if (p_ctx->rate_) {
+        p_ctx->time_base_us_ += fp_ticks_to_us(p_ctx->samples_, p_ctx->rate_);
+      }
+      p_ctx->samples_ = 0;
+      p_ctx->rate_ = rate;
+    }
+    fp_frame_timing(p_frame, p_ctx->samples_, samples, rate);
+    p_frame->pts_us += p_ctx->time_base_us_;
+    p_ctx->samples_ += samples;
 
     p_ctx->data_offset_ += aacframe.aac_frame_length;
 
@@ -154,6 +381,28 @@ static int aac_obtain_frame(media_parser_t *h, frame_t *p_frame)
 
 static int aac_release_frame(media_parser_t *h, frame_t *p_frame)
 {
+  fp_map_unref((fp_map_window_t *)p_frame->p_priv);
+  p_frame->p_priv = NULL;
+  return 0;
+}
+
+static int aac_frame_at(media_parser_t *h, uint64_t offset, uint32_t len, frame_t *p_frame)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx || offset + len > p_ctx->map_.size || fp_map_view(&p_ctx->map_, offset, len) < 0) {
+    return -1;
+  }
+
+  p_frame->ptr = p_ctx->map_.view + (offset - p_ctx->map_.view_offset);
+  p_frame->offset = offset;
+  p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+  p_ctx->data_offset_ = offset + len;
+  // the header was checked when the index was built
+  if (len >= ADTS_HEADER_SIZE) {
+    AACAudioFrame aacframe;
+    aac_parse_adts(p_frame->ptr, &aacframe);
+    aac_frame_info(p_frame, &aacframe);
+  }
   return 0;
 }
 
@@ -167,6 +416,10 @@ static int aac_reset(media_parser_t *h)
     }
 
     p_ctx->data_offset_ = 0;
+    p_ctx->samples_ = 0;
+    p_ctx->rate_ = 0;
+    p_ctx->time_base_us_ = 0;
+    p_ctx->have_last_hdr_ = false;
     rval = 0;
   } while (0);
 
@@ -182,15 +435,7 @@ static int aac_close(media_parser_t *h)
       break;
     }
 
-    if (p_ctx->data_buffer_) {
-      munmap(p_ctx->data_buffer_, p_ctx->data_size_);
-      p_ctx->data_buffer_ = NULL;
-      p_ctx->data_size_ = 0;
-    }
-
-    if (p_ctx->fd_) {
-      close(p_ctx->fd_);
-    }
+    fp_map_close(&p_ctx->map_);
 
     free(p_ctx);
     h->p_ctx = NULL;
@@ -210,4 +455,5 @@ media_parser_t audio_parser_aac = {
   .release_frame = aac_release_frame,
   .reset = aac_reset,
   .close = aac_close,
+  .frame_at = aac_frame_at,
 };
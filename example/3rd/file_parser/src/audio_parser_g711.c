@@ -10,27 +10,22 @@
  *
  *************************************************************/
 
-#include <stdio.h>
 
 #include "file_parser.h"
 #include "file_parser_priv.h"
 
 typedef struct {
-  FILE *file;
-  size_t file_size;
+  uint64_t data_offset_;
+  fp_map_t map_;
   size_t g711_frame_len;
 } ctx_t;
 
-extern long get_file_size(FILE *f);
-
 static int g711_open(media_parser_t *h, const char *path)
 {
-  FILE *file = NULL;
-
-  file = fopen(path, "r");
-
-  if (!file) {
-    AGO_LOGE("open %s failed", path);
+  // g711 is always 8k sample rate and mono; compression ratio is 2:1
+  size_t frame_len = (8000 * h->parser_cfg.u.audio_cfg.framePeriodMs / 1000 * sizeof(int16_t) / 2);
+  if (frame_len == 0) {
+    AGO_LOGE("parser: invalid g711 config");
     return -1;
   }
 
@@ -39,13 +34,15 @@ static int g711_open(media_parser_t *h, const char *path)
     return -1;
   }
 
-  p_ctx->file = file;
-  p_ctx->file_size = get_file_size(file);
-  // g711 is always 8k sample rate and mono; compression ratio is 2:1
-  p_ctx->g711_frame_len = (8000 * h->parser_cfg.u.audio_cfg.framePeriodMs / 1000 * sizeof(int16_t) / 2);
+  if (fp_map_open(&p_ctx->map_, path, FP_MAP_WINDOW_SIZE) < 0) {
+    AGO_LOGE("open %s failed", path);
+    free(p_ctx);
+    return -1;
+  }
+  p_ctx->data_offset_ = 0;
+  p_ctx->g711_frame_len = frame_len;
 
   h->p_ctx = (void *)p_ctx;
-
   return 0;
 }
 
@@ -57,30 +54,44 @@ static int g711_obtain_frame(media_parser_t *h, frame_t *p_frame)
     return -1;
   }
 
-  if (feof(p_ctx->file)) {
-    return -2;
+  size_t len = p_ctx->g711_frame_len;
+  int ret = fp_map_view(&p_ctx->map_, p_ctx->data_offset_, len);
+  if (ret < 0) {
+    return ret;
   }
 
-  p_frame->ptr = malloc(p_ctx->g711_frame_len);
-  fread(p_frame->ptr, 1, p_ctx->g711_frame_len, p_ctx->file);
+  // the last frame of the file may be short
+  if (p_ctx->data_offset_ + len > p_ctx->map_.size) {
+    len = p_ctx->map_.size - p_ctx->data_offset_;
+  }
 
+  p_frame->ptr = p_ctx->map_.view + (p_ctx->data_offset_ - p_ctx->map_.view_offset);
+  p_frame->p_priv = fp_map_ref(&p_ctx->map_);
   p_frame->type = h->type;
-  p_frame->len = p_ctx->g711_frame_len;
+  p_frame->len = len;
+  p_frame->offset = p_ctx->data_offset_;
+  // one byte per sample
+  fp_frame_timing(p_frame, p_ctx->data_offset_, len, 8000);
+  p_ctx->data_offset_ += len;
 
   return 0;
 }
 
 static int g711_release_frame(media_parser_t *h, frame_t *p_frame)
 {
-  free(p_frame->ptr);
+  fp_map_unref((fp_map_window_t *)p_frame->p_priv);
+  p_frame->p_priv = NULL;
   return 0;
 }
 
 static int g711_reset(media_parser_t *h)
 {
   ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    return -1;
+  }
 
-  fseek(p_ctx->file, 0L, SEEK_SET);
+  p_ctx->data_offset_ = 0;
 
   return 0;
 }
@@ -88,8 +99,11 @@ static int g711_reset(media_parser_t *h)
 static int g711_close(media_parser_t *h)
 {
   ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    return -1;
+  }
 
-  fclose(p_ctx->file);
+  fp_map_close(&p_ctx->map_);
 
   free(p_ctx);
   h->p_ctx = NULL;
@@ -107,4 +121,4 @@ media_parser_t audio_parser_g711 = {
   .release_frame = g711_release_frame,
   .reset = g711_reset,
   .close = g711_close,
-};
+};
\ No newline at end of file
@@ -3,6 +3,9 @@
  * Date	 :	Oct 21th, 2020
  * Module:	Agora SD-RTN SDK RTC C API demo application.
  *
+ * Ogg Opus demuxer. Packets are handed out straight from the mapped
+ * page; only a packet continued across pages is put together in a
+ * buffer of its own.
  *
  * This is a part of the Agora RTC Service SDK.
  * Copyright (C) 2020 Agora IO
@@ -13,153 +16,346 @@
 #include "file_parser.h"
 #include "file_parser_priv.h"
 
-#if 0
-#include "string.h"
-#include "opusfile/opusfile.h"
+#include <string.h>
 
+#define OGG_PAGE_HEADER_SIZE 27
+#define OGG_FLAG_CONTINUED 0x01
+#define OGG_FLAG_BOS 0x02
+
+// Opus always runs its clock at 48 kHz
+#define OPUS_RATE 48000
+// RFC 6716: a packet holds at most 120 ms
+#define OPUS_MAX_PACKET_SAMPLES 5760
 
 typedef struct {
-  int current_packet;
-  int total_length;
+  // start of the next page
+  uint64_t data_offset_;
+  fp_map_t map_;
+  // stream being demuxed, taken from the OpusHead page
+  uint32_t serial_;
+  bool have_serial_;
+  // OpusHead and OpusTags still to skip
+  int header_packets_;
+
+  // page the packets come from
+  uint64_t page_offset_;
+  uint32_t page_len_;
+  uint64_t body_pos_; // next segment
+  int seg_cnt_;
+  int seg_idx_;
+  uint8_t lacing_[255];
+  // the page starts with the tail of a packet we don't have the head of
+  bool skip_continued_;
+
+  // head of a packet continued on the next page
+  uint8_t *join_;
+  uint32_t join_len_;
+  uint32_t join_cap_;
+
+  uint64_t samples_;
+  uint32_t last_samples_;
+} ctx_t;
+
+static inline uint32_t ogg_rl32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-  int nsamples;
-  int nchannels;
-  int format;
+// p_priv is the map window the packet points into, or, for a packet put
+// together from several pages, its malloc'd buffer tagged in the low bit
+static inline void *opus_joined_priv(uint8_t *buf)
+{
+  return (void *)((uintptr_t)buf | 1);
+}
 
-  unsigned char packet[960 * 2 * 2];
-  long bytes;
-  long b_o_s;
-  long e_o_s;
+static inline uint8_t *opus_priv_joined(void *p_priv)
+{
+  return ((uintptr_t)p_priv & 1) ? (uint8_t *)((uintptr_t)p_priv & ~(uintptr_t)1) : NULL;
+}
 
-  ogg_int64_t granulepos;
-  ogg_int64_t packetno;
-} decode_context;
+// Samples per channel at 48 kHz from the TOC byte (RFC 6716 3.1), 0 if invalid
+static uint32_t opus_packet_samples(const uint8_t *pkt, uint32_t len)
+{
+  // SILK: 10/20/40/60 ms, hybrid: 10/20 ms, CELT: 2.5/5/10/20 ms
+  static const uint16_t silk[4] = { 480, 960, 1920, 2880 };
+  static const uint16_t celt[4] = { 120, 240, 480, 960 };
+  uint32_t config, frame, frames;
 
-typedef struct opus_ctx {
-  OggOpusFile* oggOpusFile_;
-  decode_context decode_context_;
-} opus_ctx_t;
+  if (len < 1) {
+    return 0;
+  }
+  config = pkt[0] >> 3;
+  if (config < 12) {
+    frame = silk[config & 3];
+  } else if (config < 16) {
+    frame = silk[config & 1];
+  } else {
+    frame = celt[config & 3];
+  }
 
+  switch (pkt[0] & 3) {
+  case 0:
+    frames = 1;
+    break;
+  case 1:
+  case 2:
+    frames = 2;
+    break;
+  default:
+    // code 3: the frame count follows in the next byte
+    if (len < 2) {
+      return 0;
+    }
+    frames = pkt[1] & 0x3f;
+    break;
+  }
 
-int op_decode_cb(void* ctx, OpusMSDecoder* decoder, void* pcm, const ogg_packet* op, int nsamples,
-                 int nchannels, int format, int li) {
-  decode_context* context = (decode_context*)ctx;
-  context->nsamples = nsamples;
-  context->nchannels = nchannels;
-  context->format = format;
+  frame *= frames;
+  return frame <= OPUS_MAX_PACKET_SAMPLES ? frame : 0;
+}
 
-  context->b_o_s = op->b_o_s;
-  context->e_o_s = op->e_o_s;
-  context->bytes = op->bytes;
-  context->granulepos = op->granulepos;
-  context->packetno = op->packetno;
-  memcpy(context->packet, op->packet, op->bytes);
+static int opus_join(ctx_t *p_ctx, const uint8_t *data, uint32_t len)
+{
+  if (p_ctx->join_len_ + len > p_ctx->join_cap_) {
+    uint32_t cap = p_ctx->join_cap_ ? p_ctx->join_cap_ : 1024;
+    while (cap < p_ctx->join_len_ + len) {
+      cap *= 2;
+    }
+    uint8_t *buf = (uint8_t *)realloc(p_ctx->join_, cap);
+    if (!buf) {
+      return -1;
+    }
+    p_ctx->join_ = buf;
+    p_ctx->join_cap_ = cap;
+  }
+  memcpy(p_ctx->join_ + p_ctx->join_len_, data, len);
+  p_ctx->join_len_ += len;
+  return 0;
+}
 
-  context->total_length += op->bytes;
-  ++context->current_packet;
+// Make the page at data_offset_ the current one; -2 at the end of input
+static int opus_next_page(ctx_t *p_ctx)
+{
+  const uint8_t *hdr;
+  uint64_t offset = p_ctx->data_offset_;
+  uint32_t body_len = 0;
+  int ret, i;
+
+  while (1) {
+    ret = fp_map_view(&p_ctx->map_, offset, OGG_PAGE_HEADER_SIZE);
+    if (ret < 0) {
+      return ret;
+    }
+    if (offset + OGG_PAGE_HEADER_SIZE > p_ctx->map_.size) {
+      return -2;
+    }
+    hdr = p_ctx->map_.view + (offset - p_ctx->map_.view_offset);
+    if (memcmp(hdr, "OggS", 4) == 0 && hdr[4] == 0) {
+      break;
+    }
+    // lost sync: look for the next capture pattern
+    if (offset == p_ctx->data_offset_) {
+      AGO_LOGW("parser: no Ogg page at 0x%llx, resyncing", (unsigned long long)offset);
+    }
+    offset++;
+  }
+
+  int seg_cnt = hdr[26];
+  if (fp_map_view(&p_ctx->map_, offset, OGG_PAGE_HEADER_SIZE + seg_cnt) < 0) {
+    return -1;
+  }
+  if (offset + OGG_PAGE_HEADER_SIZE + seg_cnt > p_ctx->map_.size) {
+    return -2;
+  }
+  hdr = p_ctx->map_.view + (offset - p_ctx->map_.view_offset);
+  for (i = 0; i < seg_cnt; i++) {
+    p_ctx->lacing_[i] = hdr[OGG_PAGE_HEADER_SIZE + i];
+    body_len += p_ctx->lacing_[i];
+  }
 
-  (void)pcm;
-  (void)decoder;
-  (void)li;
+  uint8_t flags = hdr[5];
+  uint32_t serial = ogg_rl32(hdr + 14);
+  p_ctx->page_offset_ = offset;
+  p_ctx->page_len_ = OGG_PAGE_HEADER_SIZE + seg_cnt + body_len;
+  if (fp_map_view(&p_ctx->map_, offset, p_ctx->page_len_) < 0) {
+    return -1;
+  }
+  // a truncated last page
+  if (offset + p_ctx->page_len_ > p_ctx->map_.size) {
+    return -2;
+  }
+  p_ctx->data_offset_ = offset + p_ctx->page_len_;
+  p_ctx->body_pos_ = offset + OGG_PAGE_HEADER_SIZE + seg_cnt;
+  p_ctx->seg_cnt_ = seg_cnt;
+  p_ctx->seg_idx_ = 0;
+
+  // the first stream to start with OpusHead is the one we send
+  if (!p_ctx->have_serial_ && (flags & OGG_FLAG_BOS) && body_len >= 19 &&
+      memcmp(p_ctx->map_.view + (p_ctx->body_pos_ - p_ctx->map_.view_offset), "OpusHead", 8) == 0) {
+    p_ctx->serial_ = serial;
+    p_ctx->have_serial_ = true;
+  }
+  if (!p_ctx->have_serial_ || serial != p_ctx->serial_) {
+    p_ctx->seg_cnt_ = 0;
+    return 0;
+  }
 
+  // the head of a continued packet is gone, so is its tail
+  p_ctx->skip_continued_ = (flags & OGG_FLAG_CONTINUED) && p_ctx->join_len_ == 0;
+  if (!(flags & OGG_FLAG_CONTINUED) && p_ctx->join_len_) {
+    AGO_LOGW("parser: Ogg packet cut short at 0x%llx", (unsigned long long)offset);
+    p_ctx->join_len_ = 0;
+  }
   return 0;
 }
 
 static int opus_open(media_parser_t *h, const char *path)
 {
-  int ret = 0;
-  opus_ctx_t *p_ctx = (opus_ctx_t *)malloc(sizeof(opus_ctx_t));
+  ctx_t *p_ctx = (ctx_t *)calloc(1, sizeof(ctx_t));
   if (!p_ctx) {
     return -1;
   }
-  memset(p_ctx, 0, sizeof(opus_ctx_t));
-
-  p_ctx->oggOpusFile_ = op_open_file(path, &ret);
-  if (!p_ctx->oggOpusFile_) {
-    goto __tag_failed;
-  }
 
-  op_set_decode_callback(p_ctx->oggOpusFile_, op_decode_cb, &p_ctx->decode_context_);
-
-  const OpusHead* head = op_head(p_ctx->oggOpusFile_, -1);
-  if (head->channel_count != 1) {
-    AGO_LOGE("channel_count=%d\n", head->channel_count);
-    goto __tag_failed;
+  if (fp_map_open(&p_ctx->map_, path, FP_MAP_WINDOW_SIZE) < 0) {
+    AGO_LOGE("open %s failed", path);
+    free(p_ctx);
+    return -1;
   }
+  p_ctx->header_packets_ = 2;
 
   h->p_ctx = (void *)p_ctx;
-
-  AGO_LOGI("chnum=%d sample=%u\n", head->channel_count, head->input_sample_rate);
-
   return 0;
-
-__tag_failed:
-  if (p_ctx->oggOpusFile_) {
-    op_free(p_ctx->oggOpusFile_);
-    p_ctx->oggOpusFile_ = NULL;
-  }
-  free(p_ctx);
-  return -1;
 }
 
 static int opus_obtain_frame(media_parser_t *h, frame_t *p_frame)
 {
-  opus_ctx_t *p_ctx = (opus_ctx_t *)h->p_ctx;
-  if (!p_ctx || !p_ctx->oggOpusFile_) {
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
     AGO_LOGE("parser: invalid ctx");
     return -1;
   }
 
-  if (p_ctx->decode_context_.e_o_s) {
-    return -2;
-  }
-
-  opus_int16 pcm[120 * 48 * 2];
-  int ret = op_read_stereo(p_ctx->oggOpusFile_, pcm, sizeof(pcm) / sizeof(*pcm));
-  if (ret < 0) {
-    AGO_LOGE("read stereo failed\n");
-    return -2;
+  while (1) {
+    if (p_ctx->seg_idx_ >= p_ctx->seg_cnt_) {
+      int ret = opus_next_page(p_ctx);
+      if (ret < 0) {
+        return ret;
+      }
+      continue;
+    }
+
+    // keep the page in view; a frame handed out before may have moved it
+    if (fp_map_view(&p_ctx->map_, p_ctx->page_offset_, p_ctx->page_len_) < 0) {
+      return -1;
+    }
+
+    uint64_t start = p_ctx->body_pos_;
+    uint32_t len = 0;
+    bool complete = false;
+    while (p_ctx->seg_idx_ < p_ctx->seg_cnt_) {
+      uint8_t lacing = p_ctx->lacing_[p_ctx->seg_idx_++];
+      len += lacing;
+      if (lacing < 255) {
+        complete = true;
+        break;
+      }
+    }
+    p_ctx->body_pos_ += len;
+    const uint8_t *data = p_ctx->map_.view + (start - p_ctx->map_.view_offset);
+
+    if (p_ctx->skip_continued_) {
+      p_ctx->skip_continued_ = !complete;
+      continue;
+    }
+    if (!complete || p_ctx->join_len_) {
+      if (opus_join(p_ctx, data, len) < 0) {
+        return -1;
+      }
+      if (!complete) {
+        continue;
+      }
+    }
+
+    if (p_ctx->header_packets_ > 0) {
+      p_ctx->header_packets_--;
+      p_ctx->join_len_ = 0;
+      continue;
+    }
+
+    if (p_ctx->join_len_) {
+      // the buffer goes with the frame
+      p_frame->ptr = p_ctx->join_;
+      p_frame->len = p_ctx->join_len_;
+      p_frame->p_priv = opus_joined_priv(p_ctx->join_);
+      p_ctx->join_ = NULL;
+      p_ctx->join_len_ = 0;
+      p_ctx->join_cap_ = 0;
+    } else if (len == 0) {
+      // nothing to send in an empty packet
+      continue;
+    } else {
+      p_frame->ptr = (uint8_t *)data;
+      p_frame->len = len;
+      p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+    }
+
+    uint32_t samples = opus_packet_samples(p_frame->ptr, p_frame->len);
+    if (samples == 0) {
+      // a broken TOC: assume it lasts as long as the packet before
+      samples = p_ctx->last_samples_ ? p_ctx->last_samples_ : OPUS_RATE / 50;
+    }
+    p_ctx->last_samples_ = samples;
+
+    p_frame->type = h->type;
+    p_frame->offset = start;
+    p_frame->u.audio.samples_per_channel = samples;
+    fp_frame_timing(p_frame, p_ctx->samples_, samples, OPUS_RATE);
+    p_ctx->samples_ += samples;
+    return 0;
   }
-
-  p_frame->ptr = malloc(p_ctx->decode_context_.bytes);
-  memcpy(p_frame->ptr, p_ctx->decode_context_.packet, p_ctx->decode_context_.bytes);
-  p_frame->type = h->type;
-  p_frame->len = p_ctx->decode_context_.bytes;
-
-  return 0;
 }
 
 static int opus_release_frame(media_parser_t *h, frame_t *p_frame)
 {
-  free(p_frame->ptr);
+  uint8_t *joined = opus_priv_joined(p_frame->p_priv);
+  if (joined) {
+    free(joined);
+  } else {
+    fp_map_unref((fp_map_window_t *)p_frame->p_priv);
+  }
+  p_frame->p_priv = NULL;
   return 0;
 }
 
 static int opus_reset(media_parser_t *h)
 {
-  opus_ctx_t *p_ctx = (opus_ctx_t *)h->p_ctx;
-  if (!p_ctx || !p_ctx->oggOpusFile_) {
-    return -1;
-  }
-
-  if (op_pcm_seek(p_ctx->oggOpusFile_, 0)) {
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
     return -1;
   }
 
+  // the stream headers come around again
+  p_ctx->data_offset_ = 0;
+  p_ctx->have_serial_ = false;
+  p_ctx->header_packets_ = 2;
+  p_ctx->seg_cnt_ = 0;
+  p_ctx->seg_idx_ = 0;
+  p_ctx->skip_continued_ = false;
+  p_ctx->join_len_ = 0;
+  p_ctx->samples_ = 0;
   return 0;
 }
 
 static int opus_close(media_parser_t *h)
 {
-  opus_ctx_t *p_ctx = (opus_ctx_t *)h->p_ctx;
-
-  if (p_ctx && p_ctx->oggOpusFile_) {
-    op_free(p_ctx->oggOpusFile_);
-    p_ctx->oggOpusFile_ = NULL;
-  }
-  if (p_ctx) {
-    free(p_ctx);
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    return -1;
   }
+
+  fp_map_close(&p_ctx->map_);
+  free(p_ctx->join_);
+  free(p_ctx);
   h->p_ctx = NULL;
 
   return 0;
@@ -176,11 +372,3 @@ media_parser_t audio_parser_opus = {
   .reset = opus_reset,
   .close = opus_close,
 };
-
-#else
-media_parser_t audio_parser_opus = {
-  .codec = -1,
-  .name = "opus",
-  .p_ctx = NULL,
-};
-#endif
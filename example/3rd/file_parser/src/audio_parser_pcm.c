@@ -10,28 +10,27 @@
  *
  *************************************************************/
 
-#include <stdio.h>
 #include <string.h>
 
 #include "file_parser.h"
 #include "file_parser_priv.h"
 
 typedef struct {
-  FILE *file;
-  size_t file_size;
+  uint64_t data_offset_;
+  fp_map_t map_;
   size_t pcm_frame_len;
+  // bytes per sample over all channels
+  size_t sample_size_;
+  // last partial frame, zero padded when first reached
+  uint8_t *tail_frame_;
 } ctx_t;
 
-extern long get_file_size(FILE *f);
-
 static int pcm_open(media_parser_t *h, const char *path)
 {
-  FILE *file = NULL;
-
-  file = fopen(path, "r");
-
-  if (!file) {
-    AGO_LOGE("open %s failed", path);
+  size_t frame_len = (h->parser_cfg.u.audio_cfg.sampleRateHz * h->parser_cfg.u.audio_cfg.framePeriodMs / 1000 *
+                      h->parser_cfg.u.audio_cfg.numberOfChannels * sizeof(int16_t));
+  if (frame_len == 0) {
+    AGO_LOGE("parser: invalid pcm config");
     return -1;
   }
 
@@ -40,12 +39,17 @@ static int pcm_open(media_parser_t *h, const char *path)
     return -1;
   }
 
-  p_ctx->file = file;
-  p_ctx->file_size = get_file_size(file);
-  p_ctx->pcm_frame_len = (h->parser_cfg.u.audio_cfg.sampleRateHz * h->parser_cfg.u.audio_cfg.framePeriodMs / 1000 *
-                          h->parser_cfg.u.audio_cfg.numberOfChannels * sizeof(int16_t));
-  h->p_ctx = (void *)p_ctx;
+  if (fp_map_open(&p_ctx->map_, path, FP_MAP_WINDOW_SIZE) < 0) {
+    AGO_LOGE("open %s failed", path);
+    free(p_ctx);
+    return -1;
+  }
+  p_ctx->data_offset_ = 0;
+  p_ctx->pcm_frame_len = frame_len;
+  p_ctx->sample_size_ = h->parser_cfg.u.audio_cfg.numberOfChannels * sizeof(int16_t);
+  p_ctx->tail_frame_ = NULL;
 
+  h->p_ctx = (void *)p_ctx;
   return 0;
 }
 
@@ -57,37 +61,52 @@ static int pcm_obtain_frame(media_parser_t *h, frame_t *p_frame)
     return -1;
   }
 
-  if (feof(p_ctx->file)) {
-    return -2;
+  int ret = fp_map_view(&p_ctx->map_, p_ctx->data_offset_, p_ctx->pcm_frame_len);
+  if (ret < 0) {
+    return ret;
   }
 
-  p_frame->ptr = malloc(p_ctx->pcm_frame_len);
-  int ret = fread(p_frame->ptr, 1, p_ctx->pcm_frame_len, p_ctx->file);
-  if (ret != p_ctx->pcm_frame_len) {
-    if (ret <= 0) {
-      memset(p_frame->ptr, 0, p_ctx->pcm_frame_len);
-    } else {
-      memset(p_frame->ptr + ret, 0, p_ctx->pcm_frame_len - ret);
+  if (p_ctx->data_offset_ + p_ctx->pcm_frame_len <= p_ctx->map_.size) {
+    p_frame->ptr = p_ctx->map_.view + (p_ctx->data_offset_ - p_ctx->map_.view_offset);
+    p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+  } else {
+    if (!p_ctx->tail_frame_) {
+      size_t tail_len = p_ctx->map_.size - p_ctx->data_offset_;
+      p_ctx->tail_frame_ = (uint8_t *)calloc(1, p_ctx->pcm_frame_len);
+      if (!p_ctx->tail_frame_) {
+        return -2;
+      }
+      memcpy(p_ctx->tail_frame_, p_ctx->map_.view + (p_ctx->data_offset_ - p_ctx->map_.view_offset), tail_len);
     }
+    p_frame->ptr = p_ctx->tail_frame_;
+    p_frame->p_priv = NULL;
   }
 
   p_frame->type = h->type;
   p_frame->len = p_ctx->pcm_frame_len;
+  p_frame->offset = p_ctx->data_offset_;
+  fp_frame_timing(p_frame, p_ctx->data_offset_ / p_ctx->sample_size_, p_ctx->pcm_frame_len / p_ctx->sample_size_,
+                  h->parser_cfg.u.audio_cfg.sampleRateHz);
+  p_ctx->data_offset_ += p_ctx->pcm_frame_len;
 
   return 0;
 }
 
 static int pcm_release_frame(media_parser_t *h, frame_t *p_frame)
 {
-  free(p_frame->ptr);
+  fp_map_unref((fp_map_window_t *)p_frame->p_priv);
+  p_frame->p_priv = NULL;
   return 0;
 }
 
 static int pcm_reset(media_parser_t *h)
 {
   ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    return -1;
+  }
 
-  fseek(p_ctx->file, 0L, SEEK_SET);
+  p_ctx->data_offset_ = 0;
 
   return 0;
 }
@@ -95,9 +114,13 @@ static int pcm_reset(media_parser_t *h)
 static int pcm_close(media_parser_t *h)
 {
   ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    return -1;
+  }
 
-  fclose(p_ctx->file);
+  fp_map_close(&p_ctx->map_);
 
+  free(p_ctx->tail_frame_);
   free(p_ctx);
   h->p_ctx = NULL;
 
@@ -0,0 +1,385 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * RIFF/WAVE demuxer. The sample format, rate and channel count come from
+ * the fmt chunk rather than the parser config; frames of framePeriodMs
+ * are handed out from the mapped data chunk, optionally converted to
+ * int16.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file_parser.h"
+#include "file_parser_priv.h"
+
+#define WAV_RIFF_HEADER_SIZE 12
+#define WAV_CHUNK_HEADER_SIZE 8
+#define WAV_FMT_MIN_SIZE 16
+// cbSize, wValidBitsPerSample, dwChannelMask and the sub-format GUID
+#define WAV_FMT_EXTENSIBLE_SIZE 40
+
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_IEEE_FLOAT 3
+#define WAV_FORMAT_ALAW 6
+#define WAV_FORMAT_MULAW 7
+#define WAV_FORMAT_EXTENSIBLE 0xfffe
+
+#define WAV_DEFAULT_FRAME_PERIOD_MS 20
+
+// A conversion buffer of frame_samples_ * channels_ samples
+typedef struct wav_buf_s {
+  struct wav_buf_s *next;
+  int16_t samples[];
+} wav_buf_t;
+
+typedef struct {
+  uint64_t data_offset_;
+  fp_map_t map_;
+  // the data chunk
+  uint64_t data_start_;
+  uint64_t data_end_;
+  int sample_rate_;
+  int channels_;
+  int bits_;
+  bool is_float_;
+  // bytes per sample over all channels
+  uint32_t block_align_;
+  uint32_t frame_samples_;
+  // frames are converted into a buffer from free_bufs_, which p_priv then
+  // holds until the frame is released. Prefetch releases frames on another
+  // thread, and keeps several out at once; buffers are only allocated when
+  // more frames are out than ever before.
+  bool convert_;
+  pthread_mutex_t buf_lock_;
+  wav_buf_t *free_bufs_;
+} ctx_t;
+
+static wav_buf_t *wav_buf_alloc(ctx_t *p_ctx)
+{
+  return (wav_buf_t *)malloc(sizeof(wav_buf_t) + (size_t)p_ctx->frame_samples_ * p_ctx->channels_ * sizeof(int16_t));
+}
+
+static wav_buf_t *wav_buf_get(ctx_t *p_ctx)
+{
+  wav_buf_t *buf;
+
+  pthread_mutex_lock(&p_ctx->buf_lock_);
+  buf = p_ctx->free_bufs_;
+  if (buf) {
+    p_ctx->free_bufs_ = buf->next;
+  }
+  pthread_mutex_unlock(&p_ctx->buf_lock_);
+  return buf ? buf : wav_buf_alloc(p_ctx);
+}
+
+static void wav_buf_put(ctx_t *p_ctx, wav_buf_t *buf)
+{
+  pthread_mutex_lock(&p_ctx->buf_lock_);
+  buf->next = p_ctx->free_bufs_;
+  p_ctx->free_bufs_ = buf;
+  pthread_mutex_unlock(&p_ctx->buf_lock_);
+}
+
+static inline uint16_t wav_rl16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t wav_rl32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool fp_wav_is_wav(const char *path)
+{
+  uint8_t hdr[WAV_RIFF_HEADER_SIZE];
+  bool is_wav = false;
+  int fd;
+
+  if (fp_map_path_is_stream(path)) {
+    return false;
+  }
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  if (read(fd, hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr)) {
+    is_wav = memcmp(hdr, "RIFF", 4) == 0 && memcmp(hdr + 8, "WAVE", 4) == 0;
+  }
+  close(fd);
+  return is_wav;
+}
+
+static int wav_parse_fmt(media_parser_t *h, ctx_t *p_ctx, const uint8_t *fmt, uint32_t size)
+{
+  int format = wav_rl16(fmt);
+  bool ok;
+
+  p_ctx->channels_ = wav_rl16(fmt + 2);
+  p_ctx->sample_rate_ = (int)wav_rl32(fmt + 4);
+  p_ctx->block_align_ = wav_rl16(fmt + 12);
+  p_ctx->bits_ = wav_rl16(fmt + 14);
+
+  // WAVE_FORMAT_EXTENSIBLE carries the real format in the first two bytes of
+  // its sub-format GUID
+  if (format == WAV_FORMAT_EXTENSIBLE) {
+    if (size < WAV_FMT_EXTENSIBLE_SIZE) {
+      AGO_LOGE("parser: truncated WAVE_FORMAT_EXTENSIBLE header");
+      return -1;
+    }
+    format = wav_rl16(fmt + 24);
+  }
+
+  if (h->codec == MEDIA_FILE_TYPE_G711) {
+    ok = (format == WAV_FORMAT_ALAW || format == WAV_FORMAT_MULAW) && p_ctx->bits_ == 8;
+    // the header knows the law better than the caller
+    h->parser_cfg.u.audio_cfg.g711Ulaw = format == WAV_FORMAT_MULAW;
+  } else {
+    ok = (format == WAV_FORMAT_PCM && (p_ctx->bits_ == 16 || p_ctx->bits_ == 24 || p_ctx->bits_ == 32)) ||
+         (format == WAV_FORMAT_IEEE_FLOAT && p_ctx->bits_ == 32);
+  }
+  if (!ok) {
+    AGO_LOGE("parser: wav format %d with %d bits can't be read as %s", format, p_ctx->bits_,
+             h->codec == MEDIA_FILE_TYPE_G711 ? "g711" : "pcm");
+    return -1;
+  }
+  p_ctx->is_float_ = format == WAV_FORMAT_IEEE_FLOAT;
+
+  if (p_ctx->channels_ <= 0 || p_ctx->sample_rate_ <= 0 ||
+      p_ctx->block_align_ != (uint32_t)p_ctx->channels_ * p_ctx->bits_ / 8) {
+    AGO_LOGE("parser: invalid wav header: %d Hz, %d channels, block align %u", p_ctx->sample_rate_, p_ctx->channels_,
+             p_ctx->block_align_);
+    return -1;
+  }
+  return 0;
+}
+
+static int wav_open(media_parser_t *h, const char *path)
+{
+  int *cfg_rate = &h->parser_cfg.u.audio_cfg.sampleRateHz;
+  int *cfg_channels = &h->parser_cfg.u.audio_cfg.numberOfChannels;
+  uint64_t pos = WAV_RIFF_HEADER_SIZE;
+  bool have_fmt = false;
+  int period_ms;
+
+  ctx_t *p_ctx = (ctx_t *)calloc(1, sizeof(ctx_t));
+  if (!p_ctx) {
+    return -1;
+  }
+
+  if (fp_map_open(&p_ctx->map_, path, FP_MAP_WINDOW_SIZE) < 0) {
+    AGO_LOGE("open %s failed", path);
+    free(p_ctx);
+    return -1;
+  }
+  if (p_ctx->map_.stream) {
+    AGO_LOGE("parser: wav can't be read from a stream");
+    goto fail;
+  }
+
+  // chunks up to data, which runs to the end of the file when its size is
+  // left open or overstated
+  for (;;) {
+    const uint8_t *chunk;
+    uint32_t chunk_size;
+
+    if (fp_map_view(&p_ctx->map_, pos, WAV_CHUNK_HEADER_SIZE) < 0 ||
+        pos + WAV_CHUNK_HEADER_SIZE > p_ctx->map_.size) {
+      AGO_LOGE("parser: no data chunk in %s", path);
+      goto fail;
+    }
+    chunk = p_ctx->map_.view + (pos - p_ctx->map_.view_offset);
+    chunk_size = wav_rl32(chunk + 4);
+
+    if (memcmp(chunk, "data", 4) == 0) {
+      if (!have_fmt) {
+        AGO_LOGE("parser: wav data before its fmt chunk");
+        goto fail;
+      }
+      p_ctx->data_start_ = pos + WAV_CHUNK_HEADER_SIZE;
+      p_ctx->data_end_ = p_ctx->data_start_ + chunk_size;
+      if (chunk_size == 0 || chunk_size == UINT32_MAX || p_ctx->data_end_ > p_ctx->map_.size) {
+        p_ctx->data_end_ = p_ctx->map_.size;
+      }
+      break;
+    }
+    if (memcmp(chunk, "fmt ", 4) == 0) {
+      if (chunk_size < WAV_FMT_MIN_SIZE || fp_map_view(&p_ctx->map_, pos, WAV_CHUNK_HEADER_SIZE + chunk_size) < 0 ||
+          pos + WAV_CHUNK_HEADER_SIZE + chunk_size > p_ctx->map_.size) {
+        AGO_LOGE("parser: truncated wav fmt chunk");
+        goto fail;
+      }
+      chunk = p_ctx->map_.view + (pos - p_ctx->map_.view_offset);
+      if (wav_parse_fmt(h, p_ctx, chunk + WAV_CHUNK_HEADER_SIZE, chunk_size) < 0) {
+        goto fail;
+      }
+      have_fmt = true;
+    }
+    // chunks are padded to an even size
+    pos += WAV_CHUNK_HEADER_SIZE + (uint64_t)chunk_size + (chunk_size & 1);
+  }
+
+  if ((*cfg_rate && *cfg_rate != p_ctx->sample_rate_) || (*cfg_channels && *cfg_channels != p_ctx->channels_)) {
+    AGO_LOGW("parser: %s is %d Hz, %d channels; ignoring the configured %d Hz, %d channels", path,
+             p_ctx->sample_rate_, p_ctx->channels_, *cfg_rate, *cfg_channels);
+  }
+  *cfg_rate = p_ctx->sample_rate_;
+  *cfg_channels = p_ctx->channels_;
+
+  period_ms = h->parser_cfg.u.audio_cfg.framePeriodMs;
+  if (period_ms <= 0) {
+    period_ms = WAV_DEFAULT_FRAME_PERIOD_MS;
+  }
+  p_ctx->frame_samples_ = (uint32_t)((uint64_t)p_ctx->sample_rate_ * period_ms / 1000);
+  if (p_ctx->frame_samples_ == 0) {
+    p_ctx->frame_samples_ = 1;
+  }
+  p_ctx->convert_ = h->parser_cfg.u.audio_cfg.convertToInt16 && h->codec == MEDIA_FILE_TYPE_PCM &&
+                    (p_ctx->bits_ != 16 || p_ctx->is_float_);
+  p_ctx->data_offset_ = p_ctx->data_start_;
+  pthread_mutex_init(&p_ctx->buf_lock_, NULL);
+  if (p_ctx->convert_) {
+    p_ctx->free_bufs_ = wav_buf_alloc(p_ctx);
+    if (!p_ctx->free_bufs_) {
+      pthread_mutex_destroy(&p_ctx->buf_lock_);
+      goto fail;
+    }
+    p_ctx->free_bufs_->next = NULL;
+  }
+
+  AGO_LOGI("parser: wav %d Hz, %d channels, %d bit%s%s", p_ctx->sample_rate_, p_ctx->channels_, p_ctx->bits_,
+           p_ctx->is_float_ ? " float" : "", p_ctx->convert_ ? ", converted to 16 bit" : "");
+
+  h->p_ctx = (void *)p_ctx;
+  return 0;
+
+fail:
+  fp_map_close(&p_ctx->map_);
+  free(p_ctx);
+  return -1;
+}
+
+static int wav_obtain_frame(media_parser_t *h, frame_t *p_frame)
+{
+  uint64_t offset, len;
+  uint32_t samples;
+  const uint8_t *src;
+  int ret;
+
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    AGO_LOGE("parser: invalid ctx");
+    return -1;
+  }
+
+  offset = p_ctx->data_offset_;
+  // a trailing partial sample is dropped; the last frame may be short
+  samples = p_ctx->frame_samples_;
+  if ((p_ctx->data_end_ - offset) / p_ctx->block_align_ < samples) {
+    samples = (uint32_t)((p_ctx->data_end_ - offset) / p_ctx->block_align_);
+  }
+  if (samples == 0) {
+    return -2;
+  }
+  len = (uint64_t)samples * p_ctx->block_align_;
+
+  ret = fp_map_view(&p_ctx->map_, offset, len);
+  if (ret < 0) {
+    return ret;
+  }
+  src = p_ctx->map_.view + (offset - p_ctx->map_.view_offset);
+
+  if (p_ctx->convert_) {
+    size_t count = (size_t)samples * p_ctx->channels_;
+    wav_buf_t *buf = wav_buf_get(p_ctx);
+    if (!buf) {
+      return -1;
+    }
+    fp_pcm_to_s16(src, p_ctx->bits_, p_ctx->is_float_, buf->samples, count);
+    p_frame->ptr = (uint8_t *)buf->samples;
+    p_frame->len = (uint32_t)(count * sizeof(int16_t));
+    p_frame->p_priv = buf;
+    p_frame->u.audio.bits_per_sample = 16;
+    p_frame->u.audio.is_float = false;
+  } else {
+    p_frame->ptr = (uint8_t *)src;
+    p_frame->len = (uint32_t)len;
+    p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+    p_frame->u.audio.bits_per_sample = h->codec == MEDIA_FILE_TYPE_PCM ? p_ctx->bits_ : 0;
+    p_frame->u.audio.is_float = p_ctx->is_float_;
+  }
+
+  p_frame->type = h->type;
+  p_frame->offset = offset;
+  p_frame->u.audio.samples_per_channel = samples;
+  fp_frame_timing(p_frame, (offset - p_ctx->data_start_) / p_ctx->block_align_, samples, p_ctx->sample_rate_);
+  p_ctx->data_offset_ = offset + len;
+
+  return 0;
+}
+
+static int wav_release_frame(media_parser_t *h, frame_t *p_frame)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+
+  if (p_ctx && p_ctx->convert_) {
+    wav_buf_put(p_ctx, (wav_buf_t *)p_frame->p_priv);
+  } else {
+    fp_map_unref((fp_map_window_t *)p_frame->p_priv);
+  }
+  p_frame->p_priv = NULL;
+  return 0;
+}
+
+static int wav_reset(media_parser_t *h)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    return -1;
+  }
+
+  p_ctx->data_offset_ = p_ctx->data_start_;
+  return 0;
+}
+
+static int wav_close(media_parser_t *h)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    return -1;
+  }
+
+  fp_map_close(&p_ctx->map_);
+  while (p_ctx->free_bufs_) {
+    wav_buf_t *next = p_ctx->free_bufs_->next;
+    free(p_ctx->free_bufs_);
+    p_ctx->free_bufs_ = next;
+  }
+  pthread_mutex_destroy(&p_ctx->buf_lock_);
+
+  free(p_ctx);
+  h->p_ctx = NULL;
+
+  return 0;
+}
+
+// Not in the codec table: create_file_parser picks it by content
+media_parser_t audio_parser_wav = {
+  .codec = -1,
+  .name = "wav",
+  .p_ctx = NULL,
+
+  .open = wav_open,
+  .obtain_frame = wav_obtain_frame,
+  .release_frame = wav_release_frame,
+  .reset = wav_reset,
+  .close = wav_close,
+};
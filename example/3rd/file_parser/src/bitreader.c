@@ -0,0 +1,158 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * MSB-first bit reader with exp-Golomb decoding. Bits are served from
+ * a 64-bit cache refilled a word at a time; NAL payloads are read
+ * with their emulation prevention bytes dropped on the fly.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <string.h>
+
+#include "file_parser_priv.h"
+
+#define BR_BYTES(b) (0x0101010101010101ULL * (b))
+
+static inline uint64_t br_load_be64(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+// any byte of v equal to 0x03, i.e. a possible emulation prevention byte
+static inline bool br_has_03(uint64_t v)
+{
+  v ^= BR_BYTES(0x03);
+  return ((v - BR_BYTES(0x01)) & ~v & BR_BYTES(0x80)) != 0;
+}
+
+static void br_overrun(fp_bitreader_t *br)
+{
+  br->overrun = true;
+  br->buf = br->end;
+  br->cache = 0;
+  br->bits = 0;
+}
+
+// Top the cache up to at least 56 bits, or to what is left. With 8 bytes
+// ahead a whole word is loaded and only the bytes that fit fully are
+// consumed; the partly loaded one comes back at the same spot next time.
+static void br_refill(fp_bitreader_t *br)
+{
+  if (br->end - br->buf >= 8) {
+    uint64_t v = br_load_be64(br->buf);
+    if (!br->escaped || !br_has_03(v)) {
+      int n = (63 - br->bits) >> 3;
+      if (br->escaped && n > 0) {
+        // zero bytes at the end of what is consumed, for the next 00 00 03
+        uint64_t used = v >> (64 - 8 * n);
+        br->zeros = used ? __builtin_ctzll(used) >> 3 : br->zeros + n;
+      }
+      br->cache |= v >> br->bits;
+      br->buf += n;
+      br->bits |= 56;
+      return;
+    }
+  }
+
+  while (br->bits <= 56 && br->buf < br->end) {
+    uint8_t b = *br->buf++;
+    // 00 00 03 is an emulation prevention byte, dropped from the payload
+    if (br->escaped && br->zeros >= 2 && b == 0x03) {
+      br->zeros = 0;
+      continue;
+    }
+    br->zeros = b ? 0 : br->zeros + 1;
+    br->cache |= (uint64_t)b << (56 - br->bits);
+    br->bits += 8;
+  }
+}
+
+void fp_br_init(fp_bitreader_t *br, const uint8_t *buf, int size)
+{
+  br->buf = buf;
+  br->end = buf + (size > 0 ? size : 0);
+  br->cache = 0;
+  br->bits = 0;
+  br->zeros = 0;
+  br->escaped = false;
+  br->overrun = false;
+}
+
+void fp_br_init_nal(fp_bitreader_t *br, const uint8_t *buf, int size)
+{
+  fp_br_init(br, buf, size);
+  br->escaped = true;
+}
+
+uint32_t fp_br_read(fp_bitreader_t *br, int n)
+{
+  uint32_t val;
+
+  if (n <= 0) {
+    return 0;
+  }
+  if (br->bits < n) {
+    br_refill(br);
+    if (br->bits < n) {
+      br_overrun(br);
+      return 0;
+    }
+  }
+  val = (uint32_t)(br->cache >> (64 - n));
+  br->cache <<= n;
+  br->bits -= n;
+  return val;
+}
+
+void fp_br_skip(fp_bitreader_t *br, int n)
+{
+  while (n > 32) {
+    fp_br_read(br, 32);
+    n -= 32;
+  }
+  fp_br_read(br, n);
+}
+
+uint32_t fp_br_ue(fp_bitreader_t *br)
+{
+  int leading_zeros, n;
+
+  if (br->bits < 32) {
+    br_refill(br);
+  }
+
+  // the whole code is in the cache: one clz and one shift
+  leading_zeros = br->cache ? __builtin_clzll(br->cache) : 64;
+  n = 2 * leading_zeros + 1;
+  if (n <= br->bits) {
+    uint32_t val = (uint32_t)((br->cache >> (64 - n)) - 1);
+    br->cache <<= n;
+    br->bits -= n;
+    return val;
+  }
+
+  // near the end of the data, or longer than the cache holds
+  leading_zeros = 0;
+  while (fp_br_read(br, 1) == 0) {
+    if (br->overrun || ++leading_zeros > 31) {
+      br_overrun(br);
+      return 0;
+    }
+  }
+  return ((1u << leading_zeros) - 1) + fp_br_read(br, leading_zeros);
+}
+
+int32_t fp_br_se(fp_bitreader_t *br)
+{
+  uint32_t k = fp_br_ue(br);
+  return (k & 1) ? (int32_t)((k + 1) >> 1) : -(int32_t)(k >> 1);
+}
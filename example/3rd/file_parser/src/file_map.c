@@ -0,0 +1,309 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * Sliding-window file mapping for the mmap based parsers. Only a
+ * fixed-size window of the file is mapped at a time; it moves forward
+ * as the parser cursor advances. Frames handed out keep a reference
+ * on the window they point into, so a window stays mapped until the
+ * last frame inside it is released.
+ *
+ * Pipes, FIFOs and stdin ("-") can't be mapped; for those the window
+ * is a heap buffer that is refilled with read() as the cursor moves.
+ * The bytes still ahead of the cursor are moved to the front of the
+ * buffer, which is reused unless a frame still points into it.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_parser_priv.h"
+
+#define FP_STREAM_BUFFER_SIZE (1024 * 1024)
+
+struct fp_map_window_s {
+  uint8_t *base;
+  size_t len;
+  // heap buffer of a stream rather than a mapping
+  bool heap;
+  atomic_int refs;
+};
+
+static void map_window_put(fp_map_window_t *win)
+{
+  if (win && atomic_fetch_sub(&win->refs, 1) == 1) {
+    if (win->heap) {
+      free(win->base);
+    } else {
+      munmap(win->base, win->len);
+    }
+    free(win);
+  }
+}
+
+static int map_window_move(fp_map_t *m, uint64_t offset, uint64_t len)
+{
+  static long page_size = 0;
+  fp_map_window_t *win;
+  uint64_t start, map_len;
+  void *mapped;
+
+  if (page_size <= 0) {
+    page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0) {
+      page_size = 4096;
+    }
+  }
+
+  if (m->window_size == 0) {
+    start = 0;
+    map_len = m->size;
+  } else {
+    start = offset - offset % page_size;
+    map_len = offset + len - start;
+    if (map_len < m->window_size) {
+      map_len = m->window_size;
+    }
+    if (start + map_len > m->size) {
+      map_len = m->size - start;
+    }
+  }
+  if (map_len == 0 || map_len > SIZE_MAX) {
+    return -1;
+  }
+
+  mapped = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, m->fd, start);
+  if (mapped == MAP_FAILED) {
+    AGO_LOGE("parser: mmap failed, offset=%llu len=%llu", (unsigned long long)start, (unsigned long long)map_len);
+    return -1;
+  }
+  posix_madvise(mapped, map_len, POSIX_MADV_SEQUENTIAL);
+
+  win = (fp_map_window_t *)malloc(sizeof(fp_map_window_t));
+  if (!win) {
+    munmap(mapped, map_len);
+    return -1;
+  }
+  win->base = (uint8_t *)mapped;
+  win->len = map_len;
+  win->heap = false;
+  atomic_init(&win->refs, 1);
+
+  // the map's own reference on the old window goes away; frames still
+  // pointing into it keep it mapped
+  map_window_put(m->cur);
+  m->cur = win;
+  m->view = win->base;
+  m->view_offset = start;
+  m->view_len = map_len;
+  return 0;
+}
+
+static fp_map_window_t *stream_buffer_new(size_t len)
+{
+  fp_map_window_t *win = (fp_map_window_t *)malloc(sizeof(fp_map_window_t));
+  if (!win) {
+    return NULL;
+  }
+  win->base = (uint8_t *)malloc(len);
+  if (!win->base) {
+    free(win);
+    return NULL;
+  }
+  win->len = len;
+  win->heap = true;
+  atomic_init(&win->refs, 1);
+  return win;
+}
+
+// Make [offset, end) available in the stream buffer, reading as needed. Bytes
+// before offset are dropped; the input can't go backwards.
+static int stream_fill(fp_map_t *m, uint64_t offset, uint64_t end)
+{
+  fp_map_window_t *win = m->cur;
+  uint64_t filled_end = m->view_offset + m->view_len;
+  uint64_t keep_from;
+  size_t keep, need, filled;
+
+  if (offset < m->view_offset) {
+    AGO_LOGE("parser: stream input can't go back to offset %llu", (unsigned long long)offset);
+    return -1;
+  }
+  if (end <= filled_end || filled_end >= m->size) {
+    return 0;
+  }
+
+  keep_from = offset < filled_end ? offset : filled_end;
+  keep = filled_end - keep_from;
+  need = end - keep_from;
+
+  if (atomic_load(&win->refs) == 1 && need <= win->len) {
+    // nobody else looks at the buffer: slide the unread tail to the front
+    if (keep && keep_from != m->view_offset) {
+      memmove(win->base, win->base + (keep_from - m->view_offset), keep);
+    }
+  } else {
+    // frames still point into the old buffer, or it's too small
+    size_t len = win->len;
+    while (len < need) {
+      len *= 2;
+    }
+    fp_map_window_t *next = stream_buffer_new(len);
+    if (!next) {
+      return -1;
+    }
+    memcpy(next->base, win->base + (keep_from - m->view_offset), keep);
+    map_window_put(win);
+    m->cur = win = next;
+  }
+  m->view = win->base;
+  m->view_offset = keep_from;
+  m->view_len = keep;
+
+  filled = keep;
+  while (filled < need) {
+    ssize_t n = read(m->fd, win->base + filled, win->len - filled);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      AGO_LOGE("parser: read failed, errno=%d", errno);
+      return -1;
+    }
+    if (n == 0) {
+      m->size = keep_from + filled;
+      break;
+    }
+    filled += n;
+  }
+  m->view_len = filled;
+  return 0;
+}
+
+bool fp_map_path_is_stream(const char *path)
+{
+  struct stat sb;
+  return strcmp(path, "-") == 0 || (stat(path, &sb) == 0 && !S_ISREG(sb.st_mode));
+}
+
+int fp_map_open(fp_map_t *m, const char *path, uint64_t window_size)
+{
+  struct stat sb;
+
+  m->cur = NULL;
+  m->view = NULL;
+  m->view_offset = 0;
+  m->view_len = 0;
+  m->stream = false;
+
+  m->fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY);
+  if (m->fd < 0) {
+    return -1;
+  }
+  if (fstat(m->fd, &sb) == -1) {
+    close(m->fd);
+    m->fd = -1;
+    return -1;
+  }
+
+  if (!S_ISREG(sb.st_mode)) {
+    // the size is learned when the input ends
+    m->stream = true;
+    m->size = UINT64_MAX;
+    m->window_size = 0;
+    m->cur = stream_buffer_new(FP_STREAM_BUFFER_SIZE);
+    if (!m->cur) {
+      close(m->fd);
+      m->fd = -1;
+      return -1;
+    }
+    m->view = m->cur->base;
+    return 0;
+  }
+
+  if (sb.st_size <= 0) {
+    close(m->fd);
+    m->fd = -1;
+    return -1;
+  }
+  m->size = sb.st_size;
+  // small files are mapped in one piece, exactly as before
+  m->window_size = (window_size == 0 || m->size <= window_size) ? 0 : window_size;
+
+  if (map_window_move(m, 0, 0) < 0) {
+    close(m->fd);
+    m->fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+int fp_map_view(fp_map_t *m, uint64_t offset, uint64_t len)
+{
+  if (len == 0) {
+    len = 1;
+  }
+  if (m->stream && stream_fill(m, offset, offset + len) < 0) {
+    return -1;
+  }
+  if (offset >= m->size) {
+    return -2;
+  }
+  if (offset + len > m->size) {
+    len = m->size - offset;
+  }
+
+  if (offset >= m->view_offset && offset + len <= m->view_offset + m->view_len) {
+    return 0;
+  }
+  return map_window_move(m, offset, len);
+}
+
+int fp_map_grow(fp_map_t *m, uint64_t offset)
+{
+  uint64_t end = m->view_offset + m->view_len;
+
+  if (offset < m->view_offset || offset >= end) {
+    return fp_map_view(m, offset, 0);
+  }
+  if (m->stream) {
+    // whatever the next read brings is enough to retry
+    return stream_fill(m, offset, end + 1);
+  }
+  return fp_map_view(m, offset, 2 * (end - offset));
+}
+
+fp_map_window_t *fp_map_ref(fp_map_t *m)
+{
+  if (m->cur) {
+    atomic_fetch_add(&m->cur->refs, 1);
+  }
+  return m->cur;
+}
+
+void fp_map_unref(fp_map_window_t *win)
+{
+  map_window_put(win);
+}
+
+void fp_map_close(fp_map_t *m)
+{
+  map_window_put(m->cur);
+  m->cur = NULL;
+  m->view = NULL;
+  m->view_len = 0;
+
+  if (m->fd >= 0) {
+    close(m->fd);
+    m->fd = -1;
+  }
+}
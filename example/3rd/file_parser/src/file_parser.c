@@ -11,6 +11,7 @@
  *************************************************************/
 
 #include <string.h>
+#include <time.h>
 
 #include "file_parser_priv.h"
 
@@ -18,6 +19,7 @@ extern media_parser_t video_parser_h264;
 extern media_parser_t video_parser_jpeg;
 extern media_parser_t video_parser_h265;
 extern media_parser_t video_parser_yuv420;
+extern media_parser_t video_parser_ivf;
 extern media_parser_t audio_parser_opus;
 extern media_parser_t audio_parser_aac;
 extern media_parser_t audio_parser_pcm;
@@ -26,72 +28,577 @@ extern media_parser_t audio_parser_g722;
 
 static media_parser_t *gs_media_parser_tab[] = { &video_parser_h264, &video_parser_jpeg, &video_parser_h265, &video_parser_yuv420,
                                                  &audio_parser_aac,  &audio_parser_pcm,  &audio_parser_g711, &audio_parser_g722,
-                                                 &audio_parser_opus, };
+                                                 &audio_parser_opus, &video_parser_ivf, };
 static int gs_media_parser_cnt = sizeof(gs_media_parser_tab) / sizeof(gs_media_parser_tab[0]);
 
+#define FP_BATCH_CLOCK_STRIDE 8
+
+const media_parser_t *fp_parser_at(int i)
+{
+  return (i >= 0 && i < gs_media_parser_cnt) ? gs_media_parser_tab[i] : NULL;
+}
+
+// A file that doesn't start with its parameter sets, served from a loaded
+// index, is never parsed; take them from the first access unit carrying them
+static void parser_prime_param_sets(media_parser_t *parser)
+{
+  frame_t frame;
+  uint32_t i;
+
+  if (!fp_is_video_codec(parser->codec) || !parser->parser_cfg.u.video_cfg.prepend_param_sets || !parser->p_index ||
+      parser->ps_cache.has_sps) {
+    return;
+  }
+  for (i = 0; i < parser->p_index->count; i++) {
+    fp_index_entry_t *e = &parser->p_index->entries[i];
+    if (!(e->flags & FP_INDEX_FLAG_PARAM_SETS)) {
+      continue;
+    }
+    memset(&frame, 0, sizeof(frame));
+    if (parser->frame_at(parser, e->offset, e->len, &frame) == 0) {
+      fp_annexb_cache_param_sets(frame.ptr, e->len, parser->codec == MEDIA_FILE_TYPE_H265, &parser->ps_cache);
+      parser->release_frame(parser, &frame);
+    }
+    break;
+  }
+}
+
 void *create_file_parser(media_file_type_e type, const char *path, parser_cfg_t *p_parser_cfg)
 {
+  const media_parser_t *tmpl = NULL;
   int i;
-  for (i = 0; i < gs_media_parser_cnt; i++) {
+
+  // a container serves whichever of its tracks has the codec asked for
+  if (fp_mp4_is_mp4(path)) {
+    tmpl = &media_parser_mp4;
+  } else if ((type == MEDIA_FILE_TYPE_PCM || type == MEDIA_FILE_TYPE_G711) && fp_wav_is_wav(path)) {
+    tmpl = &audio_parser_wav;
+  }
+  for (i = 0; !tmpl && i < gs_media_parser_cnt; i++) {
     if (type == gs_media_parser_tab[i]->codec) {
-      break;
+      tmpl = gs_media_parser_tab[i];
     }
   }
 
-  if (i == gs_media_parser_cnt) {
+  if (!tmpl) {
     // type not found, return NULL
     AGO_LOGE("Can't find the file parser matching type %d", type);
     return NULL;
   }
 
-  AGO_LOGI("File parser found: %s", gs_media_parser_tab[i]->name);
+  AGO_LOGI("File parser found: %s", tmpl->name);
 
   // type found, now create the File parser
   media_parser_t *parser = (media_parser_t *)malloc(sizeof(media_parser_t));
   if (parser == NULL) {
     return NULL;
   }
-  memcpy(parser, gs_media_parser_tab[i], sizeof(media_parser_t));
+  memcpy(parser, tmpl, sizeof(media_parser_t));
+  parser->codec = type;
   if (p_parser_cfg) {
     memcpy(&(parser->parser_cfg), p_parser_cfg, sizeof(parser_cfg_t));
   }
 
+  parser->p_index = NULL;
+  parser->p_prefetch = NULL;
+  parser->is_stream = fp_map_path_is_stream(path);
+  parser->pts_base_us = 0;
+  parser->pts_end_us = 0;
+  memset(&parser->video_info, 0, sizeof(video_stream_info_t));
+  memset(&parser->ps_cache, 0, sizeof(fp_ps_cache_t));
+  parser->p_pending = NULL;
+  parser->pending_cnt = 0;
+  parser->pending_pos = 0;
+  parser->codec_config = NULL;
+  parser->codec_config_len = 0;
+  parser->nal_length_size = 0;
+  parser->want_ext = false;
+  pthread_mutex_init(&parser->ext_lock, NULL);
+  parser->free_exts = NULL;
   if (parser->open(parser, path) < 0) {
+    pthread_mutex_destroy(&parser->ext_lock);
     free(parser);
     AGO_LOGE("File parser can't open file %s", path);
     return NULL;
   }
 
+  // MP4 samples only reach Annex-B through the nal list and iov
+  if (fp_is_annexb_codec(parser->codec)) {
+    parser->want_ext = parser->nal_length_size || parser->parser_cfg.u.video_cfg.list_nals ||
+                       parser->parser_cfg.u.video_cfg.prepend_param_sets ||
+                       parser->parser_cfg.u.video_cfg.length_prefixed;
+  }
+  if (!parser->p_index) {
+    parser->p_index = fp_index_open(parser, path);
+  }
+  parser_prime_param_sets(parser);
+
   return (void *)parser;
 }
 
+static void parser_drop_pending(media_parser_t *parser)
+{
+  int i;
+  for (i = parser->pending_pos; i < parser->pending_cnt; i++) {
+    fp_parser_release_frame(parser, &parser->p_pending[i]);
+  }
+  free(parser->p_pending);
+  parser->p_pending = NULL;
+  parser->pending_cnt = 0;
+  parser->pending_pos = 0;
+}
+
 void destroy_file_parser(void *p_parser)
 {
   if (p_parser) {
     media_parser_t *parser = (media_parser_t *)p_parser;
+    fp_prefetch_stop(parser->p_prefetch, NULL);
+    parser_drop_pending(parser);
     parser->close(parser);
+    fp_index_free(parser->p_index);
+    fp_ps_cache_free(&parser->ps_cache);
+    fp_frame_ext_free_all(parser);
+    pthread_mutex_destroy(&parser->ext_lock);
     free(parser);
   }
 }
 
-int file_parser_obtain_frame(void *p_parser, frame_t *p_frame)
+static void index_rewind(media_parser_t *parser)
 {
+  parser->p_index->cur = 0;
+  parser->pts_base_us += parser->pts_end_us;
+  parser->pts_end_us = 0;
+  AGO_LOGI("File parser has reached the end of file. Now rewind ...");
+}
+
+// Hand out the frame of index entry e
+static inline int index_frame_at(media_parser_t *parser, const fp_index_entry_t *e, frame_t *p_frame, bool video)
+{
+  if (parser->frame_at(parser, e->offset, e->len, p_frame) < 0) {
+    return -1;
+  }
+
+  p_frame->type = parser->type;
+  p_frame->len = e->len;
+  p_frame->pts_us = e->pts_us;
+  p_frame->duration_us = e->duration_us;
+  if (video) {
+    p_frame->u.video.is_key_frame = (e->flags & FP_INDEX_FLAG_KEY) != 0;
+    p_frame->u.video.has_param_sets = (e->flags & FP_INDEX_FLAG_PARAM_SETS) != 0;
+    p_frame->u.video.frame_class = e->frame_class;
+    p_frame->u.video.temporal_id = e->temporal_id;
+    // the parser's own walk caches every set it passes; keep a mid-stream
+    // SPS/PPS change from leaving a stale one for the key frames after it
+    if (p_frame->u.video.has_param_sets && parser->parser_cfg.u.video_cfg.prepend_param_sets) {
+      fp_annexb_cache_param_sets(p_frame->ptr, e->len, parser->codec == MEDIA_FILE_TYPE_H265, &parser->ps_cache);
+    }
+  } else {
+    p_frame->u.audio.samples_per_channel = e->samples_per_channel;
+  }
+  return 0;
+}
+
+static int index_obtain_frame(media_parser_t *parser, frame_t *p_frame, bool video)
+{
+  fp_index_t *p_index = parser->p_index;
+
+  if (p_index->cur >= p_index->count) {
+    index_rewind(parser);
+  }
+  if (index_frame_at(parser, &p_index->entries[p_index->cur], p_frame, video) < 0) {
+    return -1;
+  }
+  p_index->cur++;
+  return 0;
+}
+
+// Gather the cached parameter sets in front of a key frame that lacks them,
+// e.g. the first one after a rewind or when the file starts mid-stream
+static int parser_prepend_param_sets(media_parser_t *parser, frame_t *p_frame)
+{
+  frame_ext_t *ext = p_frame->ext;
+  fp_ps_blob_t *blob;
+
+  if (!parser->parser_cfg.u.video_cfg.prepend_param_sets || !p_frame->u.video.is_key_frame ||
+      p_frame->u.video.has_param_sets) {
+    return 0;
+  }
+  if (!fp_frame_ext_reserve_iov(ext, 2)) {
+    return -1;
+  }
+  blob = fp_ps_cache_blob(&parser->ps_cache);
+  if (!blob) {
+    return 0;
+  }
+  // held until the frame is released
+  ((fp_frame_ext_t *)ext)->ps_blob = blob;
+  ext->iov[0].ptr = blob->data;
+  ext->iov[0].len = blob->len;
+  ext->iov[1].ptr = p_frame->ptr;
+  ext->iov[1].len = p_frame->len;
+  ext->iov_cnt = 2;
+  return 0;
+}
+
+// Samples made of length prefixed nals are handed out as Annex-B through
+// iov, a start code in front of each nal. iov[0] stays the place of the
+// prepended parameter sets, empty when there are none.
+static int parser_annexb_iov(media_parser_t *parser, frame_t *p_frame)
+{
+  static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+  frame_ext_t *ext = p_frame->ext;
+  int i;
+
+  if (!parser->nal_length_size || ext->nal_cnt == 0) {
+    return 0;
+  }
+  if (!fp_frame_ext_reserve_iov(ext, 1 + 2 * ext->nal_cnt)) {
+    return -1;
+  }
+  if (ext->iov_cnt == 0) {
+    ext->iov[0].ptr = start_code;
+    ext->iov[0].len = 0;
+  }
+  ext->iov_cnt = 1;
+  for (i = 0; i < ext->nal_cnt; i++) {
+    ext->iov[ext->iov_cnt].ptr = start_code;
+    ext->iov[ext->iov_cnt].len = sizeof(start_code);
+    ext->iov[ext->iov_cnt + 1].ptr = p_frame->ptr + ext->nals[i].offset;
+    ext->iov[ext->iov_cnt + 1].len = ext->nals[i].len;
+    ext->iov_cnt += 2;
+  }
+  return 0;
+}
+
+static void iov_add_nal(frame_ext_t *ext, uint8_t *hdrs, const uint8_t *nal, uint32_t len)
+{
+  uint8_t *hdr = hdrs + 2 * ext->iov_cnt;
+
+  hdr[0] = (uint8_t)(len >> 24);
+  hdr[1] = (uint8_t)(len >> 16);
+  hdr[2] = (uint8_t)(len >> 8);
+  hdr[3] = (uint8_t)len;
+  ext->iov[ext->iov_cnt].ptr = hdr;
+  ext->iov[ext->iov_cnt].len = 4;
+  ext->iov[ext->iov_cnt + 1].ptr = nal;
+  ext->iov[ext->iov_cnt + 1].len = len;
+  ext->iov_cnt += 2;
+}
+
+// Rewrite the frame, prepended parameter sets included, as length prefixed
+// nals. The length headers live in the ext, so this runs with the rest of
+// the read, ahead on the prefetch thread too.
+static int parser_length_prefix(media_parser_t *parser, frame_t *p_frame)
+{
+  frame_ext_t *ext = p_frame->ext;
+  const uint8_t *ps = NULL;
+  uint8_t *hdrs;
+  int ps_len = 0;
+  int pos = 0;
+  int i;
+
+  if (!parser->parser_cfg.u.video_cfg.length_prefixed || ext->nal_cnt == 0) {
+    return 0;
+  }
+  if (ext->iov_cnt > 1) {
+    ps = ext->iov[0].ptr;
+    ps_len = ext->iov[0].len;
+  }
+  hdrs = fp_frame_ext_reserve_iov(ext, 2 * (FP_PS_SLOTS + ext->nal_cnt));
+  if (!hdrs) {
+    return -1;
+  }
+
+  ext->iov_cnt = 0;
+  while (pos < ps_len && ext->iov_cnt < 2 * FP_PS_SLOTS) {
+    int nal_start, hdr_start, nal_end;
+    int found = fp_find_nal_unit(ps + pos, ps_len - pos, &nal_start, &hdr_start, &nal_end);
+    if (found == 0) {
+      break;
+    }
+    iov_add_nal(ext, hdrs, ps + pos + hdr_start, nal_end - hdr_start + 1);
+    if (found < 0) {
+      break;
+    }
+    pos += nal_end + 1;
+  }
+  for (i = 0; i < ext->nal_cnt; i++) {
+    iov_add_nal(ext, hdrs, p_frame->ptr + ext->nals[i].offset, ext->nals[i].len);
+  }
+  ext->length_prefixed = true;
+  return 0;
+}
+
+// Fill in the iov of a frame with an ext; -1 when out of memory, for the
+// nal list included
+static int parser_frame_ext(media_parser_t *parser, frame_t *p_frame)
+{
+  if (!p_frame->ext) {
+    return 0;
+  }
+  if (p_frame->ext->nal_cnt < 0 || parser_prepend_param_sets(parser, p_frame) < 0 ||
+      parser_annexb_iov(parser, p_frame) < 0 || parser_length_prefix(parser, p_frame) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+// spare, when given, holds exts taken from the free list for a batch
+static inline int parser_take_ext(media_parser_t *parser, frame_t *p_frame, fp_frame_ext_t **spare)
+{
+  p_frame->ext = NULL;
+  if (parser->want_ext) {
+    p_frame->ext = spare ? fp_frame_ext_next(parser, spare) : fp_frame_ext_get(parser);
+    if (!p_frame->ext) {
+      AGO_LOGE("File parser is out of memory for the frame's nal list");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Only the Annex-B parsers fill in the nal list and the frame class, the
+// raw YUV parser the planes, and only some audio parsers know the sample
+// count and format
+static inline void parser_clear_frame(frame_t *p_frame, bool video)
+{
+  if (video) {
+    p_frame->u.video.frame_class = VIDEO_FRAME_CLASS_REFERENCE;
+    p_frame->u.video.temporal_id = 0;
+    memset(p_frame->u.video.planes, 0, sizeof(p_frame->u.video.planes));
+    memset(p_frame->u.video.strides, 0, sizeof(p_frame->u.video.strides));
+  } else {
+    memset(&p_frame->u.audio, 0, sizeof(p_frame->u.audio));
+  }
+}
+
+// What every frame read goes through after the parser; a frame that can't
+// be completed is released
+static inline int parser_finish_frame(media_parser_t *parser, frame_t *p_frame, bool video)
+{
+  if (video && p_frame->u.video.is_key_frame) {
+    p_frame->u.video.frame_class = VIDEO_FRAME_CLASS_KEY;
+  }
+  // frames reordered for display may end before the ones decoded earlier
+  if (p_frame->pts_us + p_frame->duration_us > parser->pts_end_us) {
+    parser->pts_end_us = p_frame->pts_us + p_frame->duration_us;
+  }
+  p_frame->pts_us += parser->pts_base_us;
+  if (parser_frame_ext(parser, p_frame) < 0) {
+    AGO_LOGE("File parser is out of memory for the nals of the frame at %llu", (unsigned long long)p_frame->offset);
+    fp_parser_release_frame(parser, p_frame);
+    return -1;
+  }
+  return 0;
+}
+
+int fp_parser_read_frame(media_parser_t *parser, frame_t *p_frame)
+{
+  bool video = fp_is_video_codec(parser->codec);
   int ret;
 
+  if (parser_take_ext(parser, p_frame, NULL) < 0) {
+    return -1;
+  }
+  parser_clear_frame(p_frame, video);
+  if (parser->p_index) {
+    ret = index_obtain_frame(parser, p_frame, video);
+  } else {
+    ret = parser->obtain_frame(parser, p_frame);
+    if (ret == -2 && !parser->is_stream) {
+      parser->reset(parser);
+      // the next pass of the file continues where this one ended
+      parser->pts_base_us += parser->pts_end_us;
+      parser->pts_end_us = 0;
+      AGO_LOGI("File parser has reached the end of file. Now rewind ...");
+      ret = parser->obtain_frame(parser, p_frame);
+    }
+  }
+  if (ret < 0) {
+    fp_frame_ext_put(parser, p_frame->ext);
+    p_frame->ext = NULL;
+    return ret;
+  }
+  return parser_finish_frame(parser, p_frame, video);
+}
+
+void fp_parser_release_frame(media_parser_t *parser, frame_t *p_frame)
+{
+  parser->release_frame(parser, p_frame);
+  fp_frame_ext_put(parser, p_frame->ext);
+  p_frame->ext = NULL;
+}
+
+// Move up to max of the frames a stopped prefetch left over to p_frames
+static int parser_take_pending(media_parser_t *parser, frame_t *p_frames, int max)
+{
+  int n = parser->pending_cnt - parser->pending_pos;
+
+  if (n > max) {
+    n = max;
+  }
+  memcpy(p_frames, parser->p_pending + parser->pending_pos, n * sizeof(frame_t));
+  parser->pending_pos += n;
+  if (parser->pending_pos == parser->pending_cnt) {
+    free(parser->p_pending);
+    parser->p_pending = NULL;
+    parser->pending_cnt = 0;
+    parser->pending_pos = 0;
+  }
+  return n;
+}
+
+static int parser_obtain_frame(media_parser_t *parser, frame_t *p_frame)
+{
+  int ret = 0;
+
+  if (parser->p_pending) {
+    parser_take_pending(parser, p_frame, 1);
+  } else if (parser->p_prefetch) {
+    ret = fp_prefetch_pop(parser->p_prefetch, p_frame);
+  } else {
+    ret = fp_parser_read_frame(parser, p_frame);
+  }
+  return ret;
+}
+
+int file_parser_get_video_info(void *p_parser, video_stream_info_t *p_info)
+{
+  if (!p_parser || !p_info) {
+    return -1;
+  }
+
+  media_parser_t *parser = (media_parser_t *)p_parser;
+  if (!fp_is_video_codec(parser->codec)) {
+    return -1;
+  }
+
+  *p_info = parser->video_info;
+  if (p_info->fps_num == 0 || p_info->fps_den == 0) {
+    p_info->fps_num = fp_cfg_fps(parser);
+    p_info->fps_den = 1;
+  }
+  return (p_info->width > 0 && p_info->height > 0) ? 0 : -1;
+}
+
+int file_parser_get_codec_config(void *p_parser, const uint8_t **pp_data, uint32_t *p_len)
+{
+  if (!p_parser || !pp_data || !p_len) {
+    return -1;
+  }
+
+  media_parser_t *parser = (media_parser_t *)p_parser;
+  if (!parser->codec_config) {
+    return -1;
+  }
+
+  *pp_data = parser->codec_config;
+  *p_len = parser->codec_config_len;
+  return 0;
+}
+
+int file_parser_obtain_frame(void *p_parser, frame_t *p_frame)
+{
   if (!p_parser) {
     return -1;
   }
 
+  return parser_obtain_frame((media_parser_t *)p_parser, p_frame);
+}
+
+static uint64_t batch_time_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// the clock is only read every few frames to keep it off the hot path
+static inline bool batch_expired(int n, uint64_t deadline_us)
+{
+  return deadline_us && (n % FP_BATCH_CLOCK_STRIDE) == 0 && batch_time_us() >= deadline_us;
+}
+
+// A run of frames straight from the index entries, the same as repeated
+// fp_parser_read_frame calls with the per-call decisions taken once
+static int index_obtain_frames(media_parser_t *parser, frame_t *p_frames, int max, uint64_t deadline_us)
+{
+  fp_index_t *p_index = parser->p_index;
+  bool video = fp_is_video_codec(parser->codec);
+  fp_frame_ext_t *spare = parser->want_ext ? fp_frame_ext_take(parser, max) : NULL;
+  int n = 0;
+
+  while (n < max) {
+    frame_t *p_frame = &p_frames[n];
+
+    if (p_index->cur >= p_index->count) {
+      index_rewind(parser);
+    }
+    if (parser_take_ext(parser, p_frame, &spare) < 0) {
+      break;
+    }
+    parser_clear_frame(p_frame, video);
+    if (index_frame_at(parser, &p_index->entries[p_index->cur], p_frame, video) < 0) {
+      fp_frame_ext_put(parser, p_frame->ext);
+      p_frame->ext = NULL;
+      break;
+    }
+    p_index->cur++;
+    if (parser_finish_frame(parser, p_frame, video) < 0) {
+      break;
+    }
+    n++;
+    if (batch_expired(n, deadline_us)) {
+      break;
+    }
+  }
+  fp_frame_ext_give(parser, spare);
+  return n;
+}
+
+int file_parser_obtain_frames(void *p_parser, frame_t *p_frames, int max, uint64_t budget_us)
+{
+  uint64_t deadline_us = 0;
+  int n = 0;
+
+  if (!p_parser || !p_frames || max <= 0) {
+    return -1;
+  }
+
   media_parser_t *parser = (media_parser_t *)p_parser;
+  if (budget_us) {
+    deadline_us = batch_time_us() + budget_us;
+  }
 
-  ret = parser->obtain_frame(parser, p_frame);
-  if (ret == -2) {
-    parser->reset(parser);
-    AGO_LOGI("File parser has reached the end of file. Now rewind ...");
-    ret = parser->obtain_frame(parser, p_frame);
+  // the order single calls would hand them out in: what a stopped prefetch
+  // left over first, then the ring or the file
+  if (parser->p_pending) {
+    n = parser_take_pending(parser, p_frames, max);
+  }
+  if (parser->p_prefetch) {
+    // everything the ring holds at once, waiting only while it's empty
+    while (n < max) {
+      int got = fp_prefetch_pop_frames(parser->p_prefetch, p_frames + n, max - n);
+      if (got <= 0) {
+        break;
+      }
+      n += got;
+      if (deadline_us && batch_time_us() >= deadline_us) {
+        break;
+      }
+    }
+  } else if (parser->p_index) {
+    n += index_obtain_frames(parser, p_frames + n, max - n, deadline_us);
+  } else {
+    while (n < max && fp_parser_read_frame(parser, &p_frames[n]) == 0) {
+      n++;
+      if (batch_expired(n, deadline_us)) {
+        break;
+      }
+    }
   }
 
-  return ret;
+  return n > 0 ? n : -1;
 }
 
 int file_parser_release_frame(void *p_parser, frame_t *p_frame)
@@ -105,6 +612,116 @@ int file_parser_release_frame(void *p_parser, frame_t *p_frame)
   media_parser_t *parser = (media_parser_t *)p_parser;
 
   ret = parser->release_frame(parser, p_frame);
+  fp_frame_ext_put(parser, p_frame->ext);
+  p_frame->ext = NULL;
 
   return ret;
 }
+
+int file_parser_release_frames(void *p_parser, frame_t *p_frames, int count)
+{
+  int i;
+
+  if (!p_parser || (!p_frames && count > 0)) {
+    return -1;
+  }
+
+  media_parser_t *parser = (media_parser_t *)p_parser;
+  fp_frame_ext_t *exts = NULL;
+  // the exts go back to the free list together, under one lock
+  for (i = 0; i < count; i++) {
+    fp_frame_ext_t *x = (fp_frame_ext_t *)p_frames[i].ext;
+    parser->release_frame(parser, &p_frames[i]);
+    if (x) {
+      x->next = exts;
+      exts = x;
+    }
+    p_frames[i].ext = NULL;
+  }
+  fp_frame_ext_give(parser, exts);
+
+  return 0;
+}
+
+static void parser_stop_prefetch(media_parser_t *parser)
+{
+  frame_t *p_left = NULL;
+  int left = fp_prefetch_stop(parser->p_prefetch, &p_left);
+  parser->p_prefetch = NULL;
+
+  // frames read ahead but never consumed are handed out first afterwards
+  if (left > 0) {
+    parser_drop_pending(parser);
+    parser->p_pending = p_left;
+    parser->pending_cnt = left;
+  } else {
+    free(p_left);
+  }
+}
+
+int file_parser_seek(void *p_parser, uint32_t frame_no)
+{
+  if (!p_parser) {
+    return -1;
+  }
+
+  media_parser_t *parser = (media_parser_t *)p_parser;
+  if (!parser->p_index || frame_no >= parser->p_index->count) {
+    return -1;
+  }
+
+  int depth = 0;
+  if (parser->p_prefetch) {
+    depth = fp_prefetch_depth(parser->p_prefetch);
+    parser_stop_prefetch(parser);
+  }
+
+  parser_drop_pending(parser);
+  parser->p_index->cur = frame_no;
+
+  if (depth > 0) {
+    parser->p_prefetch = fp_prefetch_start(parser, depth);
+  }
+  return 0;
+}
+
+int file_parser_start_prefetch(void *p_parser, int depth)
+{
+  if (!p_parser || depth <= 0) {
+    return -1;
+  }
+
+  media_parser_t *parser = (media_parser_t *)p_parser;
+  if (parser->p_prefetch) {
+    parser_stop_prefetch(parser);
+  }
+
+  parser->p_prefetch = fp_prefetch_start(parser, depth);
+  return parser->p_prefetch ? 0 : -1;
+}
+
+void file_parser_stop_prefetch(void *p_parser)
+{
+  if (!p_parser) {
+    return;
+  }
+
+  media_parser_t *parser = (media_parser_t *)p_parser;
+  if (parser->p_prefetch) {
+    parser_stop_prefetch(parser);
+  }
+}
+
+int64_t file_parser_frame_count(void *p_parser)
+{
+  if (!p_parser) {
+    return -1;
+  }
+
+  media_parser_t *parser = (media_parser_t *)p_parser;
+  if (!parser->p_index) {
+    return -1;
+  }
+
+  return parser->p_index->count;
+}
@@ -13,6 +13,8 @@
 #ifndef __FILE_PARSER_PRIV_H__
 #define __FILE_PARSER_PRIV_H__
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdint.h>
 #include "file_parser.h"
@@ -23,6 +25,74 @@
 #define AGO_LOGW(fmt, ...) fprintf(stdout, "[WRN] " fmt "\n", ##__VA_ARGS__)
 #define AGO_LOGE(fmt, ...) fprintf(stdout, "[ERR] " fmt "\n", ##__VA_ARGS__)
 
+#define FP_INDEX_FLAG_KEY (1 << 0)
+#define FP_INDEX_FLAG_PARAM_SETS (1 << 1)
+
+#define FP_DEFAULT_FPS 25
+
+typedef struct {
+  uint64_t offset;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t nal_count;
+  int64_t pts_us;
+  uint32_t duration_us;
+  uint8_t frame_class;
+  uint8_t temporal_id;
+  // audio, 0 if unknown
+  uint16_t samples_per_channel;
+} fp_index_entry_t;
+
+typedef struct {
+  fp_index_entry_t *entries;
+  uint32_t count;
+  uint32_t cur;
+} fp_index_t;
+
+typedef struct fp_prefetch_s fp_prefetch_t;
+
+// VPS, SPS and PPS
+#define FP_PS_SLOTS 3
+// the most ids of any kind, the 256 of an H.264 PPS
+#define FP_PS_IDS 256
+
+// Annex-B copy of a set of parameter sets, start codes included. Blobs are
+// never changed once built; the cache holds a reference to the current one
+// and every frame prepended with it another, so a blob is freed once it
+// was replaced and the last such frame was released.
+typedef struct fp_ps_blob_s fp_ps_blob_t;
+struct fp_ps_blob_s {
+  atomic_int refs;
+  uint32_t len;
+  uint8_t data[];
+};
+
+typedef struct {
+  // latest nal of each kind and id, header included
+  uint8_t *nal[FP_PS_SLOTS][FP_PS_IDS];
+  uint32_t len[FP_PS_SLOTS][FP_PS_IDS];
+  // the SPS is the one set every codec has
+  bool has_sps;
+  // a set changed since the blob was built
+  bool dirty;
+  fp_ps_blob_t *blob;
+} fp_ps_cache_t;
+
+// frame_t.ext and the storage behind it, grown to fit the largest frame
+// seen and recycled through the parser's free list
+typedef struct fp_frame_ext_s fp_frame_ext_t;
+struct fp_frame_ext_s {
+  // first, so that frame_t.ext points at the whole
+  frame_ext_t ext;
+  fp_frame_ext_t *next;
+  int nal_cap;
+  int iov_cap;
+  // the 4-byte length headers of length prefixed mode, one per iov pair
+  uint8_t *iov_hdr;
+  // the prepended parameter sets iov[0] points into, referenced
+  fp_ps_blob_t *ps_blob;
+};
+
 typedef struct media_parser_s media_parser_t;
 struct media_parser_s {
   int type;
@@ -30,12 +100,301 @@ struct media_parser_s {
   char name[16];
   void *p_ctx;
   parser_cfg_t parser_cfg;
+  fp_index_t *p_index;
+  fp_prefetch_t *p_prefetch;
+  // reading from a pipe, FIFO or stdin: EOF is final, no rewind
+  bool is_stream;
+  // added to the parser's pts so that time keeps going across rewinds
+  int64_t pts_base_us;
+  // end of the last frame read, relative to pts_base_us
+  int64_t pts_end_us;
+  // filled by open for video
+  video_stream_info_t video_info;
+  // parameter sets seen so far, kept by the Annex-B parsers
+  fp_ps_cache_t ps_cache;
+  // frames read ahead before prefetch was stopped, served before the parser
+  frame_t *p_pending;
+  int pending_cnt;
+  int pending_pos;
+  // decoder config carried out of band by the container, owned by the parser
+  const uint8_t *codec_config;
+  uint32_t codec_config_len;
+  // samples hold nals behind big-endian lengths of this many bytes rather
+  // than start codes (MP4); 0 for Annex-B
+  int nal_length_size;
+  // frames get a frame_t.ext; the free ones are shared by the producer and
+  // consumer sides of prefetch
+  bool want_ext;
+  pthread_mutex_t ext_lock;
+  fp_frame_ext_t *free_exts;
 
   int (*open)(media_parser_t *h, const char *path);
   int (*obtain_frame)(media_parser_t *h, frame_t *p_frame);
   int (*release_frame)(media_parser_t *h, frame_t *p_frame);
   int (*reset)(media_parser_t *h);
   int (*close)(media_parser_t *h);
+  // optional: hand out the frame at a known file range. Parsers providing it
+  // get a persistent frame index built on open, unless open set p_index
+  // from a sample table of the container.
+  int (*frame_at)(media_parser_t *h, uint64_t offset, uint32_t len, frame_t *p_frame);
 };
 
+static inline bool fp_is_video_codec(int codec)
+{
+  return (codec >= 0 && codec < MEDIA_FILE_TYPE_PCM) || codec == MEDIA_FILE_TYPE_VP8;
+}
+
+// Formats made of NAL units behind start codes
+static inline bool fp_is_annexb_codec(int codec)
+{
+  return codec == MEDIA_FILE_TYPE_H264 || codec == MEDIA_FILE_TYPE_H265;
+}
+
+// Frame rate for video without timing of its own
+static inline int fp_cfg_fps(const media_parser_t *h)
+{
+  return h->parser_cfg.u.video_cfg.fps > 0 ? h->parser_cfg.u.video_cfg.fps : FP_DEFAULT_FPS;
+}
+
+// ticks * 1e6 / rate without overflowing for long streams
+static inline int64_t fp_ticks_to_us(uint64_t ticks, uint64_t rate)
+{
+  return (int64_t)((ticks / rate) * 1000000 + (ticks % rate) * 1000000 / rate);
+}
+
+// Timestamps for a frame starting at tick and lasting count ticks. The
+// duration is the distance to the next pts, so rounding never accumulates.
+static inline void fp_frame_timing(frame_t *p_frame, uint64_t tick, uint32_t count, uint64_t rate)
+{
+  p_frame->pts_us = fp_ticks_to_us(tick, rate);
+  p_frame->duration_us = (uint32_t)(fp_ticks_to_us(tick + count, rate) - p_frame->pts_us);
+}
+
+/* Persistent frame index (frame_index.c) */
+fp_index_t *fp_index_open(media_parser_t *h, const char *path);
+void fp_index_free(fp_index_t *p_index);
+
+/* Read one frame from the index or the parser, rewinding at EOF (file_parser.c) */
+int fp_parser_read_frame(media_parser_t *parser, frame_t *p_frame);
+// Release a frame read by fp_parser_read_frame, its ext included
+void fp_parser_release_frame(media_parser_t *parser, frame_t *p_frame);
+// The i-th registered parser template, NULL past the end
+const media_parser_t *fp_parser_at(int i);
+
+/* MP4 and fragmented MP4 (mp4_parser.c). Registered for every codec it
+   carries: create_file_parser picks it by content. */
+extern media_parser_t media_parser_mp4;
+bool fp_mp4_is_mp4(const char *path);
+// The first video track, else the first audio track; audio picks the first
+// audio track only
+int fp_mp4_probe(const char *path, bool audio, media_file_type_e *p_type, parser_cfg_t *p_cfg);
+
+/* RIFF/WAVE (audio_parser_wav.c). Picked by content for PCM and G.711. */
+extern media_parser_t audio_parser_wav;
+bool fp_wav_is_wav(const char *path);
+
+/* Read-ahead thread with a SPSC frame ring (prefetch.c) */
+fp_prefetch_t *fp_prefetch_start(media_parser_t *parser, int depth);
+int fp_prefetch_pop(fp_prefetch_t *pf, frame_t *p_frame);
+// Pop what the ring holds, up to max frames, waiting only while it is empty.
+// Returns the count, or the error of a failed read when it comes first.
+int fp_prefetch_pop_frames(fp_prefetch_t *pf, frame_t *p_frames, int max);
+int fp_prefetch_depth(fp_prefetch_t *pf);
+// Stop the thread. Unconsumed frames are returned through pp_left (malloc'd,
+// the count is the return value), or released when pp_left is NULL.
+int fp_prefetch_stop(fp_prefetch_t *pf, frame_t **pp_left);
+
+/* Sliding-window file mapping (file_map.c) */
+#ifndef FP_MAP_WINDOW_SIZE
+#define FP_MAP_WINDOW_SIZE (64 * 1024 * 1024)
+#endif
+
+typedef struct fp_map_window_s fp_map_window_t;
+typedef struct {
+  int fd;
+  // UINT64_MAX for a stream until its end has been read
+  uint64_t size;
+  uint64_t window_size;
+  // pipe, FIFO or stdin: read into a buffer, never rewound
+  bool stream;
+  fp_map_window_t *cur;
+  // the part of the file currently mapped
+  uint8_t *view;
+  uint64_t view_offset;
+  uint64_t view_len;
+} fp_map_t;
+
+// window_size 0 maps the whole file at once; "-" is stdin
+int fp_map_open(fp_map_t *m, const char *path, uint64_t window_size);
+// Make [offset, offset + len) visible through m->view, moving the window if
+// needed. The view is clipped at the end of file; -2 if offset is past it.
+int fp_map_view(fp_map_t *m, uint64_t offset, uint64_t len);
+// Make more data past the end of the view visible, keeping offset in view
+int fp_map_grow(fp_map_t *m, uint64_t offset);
+bool fp_map_path_is_stream(const char *path);
+// Pin the current window for a frame handed out to the caller
+fp_map_window_t *fp_map_ref(fp_map_t *m);
+void fp_map_unref(fp_map_window_t *win);
+void fp_map_close(fp_map_t *m);
+
+static inline bool fp_map_view_at_eof(const fp_map_t *m)
+{
+  return m->view_offset + m->view_len >= m->size;
+}
+
+/* Annex-B start code scanner (startcode.c) */
+typedef const uint8_t *(*fp_startcode_fn)(const uint8_t *p, const uint8_t *end);
+typedef struct {
+  const char *name;
+  fp_startcode_fn fn;
+} fp_startcode_impl_t;
+
+// Return the first 00 00 01 in [p, end), or end if there is none
+const uint8_t *fp_find_startcode(const uint8_t *p, const uint8_t *end);
+const uint8_t *fp_find_startcode_c(const uint8_t *p, const uint8_t *end);
+#if defined(__x86_64__) || defined(__i386__)
+const uint8_t *fp_find_startcode_sse2(const uint8_t *p, const uint8_t *end);
+const uint8_t *fp_find_startcode_avx2(const uint8_t *p, const uint8_t *end);
+#endif
+const char *fp_startcode_impl_name(void);
+// Fill impls with the implementations usable on this CPU, best first
+int fp_startcode_impls(const fp_startcode_impl_t **impls, int max);
+
+/* PCM sample conversion (pcm_convert.c) */
+typedef void (*fp_pcm_convert_fn)(const uint8_t *src, int bits, bool is_float, int16_t *dst, size_t samples);
+
+// Convert little-endian 16/24/32-bit integer or 32-bit float samples to
+// int16, keeping the top bits of integers and clipping floats
+void fp_pcm_to_s16(const uint8_t *src, int bits, bool is_float, int16_t *dst, size_t samples);
+void fp_pcm_to_s16_c(const uint8_t *src, int bits, bool is_float, int16_t *dst, size_t samples);
+#if defined(__x86_64__) || defined(__i386__)
+void fp_pcm_to_s16_simd(const uint8_t *src, int bits, bool is_float, int16_t *dst, size_t samples);
+#endif
+
+/**
+ Find the beginning and end of a NAL unit in an Annex-B byte buffer.
+ @param[out]  nal_start  offset of the start code
+ @param[out]  hdr_start  offset of the first nal header byte
+ @param[out]  nal_end    offset of the last byte of the nal
+ @return                 the length of the nal, or 0 if did not find start of
+ nal, or -1 if did not find end of nal
+ */
+int fp_find_nal_unit(const uint8_t *buf, int size, int *nal_start, int *hdr_start, int *nal_end);
+
+/* Per-frame extension storage (frame_ext.c) */
+// A cleared ext from the parser's free list, or a new one; NULL when out of
+// memory
+frame_ext_t *fp_frame_ext_get(media_parser_t *h);
+void fp_frame_ext_put(media_parser_t *h, frame_ext_t *ext);
+// Batches: detach up to n exts from the free list with one lock, hand them
+// out one by one (falling back to fp_frame_ext_get once they run out), and
+// give a chain back with one lock
+fp_frame_ext_t *fp_frame_ext_take(media_parser_t *h, int n);
+frame_ext_t *fp_frame_ext_next(media_parser_t *h, fp_frame_ext_t **spare);
+void fp_frame_ext_give(media_parser_t *h, fp_frame_ext_t *chain);
+// Free the exts on the free list, at destroy
+void fp_frame_ext_free_all(media_parser_t *h);
+int fp_frame_ext_grow_nals(frame_ext_t *ext);
+// Room for n iov entries and their length headers: the header for iov[i]
+// is at the returned pointer + 2 * i. NULL when out of memory.
+uint8_t *fp_frame_ext_reserve_iov(frame_ext_t *ext, int n);
+// List the NAL units of the Annex-B access unit at p_frame->ptr in its ext,
+// if it has one
+void fp_annexb_list_nals(frame_t *p_frame, bool h265);
+
+// -1 when the list can't grow
+static inline int fp_frame_ext_add_nal(frame_ext_t *ext, uint32_t offset, uint32_t len, uint8_t type)
+{
+  if (ext->nal_cnt == ((fp_frame_ext_t *)ext)->nal_cap && fp_frame_ext_grow_nals(ext) < 0) {
+    return -1;
+  }
+  ext->nals[ext->nal_cnt].offset = offset;
+  ext->nals[ext->nal_cnt].len = len;
+  ext->nals[ext->nal_cnt].type = type;
+  ext->nal_cnt++;
+  return 0;
+}
+
+static inline void fp_frame_clear_nals(frame_t *p_frame)
+{
+  if (p_frame->ext) {
+    p_frame->ext->nal_cnt = 0;
+  }
+}
+
+// While parsing, nals[] holds window relative offsets; -1 marks running out
+// of memory, which fp_parser_read_frame turns into an error. Frames without
+// an ext aren't listed.
+static inline void fp_frame_add_nal(frame_t *p_frame, const uint8_t *view, int nal_start, int nal_end, uint8_t type)
+{
+  frame_ext_t *ext = p_frame->ext;
+  int hdr = nal_start + (view[nal_start + 2] == 1 ? 3 : 4);
+  if (!ext || ext->nal_cnt < 0) {
+    return;
+  }
+  if (fp_frame_ext_add_nal(ext, hdr, nal_end - hdr + 1, type) < 0) {
+    ext->nal_cnt = -1;
+  }
+}
+
+// Make the offsets relative to the frame start once it is known
+static inline void fp_frame_rebase_nals(frame_t *p_frame, int frame_start)
+{
+  frame_ext_t *ext = p_frame->ext;
+  int i;
+  if (!ext) {
+    return;
+  }
+  for (i = 0; i < ext->nal_cnt; i++) {
+    ext->nals[i].offset -= frame_start;
+  }
+}
+
+/* Bit reader (bitreader.c) */
+typedef struct {
+  // next byte to load into the cache
+  const uint8_t *buf;
+  const uint8_t *end;
+  // unread bits, MSB first
+  uint64_t cache;
+  int bits;
+  // zero bytes just loaded, to spot 00 00 03
+  int zeros;
+  bool escaped;
+  // set once a read ran past the end; reads then return 0
+  bool overrun;
+} fp_bitreader_t;
+
+// Read RBSP or any other plain bitstream
+void fp_br_init(fp_bitreader_t *br, const uint8_t *buf, int size);
+// Read a NAL payload, dropping its emulation prevention bytes
+void fp_br_init_nal(fp_bitreader_t *br, const uint8_t *buf, int size);
+// n is at most 32
+uint32_t fp_br_read(fp_bitreader_t *br, int n);
+void fp_br_skip(fp_bitreader_t *br, int n);
+uint32_t fp_br_ue(fp_bitreader_t *br);
+int32_t fp_br_se(fp_bitreader_t *br);
+
+/* Parameter sets (param_sets.c) */
+// nal points at the nal header, right after the start code. The frame rate
+// is 0/0 when the parameter set doesn't carry timing info; a VPS only sets
+// the frame rate.
+int fp_h264_parse_sps(const uint8_t *nal, int len, video_stream_info_t *info);
+int fp_h265_parse_vps(const uint8_t *nal, int len, video_stream_info_t *info);
+int fp_h265_parse_sps(const uint8_t *nal, int len, video_stream_info_t *info);
+// Parse the parameter sets ahead of the first slice of an Annex-B stream,
+// remembering them in cache if given; -1 if there is no SPS
+#define FP_STREAM_INFO_SCAN_SIZE (64 * 1024)
+int fp_annexb_stream_info(const uint8_t *buf, int size, bool h265, video_stream_info_t *info, fp_ps_cache_t *cache);
+// Only remember the parameter sets ahead of the first slice
+void fp_annexb_cache_param_sets(const uint8_t *buf, int size, bool h265, fp_ps_cache_t *cache);
+// Remember the parameter set nal (header included) as the latest of its kind
+// and id; other nals are ignored
+void fp_ps_cache_put(fp_ps_cache_t *c, bool h265, const uint8_t *nal, uint32_t len);
+// The cached sets as one Annex-B blob with a reference for the caller, NULL
+// if there is no SPS yet
+fp_ps_blob_t *fp_ps_cache_blob(fp_ps_cache_t *c);
+void fp_ps_blob_unref(fp_ps_blob_t *blob);
+void fp_ps_cache_free(fp_ps_cache_t *c);
+
 #endif /* __FILE_PARSER_PRIV_H__ */
\ No newline at end of file
@@ -0,0 +1,181 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * Storage behind frame_t.ext: the nal list and iov of H.264/H.265
+ * frames, and the length headers iov points to. Every frame handed out
+ * gets its own from a free list of the parser, grown to fit the largest
+ * frame seen, so frames of any size need no fixed limit and frame_t
+ * stays cheap to copy. The Annex-B nal listing that fills the list
+ * lives here too, keeping the start code scanner free of it.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <string.h>
+
+#include "file_parser_priv.h"
+
+#define FP_FRAME_EXT_MIN_NALS 16
+
+static frame_ext_t *frame_ext_clear(fp_frame_ext_t *x)
+{
+  if (!x) {
+    x = (fp_frame_ext_t *)calloc(1, sizeof(fp_frame_ext_t));
+    if (!x) {
+      return NULL;
+    }
+  }
+  x->ext.iov_cnt = 0;
+  x->ext.length_prefixed = false;
+  x->ext.nal_cnt = 0;
+  return &x->ext;
+}
+
+frame_ext_t *fp_frame_ext_get(media_parser_t *h)
+{
+  fp_frame_ext_t *x;
+
+  pthread_mutex_lock(&h->ext_lock);
+  x = h->free_exts;
+  if (x) {
+    h->free_exts = x->next;
+  }
+  pthread_mutex_unlock(&h->ext_lock);
+
+  return frame_ext_clear(x);
+}
+
+fp_frame_ext_t *fp_frame_ext_take(media_parser_t *h, int n)
+{
+  fp_frame_ext_t *first, *last;
+
+  pthread_mutex_lock(&h->ext_lock);
+  first = last = h->free_exts;
+  while (last && --n > 0 && last->next) {
+    last = last->next;
+  }
+  if (last) {
+    h->free_exts = last->next;
+    last->next = NULL;
+  }
+  pthread_mutex_unlock(&h->ext_lock);
+  return first;
+}
+
+frame_ext_t *fp_frame_ext_next(media_parser_t *h, fp_frame_ext_t **spare)
+{
+  fp_frame_ext_t *x = *spare;
+
+  if (!x) {
+    return fp_frame_ext_get(h);
+  }
+  *spare = x->next;
+  return frame_ext_clear(x);
+}
+
+void fp_frame_ext_give(media_parser_t *h, fp_frame_ext_t *chain)
+{
+  fp_frame_ext_t *last = chain;
+
+  if (!chain) {
+    return;
+  }
+  // the parameter sets the frames were prepended with
+  for (;; last = last->next) {
+    fp_ps_blob_unref(last->ps_blob);
+    last->ps_blob = NULL;
+    if (!last->next) {
+      break;
+    }
+  }
+  pthread_mutex_lock(&h->ext_lock);
+  last->next = h->free_exts;
+  h->free_exts = chain;
+  pthread_mutex_unlock(&h->ext_lock);
+}
+
+void fp_frame_ext_put(media_parser_t *h, frame_ext_t *ext)
+{
+  fp_frame_ext_t *x = (fp_frame_ext_t *)ext;
+
+  if (!x) {
+    return;
+  }
+  x->next = NULL;
+  fp_frame_ext_give(h, x);
+}
+
+void fp_frame_ext_free_all(media_parser_t *h)
+{
+  while (h->free_exts) {
+    fp_frame_ext_t *x = h->free_exts;
+    h->free_exts = x->next;
+    free(x->ext.iov);
+    free(x->ext.nals);
+    free(x->iov_hdr);
+    free(x);
+  }
+}
+
+int fp_frame_ext_grow_nals(frame_ext_t *ext)
+{
+  fp_frame_ext_t *x = (fp_frame_ext_t *)ext;
+  int cap = x->nal_cap ? 2 * x->nal_cap : FP_FRAME_EXT_MIN_NALS;
+  frame_nal_t *nals = (frame_nal_t *)realloc(ext->nals, cap * sizeof(frame_nal_t));
+
+  if (!nals) {
+    return -1;
+  }
+  ext->nals = nals;
+  x->nal_cap = cap;
+  return 0;
+}
+
+uint8_t *fp_frame_ext_reserve_iov(frame_ext_t *ext, int n)
+{
+  fp_frame_ext_t *x = (fp_frame_ext_t *)ext;
+
+  if (n > x->iov_cap) {
+    frame_iov_t *iov = (frame_iov_t *)realloc(ext->iov, n * sizeof(frame_iov_t));
+    if (!iov) {
+      return NULL;
+    }
+    ext->iov = iov;
+    uint8_t *hdr = (uint8_t *)realloc(x->iov_hdr, 2 * n);
+    if (!hdr) {
+      return NULL;
+    }
+    x->iov_hdr = hdr;
+    x->iov_cap = n;
+  }
+  return x->iov_hdr;
+}
+
+void fp_annexb_list_nals(frame_t *p_frame, bool h265)
+{
+  int size = p_frame->len;
+  int pos = 0;
+  int nal_start, hdr_start, nal_end;
+
+  // nobody asked for the list
+  if (!p_frame->ext) {
+    return;
+  }
+  p_frame->ext->nal_cnt = 0;
+  while (pos < size) {
+    int found = fp_find_nal_unit(p_frame->ptr + pos, size - pos, &nal_start, &hdr_start, &nal_end);
+    if (found == 0) {
+      break;
+    }
+    uint8_t hdr = p_frame->ptr[pos + hdr_start];
+    fp_frame_add_nal(p_frame, p_frame->ptr, pos + nal_start, pos + nal_end, h265 ? (hdr >> 1) & 0x3f : hdr & 0x1f);
+    if (found < 0) {
+      break;
+    }
+    pos += nal_end + 1;
+  }
+  fp_frame_rebase_nals(p_frame, 0);
+}
@@ -0,0 +1,280 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * Persistent frame index. The first open of a file walks it once with
+ * the parser and stores every frame boundary in a sidecar file
+ * (<path>.fpidx), keyed by file size, mtime and the frame rate the
+ * timestamps were derived from. Later opens load the sidecar instead of
+ * parsing.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file_parser_priv.h"
+
+#define FP_INDEX_MAGIC "FPIX"
+#define FP_INDEX_VERSION 6
+#define FP_INDEX_SUFFIX ".fpidx"
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  int32_t codec;
+  uint32_t count;
+  // configured fps behind the video pts/duration, 0 for audio
+  int32_t fps;
+  uint32_t reserved;
+  uint64_t file_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+} fp_index_hdr_t;
+
+static void index_fill_hdr(fp_index_hdr_t *hdr, const media_parser_t *h, const struct stat *sb)
+{
+  memset(hdr, 0, sizeof(fp_index_hdr_t));
+  memcpy(hdr->magic, FP_INDEX_MAGIC, 4);
+  hdr->version = FP_INDEX_VERSION;
+  hdr->codec = h->codec;
+  hdr->fps = fp_is_video_codec(h->codec) ? fp_cfg_fps(h) : 0;
+  hdr->file_size = sb->st_size;
+  hdr->mtime_sec = sb->st_mtime;
+#if defined(__APPLE__)
+  hdr->mtime_nsec = sb->st_mtimespec.tv_nsec;
+#else
+  hdr->mtime_nsec = sb->st_mtim.tv_nsec;
+#endif
+}
+
+static char *index_sidecar_path(const char *path)
+{
+  size_t len = strlen(path);
+  char *sidecar = (char *)malloc(len + sizeof(FP_INDEX_SUFFIX));
+  if (sidecar) {
+    memcpy(sidecar, path, len);
+    memcpy(sidecar + len, FP_INDEX_SUFFIX, sizeof(FP_INDEX_SUFFIX));
+  }
+  return sidecar;
+}
+
+static fp_index_t *index_load(const char *sidecar, const fp_index_hdr_t *expect)
+{
+  fp_index_t *p_index = NULL;
+  fp_index_hdr_t hdr;
+  FILE *f = fopen(sidecar, "rb");
+  if (!f) {
+    return NULL;
+  }
+
+  do {
+    uint32_t count;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1) {
+      break;
+    }
+
+    // a stale or foreign index is simply rebuilt
+    count = hdr.count;
+    hdr.count = expect->count;
+    if (memcmp(&hdr, expect, sizeof(hdr)) != 0 || count == 0) {
+      break;
+    }
+    hdr.count = count;
+
+    p_index = (fp_index_t *)calloc(1, sizeof(fp_index_t));
+    if (!p_index) {
+      break;
+    }
+    p_index->entries = (fp_index_entry_t *)malloc(hdr.count * sizeof(fp_index_entry_t));
+    if (!p_index->entries || fread(p_index->entries, sizeof(fp_index_entry_t), hdr.count, f) != hdr.count) {
+      fp_index_free(p_index);
+      p_index = NULL;
+      break;
+    }
+    p_index->count = hdr.count;
+  } while (0);
+
+  fclose(f);
+  return p_index;
+}
+
+static void index_save(const char *sidecar, const fp_index_hdr_t *hdr_tmpl, const fp_index_t *p_index)
+{
+  fp_index_hdr_t hdr = *hdr_tmpl;
+  size_t len = strlen(sidecar);
+  char *tmp = (char *)malloc(len + 8);
+  FILE *f = NULL;
+  int fd, ok;
+
+  if (!tmp) {
+    return;
+  }
+  // a temp file of its own, so that processes indexing the same file at
+  // once each rename a whole sidecar into place
+  memcpy(tmp, sidecar, len);
+  memcpy(tmp + len, ".XXXXXX", 8);
+  fd = mkstemp(tmp);
+  if (fd >= 0) {
+    fchmod(fd, 0644);
+    f = fdopen(fd, "wb");
+    if (!f) {
+      close(fd);
+      unlink(tmp);
+    }
+  }
+
+  // best effort: read-only media directories just don't get a sidecar
+  if (!f) {
+    AGO_LOGW("Can't write frame index %s", sidecar);
+    free(tmp);
+    return;
+  }
+
+  hdr.count = p_index->count;
+  ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+       fwrite(p_index->entries, sizeof(fp_index_entry_t), p_index->count, f) == p_index->count;
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp, sidecar) != 0) {
+    unlink(tmp);
+  }
+  free(tmp);
+}
+
+static uint16_t index_count_nals(const uint8_t *ptr, uint32_t len)
+{
+  const uint8_t *end = ptr + len;
+  uint32_t n = 0;
+
+  while ((ptr = fp_find_startcode(ptr, end)) != end) {
+    n++;
+    ptr += 3;
+  }
+  return n > 0xffff ? 0xffff : n;
+}
+
+// The walk ends at the first frame the parser fails; *p_complete tells
+// whether that was the end of the file rather than an error
+static fp_index_t *index_build(media_parser_t *h, bool *p_complete)
+{
+  fp_index_t *p_index = (fp_index_t *)calloc(1, sizeof(fp_index_t));
+  // one ext for all frames, for the nal count the parser finds anyway
+  frame_ext_t *ext = fp_is_annexb_codec(h->codec) ? fp_frame_ext_get(h) : NULL;
+  uint32_t cap = 0;
+  frame_t frame;
+  int ret;
+
+  *p_complete = false;
+  if (!p_index) {
+    fp_frame_ext_put(h, ext);
+    return NULL;
+  }
+
+  while (1) {
+    memset(&frame, 0, sizeof(frame));
+    frame.ext = ext;
+    ret = h->obtain_frame(h, &frame);
+    if (ret < 0) {
+      *p_complete = ret == -2;
+      break;
+    }
+
+    if (p_index->count == cap) {
+      uint32_t new_cap = cap ? cap * 2 : 1024;
+      fp_index_entry_t *entries = (fp_index_entry_t *)realloc(p_index->entries, new_cap * sizeof(fp_index_entry_t));
+      if (!entries) {
+        h->release_frame(h, &frame);
+        fp_frame_ext_put(h, ext);
+        fp_index_free(p_index);
+        return NULL;
+      }
+      p_index->entries = entries;
+      cap = new_cap;
+    }
+
+    fp_index_entry_t *e = &p_index->entries[p_index->count++];
+    e->offset = frame.offset;
+    e->len = frame.len;
+    e->flags = 0;
+    e->nal_count = 0;
+    e->pts_us = frame.pts_us;
+    e->duration_us = frame.duration_us;
+    e->frame_class = 0;
+    e->temporal_id = 0;
+    e->samples_per_channel = 0;
+    if (fp_is_video_codec(h->codec)) {
+      e->frame_class = frame.u.video.frame_class;
+      e->temporal_id = frame.u.video.temporal_id;
+      e->flags |= frame.u.video.is_key_frame ? FP_INDEX_FLAG_KEY : 0;
+      e->flags |= frame.u.video.has_param_sets ? FP_INDEX_FLAG_PARAM_SETS : 0;
+      if (fp_is_annexb_codec(h->codec)) {
+        e->nal_count = ext && ext->nal_cnt > 0 ? (ext->nal_cnt > 0xffff ? 0xffff : ext->nal_cnt)
+                                                : index_count_nals(frame.ptr, frame.len);
+      }
+    } else {
+      e->samples_per_channel = frame.u.audio.samples_per_channel > 0xffff ? 0 : frame.u.audio.samples_per_channel;
+    }
+    h->release_frame(h, &frame);
+  }
+
+  fp_frame_ext_put(h, ext);
+  h->reset(h);
+
+  if (p_index->count == 0) {
+    fp_index_free(p_index);
+    return NULL;
+  }
+  return p_index;
+}
+
+fp_index_t *fp_index_open(media_parser_t *h, const char *path)
+{
+  fp_index_t *p_index = NULL;
+  fp_index_hdr_t hdr;
+  struct stat sb;
+  bool complete;
+  char *sidecar;
+
+  if (!h->frame_at || stat(path, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+    return NULL;
+  }
+  index_fill_hdr(&hdr, h, &sb);
+
+  sidecar = index_sidecar_path(path);
+  if (!sidecar) {
+    return NULL;
+  }
+
+  p_index = index_load(sidecar, &hdr);
+  if (p_index) {
+    AGO_LOGI("Frame index loaded from %s, %u frames", sidecar, p_index->count);
+  } else {
+    p_index = index_build(h, &complete);
+    if (p_index && complete) {
+      AGO_LOGI("Frame index built for %s, %u frames", path, p_index->count);
+      index_save(sidecar, &hdr, p_index);
+    } else if (p_index) {
+      // a read error cut the walk short; don't make later opens play a
+      // shortened file
+      AGO_LOGW("Frame index for %s stops at a read error after %u frames, not saved", path, p_index->count);
+    }
+  }
+
+  free(sidecar);
+  return p_index;
+}
+
+void fp_index_free(fp_index_t *p_index)
+{
+  if (p_index) {
+    free(p_index->entries);
+    free(p_index);
+  }
+}
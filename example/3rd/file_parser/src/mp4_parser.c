@@ -0,0 +1,1082 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * MP4 and fragmented MP4 demuxer. The moov sample tables and the
+ * moof/trun runs of one track are turned into a frame index on open;
+ * samples are then handed out straight from the mapped file.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file_parser.h"
+#include "file_parser_priv.h"
+
+#define MP4_TAG(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+// trun/trex sample flags (ISO/IEC 14496-12 8.8.3.1)
+#define MP4_SAMPLE_NON_SYNC 0x10000
+#define MP4_SAMPLE_IS_DEPENDED_ON(flags) (((flags) >> 22) & 3)
+
+// tfhd flags
+#define MP4_TFHD_BASE_DATA_OFFSET 0x1
+#define MP4_TFHD_SAMPLE_DESCRIPTION 0x2
+#define MP4_TFHD_DEFAULT_DURATION 0x8
+#define MP4_TFHD_DEFAULT_SIZE 0x10
+#define MP4_TFHD_DEFAULT_FLAGS 0x20
+
+// trun flags
+#define MP4_TRUN_DATA_OFFSET 0x1
+#define MP4_TRUN_FIRST_FLAGS 0x4
+#define MP4_TRUN_DURATION 0x100
+#define MP4_TRUN_SIZE 0x200
+#define MP4_TRUN_FLAGS 0x400
+#define MP4_TRUN_CTO 0x800
+
+typedef struct {
+  const uint8_t *data;
+  uint32_t size;
+  uint32_t type;
+} mp4_box_t;
+
+// What a track is and where its tables are. Box pointers point into the
+// mapped moov and are only valid while it stays in view.
+typedef struct {
+  uint32_t track_id;
+  // media_file_type_e, -1 for a codec nobody parses
+  int codec;
+  uint32_t timescale;
+  int width;
+  int height;
+  int sample_rate;
+  int channels;
+  // avcC/hvcC record, AudioSpecificConfig or dOps body
+  const uint8_t *config;
+  uint32_t config_len;
+  int nal_length_size;
+  mp4_box_t stts, ctts, stss, stsz, stz2, stsc, stco, co64, sdtp;
+  // trex defaults for fragments
+  uint32_t trex_duration;
+  uint32_t trex_size;
+  uint32_t trex_flags;
+} mp4_track_t;
+
+typedef struct {
+  fp_map_t map_;
+  uint32_t track_id_;
+  uint32_t timescale_;
+  int sample_rate_;
+  int nal_length_size_;
+  uint32_t trex_duration_;
+  uint32_t trex_size_;
+  uint32_t trex_flags_;
+  // decode time where the next fragment continues without a tfdt
+  int64_t next_dts_;
+  // entries are built with times in track ticks and converted at the end
+  fp_index_t *p_index_;
+  uint32_t cap_;
+  int64_t min_cts_;
+  // next sample for obtain_frame
+  uint32_t next_;
+  uint8_t *config_;
+} ctx_t;
+
+static inline uint16_t mp4_rb16(const uint8_t *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t mp4_rb32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline uint64_t mp4_rb64(const uint8_t *p)
+{
+  return ((uint64_t)mp4_rb32(p) << 32) | mp4_rb32(p + 4);
+}
+
+// Step to the next box in [*p, end); false at the end or on a malformed box
+static bool mp4_next_box(const uint8_t **p, const uint8_t *end, mp4_box_t *box)
+{
+  uint64_t size;
+  uint32_t hdr = 8;
+
+  if (end - *p < 8) {
+    return false;
+  }
+  size = mp4_rb32(*p);
+  box->type = mp4_rb32(*p + 4);
+  if (size == 1) {
+    if (end - *p < 16) {
+      return false;
+    }
+    size = mp4_rb64(*p + 8);
+    hdr = 16;
+  } else if (size == 0) {
+    size = end - *p;
+  }
+  if (size < hdr || size > (uint64_t)(end - *p)) {
+    return false;
+  }
+  box->data = *p + hdr;
+  box->size = (uint32_t)(size - hdr);
+  *p += size;
+  return true;
+}
+
+static bool mp4_find_box(const uint8_t *data, uint32_t size, uint32_t type, mp4_box_t *box)
+{
+  const uint8_t *p = data;
+  while (mp4_next_box(&p, data + size, box)) {
+    if (box->type == type) {
+      return true;
+    }
+  }
+  memset(box, 0, sizeof(mp4_box_t));
+  return false;
+}
+
+// Header of the top level box at offset: its payload offset and size
+static int mp4_top_box(fp_map_t *m, uint64_t offset, uint32_t *type, uint64_t *payload, uint64_t *size)
+{
+  const uint8_t *p;
+  uint64_t box_size;
+  uint32_t hdr = 8;
+
+  if (fp_map_view(m, offset, 16) < 0 || offset + 8 > m->size) {
+    return -1;
+  }
+  p = m->view + (offset - m->view_offset);
+  box_size = mp4_rb32(p);
+  *type = mp4_rb32(p + 4);
+  if (box_size == 1) {
+    if (offset + 16 > m->size) {
+      return -1;
+    }
+    box_size = mp4_rb64(p + 8);
+    hdr = 16;
+  } else if (box_size == 0) {
+    box_size = m->size - offset;
+  }
+  if (box_size < hdr) {
+    return -1;
+  }
+  // a file cut short still yields the samples that made it
+  if (offset + box_size > m->size) {
+    box_size = m->size - offset;
+  }
+  *payload = offset + hdr;
+  *size = box_size - hdr;
+  return 0;
+}
+
+// Length of an MPEG-4 descriptor (ISO/IEC 14496-1 8.3.3)
+static int mp4_descr_len(const uint8_t **p, const uint8_t *end)
+{
+  int len = 0;
+  int i;
+  for (i = 0; i < 4 && *p < end; i++) {
+    uint8_t c = *(*p)++;
+    len = (len << 7) | (c & 0x7f);
+    if (!(c & 0x80)) {
+      return len;
+    }
+  }
+  return -1;
+}
+
+// AudioSpecificConfig out of an esds box, which wraps it in an ES and a
+// decoder config descriptor
+static bool mp4_parse_esds(const mp4_box_t *esds, mp4_track_t *t)
+{
+  const uint8_t *p = esds->data + 4;
+  const uint8_t *end = esds->data + esds->size;
+  int len;
+
+  if (esds->size < 4 || p >= end || *p++ != 3 || mp4_descr_len(&p, end) < 0 || end - p < 3) {
+    return false;
+  }
+  uint8_t flags = p[2];
+  p += 3;
+  if (flags & 0x80) {
+    p += 2;
+  }
+  if (flags & 0x40) {
+    p += p < end ? 1 + *p : 0;
+  }
+  if (flags & 0x20) {
+    p += 2;
+  }
+  if (p >= end || *p++ != 4 || mp4_descr_len(&p, end) < 0 || end - p < 13) {
+    return false;
+  }
+  // MPEG-4 AAC, or one of the MPEG-2 AAC profiles
+  if (p[0] != 0x40 && (p[0] < 0x66 || p[0] > 0x68)) {
+    return false;
+  }
+  p += 13;
+  if (p >= end || *p++ != 5 || (len = mp4_descr_len(&p, end)) < 2 || len > end - p) {
+    return false;
+  }
+  t->config = p;
+  t->config_len = len;
+
+  // SBR signalled explicitly makes it HE-AAC
+  int object_type = p[0] >> 3;
+  t->codec = (object_type == 5 || object_type == 29) ? MEDIA_FILE_TYPE_HEAAC : MEDIA_FILE_TYPE_AACLC;
+  return true;
+}
+
+static void mp4_parse_stsd(const mp4_box_t *stsd, mp4_track_t *t)
+{
+  const uint8_t *p = stsd->data + 8;
+  const uint8_t *end = stsd->data + stsd->size;
+  mp4_box_t entry, config;
+
+  // only the first sample description is used
+  if (stsd->size < 8 || !mp4_next_box(&p, end, &entry)) {
+    return;
+  }
+
+  switch (entry.type) {
+  case MP4_TAG('a', 'v', 'c', '1'):
+  case MP4_TAG('a', 'v', 'c', '3'):
+  case MP4_TAG('h', 'v', 'c', '1'):
+  case MP4_TAG('h', 'e', 'v', '1'): {
+    bool h265 = entry.type == MP4_TAG('h', 'v', 'c', '1') || entry.type == MP4_TAG('h', 'e', 'v', '1');
+    // a visual sample entry has 78 bytes of fields before its boxes
+    if (entry.size < 78 ||
+        !mp4_find_box(entry.data + 78, entry.size - 78, h265 ? MP4_TAG('h', 'v', 'c', 'C') : MP4_TAG('a', 'v', 'c', 'C'),
+                      &config) ||
+        config.size < (h265 ? 23u : 7u)) {
+      return;
+    }
+    t->width = mp4_rb16(entry.data + 24);
+    t->height = mp4_rb16(entry.data + 26);
+    t->config = config.data;
+    t->config_len = config.size;
+    t->nal_length_size = ((h265 ? config.data[21] : config.data[4]) & 3) + 1;
+    t->codec = h265 ? MEDIA_FILE_TYPE_H265 : MEDIA_FILE_TYPE_H264;
+    break;
+  }
+  case MP4_TAG('v', 'p', '0', '8'):
+    if (entry.size < 78) {
+      return;
+    }
+    t->width = mp4_rb16(entry.data + 24);
+    t->height = mp4_rb16(entry.data + 26);
+    if (mp4_find_box(entry.data + 78, entry.size - 78, MP4_TAG('v', 'p', 'c', 'C'), &config)) {
+      t->config = config.data;
+      t->config_len = config.size;
+    }
+    t->codec = MEDIA_FILE_TYPE_VP8;
+    break;
+  case MP4_TAG('m', 'p', '4', 'a'):
+  case MP4_TAG('O', 'p', 'u', 's'): {
+    // an audio sample entry has 28 bytes of fields; QuickTime sound
+    // description versions 1 and 2 add more
+    uint32_t fields = 28;
+    if (entry.size < fields) {
+      return;
+    }
+    int version = mp4_rb16(entry.data + 8);
+    fields += version == 1 ? 16 : (version == 2 ? 36 : 0);
+    if (entry.size < fields) {
+      return;
+    }
+    t->channels = mp4_rb16(entry.data + 16);
+    t->sample_rate = mp4_rb32(entry.data + 24) >> 16;
+    if (entry.type == MP4_TAG('O', 'p', 'u', 's')) {
+      if (!mp4_find_box(entry.data + fields, entry.size - fields, MP4_TAG('d', 'O', 'p', 's'), &config) ||
+          config.size < 11) {
+        return;
+      }
+      t->config = config.data;
+      t->config_len = config.size;
+      t->channels = config.data[1];
+      t->sample_rate = 48000;
+      t->codec = MEDIA_FILE_TYPE_OPUS;
+    } else if (mp4_find_box(entry.data + fields, entry.size - fields, MP4_TAG('e', 's', 'd', 's'), &config)) {
+      mp4_parse_esds(&config, t);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+static bool mp4_parse_trak(const mp4_box_t *trak, mp4_track_t *t)
+{
+  mp4_box_t tkhd, mdia, mdhd, minf, stbl, stsd;
+
+  memset(t, 0, sizeof(mp4_track_t));
+  t->codec = -1;
+  if (!mp4_find_box(trak->data, trak->size, MP4_TAG('t', 'k', 'h', 'd'), &tkhd) || tkhd.size < 24 ||
+      !mp4_find_box(trak->data, trak->size, MP4_TAG('m', 'd', 'i', 'a'), &mdia) ||
+      !mp4_find_box(mdia.data, mdia.size, MP4_TAG('m', 'd', 'h', 'd'), &mdhd) || mdhd.size < 24 ||
+      !mp4_find_box(mdia.data, mdia.size, MP4_TAG('m', 'i', 'n', 'f'), &minf) ||
+      !mp4_find_box(minf.data, minf.size, MP4_TAG('s', 't', 'b', 'l'), &stbl) ||
+      !mp4_find_box(stbl.data, stbl.size, MP4_TAG('s', 't', 's', 'd'), &stsd)) {
+    return false;
+  }
+  t->track_id = mp4_rb32(tkhd.data + (tkhd.data[0] == 1 ? 20 : 12));
+  t->timescale = mp4_rb32(mdhd.data + (mdhd.data[0] == 1 ? 20 : 12));
+  if (t->timescale == 0) {
+    return false;
+  }
+  mp4_parse_stsd(&stsd, t);
+
+  mp4_find_box(stbl.data, stbl.size, MP4_TAG('s', 't', 't', 's'), &t->stts);
+  mp4_find_box(stbl.data, stbl.size, MP4_TAG('c', 't', 't', 's'), &t->ctts);
+  mp4_find_box(stbl.data, stbl.size, MP4_TAG('s', 't', 's', 's'), &t->stss);
+  mp4_find_box(stbl.data, stbl.size, MP4_TAG('s', 't', 's', 'z'), &t->stsz);
+  mp4_find_box(stbl.data, stbl.size, MP4_TAG('s', 't', 'z', '2'), &t->stz2);
+  mp4_find_box(stbl.data, stbl.size, MP4_TAG('s', 't', 's', 'c'), &t->stsc);
+  mp4_find_box(stbl.data, stbl.size, MP4_TAG('s', 't', 'c', 'o'), &t->stco);
+  mp4_find_box(stbl.data, stbl.size, MP4_TAG('c', 'o', '6', '4'), &t->co64);
+  mp4_find_box(stbl.data, stbl.size, MP4_TAG('s', 'd', 't', 'p'), &t->sdtp);
+  return true;
+}
+
+static bool mp4_codec_matches(int want, int have)
+{
+  if (want == MEDIA_FILE_TYPE_AACLC || want == MEDIA_FILE_TYPE_HEAAC) {
+    return have == MEDIA_FILE_TYPE_AACLC || have == MEDIA_FILE_TYPE_HEAAC;
+  }
+  return want == have;
+}
+
+// The first track of the wanted codec in moov. With want -1, the first
+// video track, else the first audio track; with want -2 the first audio one.
+static bool mp4_pick_track(const uint8_t *moov, uint32_t size, int want, mp4_track_t *t)
+{
+  const uint8_t *p = moov;
+  mp4_box_t box, mvex, trex;
+  mp4_track_t cand;
+  bool found = false;
+
+  while (mp4_next_box(&p, moov + size, &box)) {
+    if (box.type != MP4_TAG('t', 'r', 'a', 'k') || !mp4_parse_trak(&box, &cand) || cand.codec < 0) {
+      continue;
+    }
+    if (want >= 0 ? mp4_codec_matches(want, cand.codec)
+                  : (want == -2 ? !fp_is_video_codec(cand.codec) : fp_is_video_codec(cand.codec))) {
+      *t = cand;
+      found = true;
+      break;
+    }
+    if (want == -1 && !found && !fp_is_video_codec(cand.codec)) {
+      *t = cand;
+      found = true;
+    }
+  }
+  if (!found) {
+    return false;
+  }
+
+  // defaults for the track's fragments
+  if (mp4_find_box(moov, size, MP4_TAG('m', 'v', 'e', 'x'), &mvex)) {
+    p = mvex.data;
+    while (mp4_next_box(&p, mvex.data + mvex.size, &trex)) {
+      if (trex.type == MP4_TAG('t', 'r', 'e', 'x') && trex.size >= 24 && mp4_rb32(trex.data + 4) == t->track_id) {
+        t->trex_duration = mp4_rb32(trex.data + 12);
+        t->trex_size = mp4_rb32(trex.data + 16);
+        t->trex_flags = mp4_rb32(trex.data + 20);
+      }
+    }
+  }
+  return true;
+}
+
+static int mp4_add_sample(ctx_t *p_ctx, uint64_t offset, uint32_t size, int64_t dts, uint32_t duration, int64_t cto,
+                          bool key, bool disposable)
+{
+  fp_index_t *p_index = p_ctx->p_index_;
+  fp_index_entry_t *e;
+
+  if (p_index->count == p_ctx->cap_) {
+    if (p_ctx->cap_ > UINT32_MAX / 2) {
+      return -1;
+    }
+    uint32_t new_cap = p_ctx->cap_ ? p_ctx->cap_ * 2 : 1024;
+    fp_index_entry_t *entries = (fp_index_entry_t *)realloc(p_index->entries, new_cap * sizeof(fp_index_entry_t));
+    if (!entries) {
+      return -1;
+    }
+    p_index->entries = entries;
+    p_ctx->cap_ = new_cap;
+  }
+
+  e = &p_index->entries[p_index->count++];
+  memset(e, 0, sizeof(fp_index_entry_t));
+  e->offset = offset;
+  e->len = size;
+  e->flags = key ? FP_INDEX_FLAG_KEY : 0;
+  // ticks until the table is complete
+  e->pts_us = dts + cto;
+  e->duration_us = duration;
+  e->frame_class = key ? VIDEO_FRAME_CLASS_KEY : (disposable ? VIDEO_FRAME_CLASS_DISPOSABLE : VIDEO_FRAME_CLASS_REFERENCE);
+  if (e->pts_us < p_ctx->min_cts_) {
+    p_ctx->min_cts_ = e->pts_us;
+  }
+  return 0;
+}
+
+// Walk the moov sample tables: stsc maps samples to the chunks of stco,
+// stsz sizes them, stts/ctts time them and stss/sdtp classify them
+static int mp4_build_stbl(ctx_t *p_ctx, const mp4_track_t *t)
+{
+  const mp4_box_t *co = t->co64.data ? &t->co64 : &t->stco;
+  int co_size = t->co64.data ? 8 : 4;
+  uint32_t count, const_size = 0, field_bits = 32;
+  uint32_t chunks, stsc_cnt, stts_cnt, ctts_cnt, stss_cnt;
+  uint32_t stsc_i = 0, stts_i = 0, stts_left, ctts_i = 0, ctts_left, stss_i = 0;
+  uint32_t sample = 0, chunk;
+  int64_t dts = 0;
+
+  if (t->stsz.data && t->stsz.size >= 12) {
+    const_size = mp4_rb32(t->stsz.data + 4);
+    count = mp4_rb32(t->stsz.data + 8);
+    if (!const_size && count > (t->stsz.size - 12) / 4) {
+      count = (t->stsz.size - 12) / 4;
+    }
+  } else if (t->stz2.data && t->stz2.size >= 12) {
+    field_bits = t->stz2.data[7];
+    count = mp4_rb32(t->stz2.data + 8);
+    if (field_bits != 4 && field_bits != 8 && field_bits != 16) {
+      return -1;
+    }
+    if ((uint64_t)count * field_bits > (uint64_t)(t->stz2.size - 12) * 8) {
+      count = (uint32_t)((uint64_t)(t->stz2.size - 12) * 8 / field_bits);
+    }
+  } else {
+    return 0;
+  }
+  if (count == 0 || !co->data || co->size < 8 || !t->stsc.data || t->stsc.size < 8 || !t->stts.data ||
+      t->stts.size < 8) {
+    return 0;
+  }
+
+  chunks = mp4_rb32(co->data + 4);
+  if (chunks > (co->size - 8) / co_size) {
+    chunks = (co->size - 8) / co_size;
+  }
+  stsc_cnt = mp4_rb32(t->stsc.data + 4);
+  if (stsc_cnt > (t->stsc.size - 8) / 12) {
+    stsc_cnt = (t->stsc.size - 8) / 12;
+  }
+  stts_cnt = mp4_rb32(t->stts.data + 4);
+  if (stts_cnt > (t->stts.size - 8) / 8) {
+    stts_cnt = (t->stts.size - 8) / 8;
+  }
+  ctts_cnt = 0;
+  if (t->ctts.data && t->ctts.size >= 8) {
+    ctts_cnt = mp4_rb32(t->ctts.data + 4);
+    if (ctts_cnt > (t->ctts.size - 8) / 8) {
+      ctts_cnt = (t->ctts.size - 8) / 8;
+    }
+  }
+  // no stss: every sample is a sync sample
+  stss_cnt = 0;
+  if (t->stss.data && t->stss.size >= 8) {
+    stss_cnt = mp4_rb32(t->stss.data + 4);
+    if (stss_cnt > (t->stss.size - 8) / 4) {
+      stss_cnt = (t->stss.size - 8) / 4;
+    }
+  }
+  if (stsc_cnt == 0 || stts_cnt == 0) {
+    return 0;
+  }
+  stts_left = mp4_rb32(t->stts.data + 8);
+  ctts_left = ctts_cnt ? mp4_rb32(t->ctts.data + 8) : 0;
+
+  for (chunk = 0; chunk < chunks && sample < count; chunk++) {
+    uint64_t offset = co_size == 8 ? mp4_rb64(co->data + 8 + 8 * chunk) : mp4_rb32(co->data + 8 + 4 * chunk);
+    uint32_t per_chunk, i;
+
+    // stsc runs are keyed by their 1-based first chunk
+    while (stsc_i + 1 < stsc_cnt && chunk + 1 >= mp4_rb32(t->stsc.data + 8 + 12 * (stsc_i + 1))) {
+      stsc_i++;
+    }
+    per_chunk = mp4_rb32(t->stsc.data + 8 + 12 * stsc_i + 4);
+
+    for (i = 0; i < per_chunk && sample < count; i++, sample++) {
+      uint32_t size, delta;
+      int64_t cto = 0;
+      bool key = true, disposable = false;
+
+      if (const_size) {
+        size = const_size;
+      } else if (t->stsz.data && t->stsz.size >= 12) {
+        size = mp4_rb32(t->stsz.data + 12 + 4 * sample);
+      } else if (field_bits == 16) {
+        size = mp4_rb16(t->stz2.data + 12 + 2 * sample);
+      } else if (field_bits == 8) {
+        size = t->stz2.data[12 + sample];
+      } else {
+        uint8_t b = t->stz2.data[12 + sample / 2];
+        size = (sample & 1) ? (b & 0x0f) : (b >> 4);
+      }
+
+      while (stts_left == 0 && stts_i + 1 < stts_cnt) {
+        stts_i++;
+        stts_left = mp4_rb32(t->stts.data + 8 + 8 * stts_i);
+      }
+      delta = mp4_rb32(t->stts.data + 8 + 8 * stts_i + 4);
+      if (stts_left) {
+        stts_left--;
+      }
+
+      if (ctts_cnt) {
+        while (ctts_left == 0 && ctts_i + 1 < ctts_cnt) {
+          ctts_i++;
+          ctts_left = mp4_rb32(t->ctts.data + 8 + 8 * ctts_i);
+        }
+        // version 1 offsets are signed; version 0 ones are in practice too
+        cto = (int32_t)mp4_rb32(t->ctts.data + 8 + 8 * ctts_i + 4);
+        if (ctts_left) {
+          ctts_left--;
+        }
+      }
+
+      if (stss_cnt) {
+        while (stss_i < stss_cnt && mp4_rb32(t->stss.data + 8 + 4 * stss_i) < sample + 1) {
+          stss_i++;
+        }
+        key = stss_i < stss_cnt && mp4_rb32(t->stss.data + 8 + 4 * stss_i) == sample + 1;
+      }
+      if (t->sdtp.data && t->sdtp.size > 4 + sample) {
+        disposable = ((t->sdtp.data[4 + sample] >> 2) & 3) == 2;
+      }
+
+      if (offset + size > p_ctx->map_.size) {
+        AGO_LOGW("parser: mp4 sample %u lies past the end of file", sample);
+        return 0;
+      }
+      if (mp4_add_sample(p_ctx, offset, size, dts, delta, cto, key, disposable) < 0) {
+        return -1;
+      }
+      offset += size;
+      dts += delta;
+    }
+  }
+  p_ctx->next_dts_ = dts;
+  return 0;
+}
+
+static int mp4_parse_trun(ctx_t *p_ctx, const mp4_box_t *trun, uint64_t *data_offset, uint64_t base, int64_t *dts,
+                          uint32_t def_duration, uint32_t def_size, uint32_t def_flags)
+{
+  uint32_t flags, count, i;
+  uint32_t first_flags = def_flags;
+  const uint8_t *p = trun->data + 8;
+  const uint8_t *end = trun->data + trun->size;
+  int per_sample = 0;
+
+  if (trun->size < 8) {
+    return 0;
+  }
+  flags = mp4_rb32(trun->data) & 0xffffff;
+  count = mp4_rb32(trun->data + 4);
+  if (flags & MP4_TRUN_DATA_OFFSET) {
+    if (end - p < 4) {
+      return 0;
+    }
+    *data_offset = base + (int32_t)mp4_rb32(p);
+    p += 4;
+  }
+  if (flags & MP4_TRUN_FIRST_FLAGS) {
+    if (end - p < 4) {
+      return 0;
+    }
+    first_flags = mp4_rb32(p);
+    p += 4;
+  }
+  per_sample = 4 * (((flags & MP4_TRUN_DURATION) != 0) + ((flags & MP4_TRUN_SIZE) != 0) +
+                    ((flags & MP4_TRUN_FLAGS) != 0) + ((flags & MP4_TRUN_CTO) != 0));
+  if (per_sample && count > (uint32_t)(end - p) / per_sample) {
+    count = (uint32_t)(end - p) / per_sample;
+  }
+  // with the default size for all of them, only as many as the file holds
+  if (!(flags & MP4_TRUN_SIZE)) {
+    uint64_t left = *data_offset < p_ctx->map_.size ? p_ctx->map_.size - *data_offset : 0;
+    if (def_size == 0) {
+      AGO_LOGW("parser: mp4 fragment samples have no size");
+      return 0;
+    }
+    if (count > left / def_size) {
+      count = (uint32_t)(left / def_size);
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    uint32_t duration = def_duration, size = def_size;
+    uint32_t sample_flags = i == 0 ? first_flags : def_flags;
+    int64_t cto = 0;
+
+    if (flags & MP4_TRUN_DURATION) {
+      duration = mp4_rb32(p);
+      p += 4;
+    }
+    if (flags & MP4_TRUN_SIZE) {
+      size = mp4_rb32(p);
+      p += 4;
+    }
+    if (flags & MP4_TRUN_FLAGS) {
+      sample_flags = mp4_rb32(p);
+      p += 4;
+    }
+    if (flags & MP4_TRUN_CTO) {
+      cto = trun->data[0] == 0 ? (int64_t)mp4_rb32(p) : (int64_t)(int32_t)mp4_rb32(p);
+      p += 4;
+    }
+
+    if (*data_offset + size > p_ctx->map_.size) {
+      AGO_LOGW("parser: mp4 fragment sample lies past the end of file");
+      return 0;
+    }
+    // nothing to hand out; its time still passes
+    if (size == 0) {
+      *dts += duration;
+      continue;
+    }
+    if (mp4_add_sample(p_ctx, *data_offset, size, *dts, duration, cto, !(sample_flags & MP4_SAMPLE_NON_SYNC),
+                       MP4_SAMPLE_IS_DEPENDED_ON(sample_flags) == 2) < 0) {
+      return -1;
+    }
+    *data_offset += size;
+    *dts += duration;
+  }
+  return 0;
+}
+
+// The track's samples in one moof, whose header starts at moof_offset
+static int mp4_parse_moof(ctx_t *p_ctx, const uint8_t *moof, uint32_t size, uint64_t moof_offset)
+{
+  const uint8_t *p = moof;
+  mp4_box_t traf, box;
+
+  while (mp4_next_box(&p, moof + size, &traf)) {
+    const uint8_t *q = traf.data;
+    uint64_t base = moof_offset, data_offset;
+    uint32_t flags, def_duration = p_ctx->trex_duration_, def_size = p_ctx->trex_size_, def_flags = p_ctx->trex_flags_;
+    int64_t dts = p_ctx->next_dts_;
+    int pos = 8;
+
+    if (traf.type != MP4_TAG('t', 'r', 'a', 'f') ||
+        !mp4_find_box(traf.data, traf.size, MP4_TAG('t', 'f', 'h', 'd'), &box) || box.size < 8 ||
+        mp4_rb32(box.data + 4) != p_ctx->track_id_) {
+      continue;
+    }
+    flags = mp4_rb32(box.data) & 0xffffff;
+    // without an explicit base, data offsets count from the moof
+    if ((flags & MP4_TFHD_BASE_DATA_OFFSET) && box.size >= 16) {
+      base = mp4_rb64(box.data + 8);
+      pos += 8;
+    }
+    if (flags & MP4_TFHD_SAMPLE_DESCRIPTION) {
+      pos += 4;
+    }
+    if ((flags & MP4_TFHD_DEFAULT_DURATION) && box.size >= (uint32_t)pos + 4) {
+      def_duration = mp4_rb32(box.data + pos);
+      pos += 4;
+    }
+    if ((flags & MP4_TFHD_DEFAULT_SIZE) && box.size >= (uint32_t)pos + 4) {
+      def_size = mp4_rb32(box.data + pos);
+      pos += 4;
+    }
+    if ((flags & MP4_TFHD_DEFAULT_FLAGS) && box.size >= (uint32_t)pos + 4) {
+      def_flags = mp4_rb32(box.data + pos);
+    }
+
+    if (mp4_find_box(traf.data, traf.size, MP4_TAG('t', 'f', 'd', 't'), &box) && box.size >= 8) {
+      dts = box.data[0] == 1 && box.size >= 12 ? (int64_t)mp4_rb64(box.data + 4) : (int64_t)mp4_rb32(box.data + 4);
+    }
+
+    // a trun without a data offset continues where the previous one ended
+    data_offset = base;
+    while (mp4_next_box(&q, traf.data + traf.size, &box)) {
+      if (box.type == MP4_TAG('t', 'r', 'u', 'n') &&
+          mp4_parse_trun(p_ctx, &box, &data_offset, base, &dts, def_duration, def_size, def_flags) < 0) {
+        return -1;
+      }
+    }
+    p_ctx->next_dts_ = dts;
+  }
+  return 0;
+}
+
+// Put the parameter sets of an avcC/hvcC record in the cache, which also
+// yields the stream info
+static void mp4_load_param_sets(media_parser_t *h, const mp4_track_t *t)
+{
+  const uint8_t *p = t->config;
+  const uint8_t *end = t->config + t->config_len;
+  bool h265 = t->codec == MEDIA_FILE_TYPE_H265;
+  uint8_t *annexb = (uint8_t *)malloc(2 * t->config_len);
+  uint32_t len = 0;
+  int arrays, i, j;
+
+  if (!annexb) {
+    return;
+  }
+  if (h265) {
+    arrays = p[22];
+    p += 23;
+  } else {
+    // the SPS count, and the PPS count as a second array
+    arrays = 2;
+    p += 5;
+  }
+  for (i = 0; i < arrays && p < end; i++) {
+    int nals;
+    if (h265) {
+      if (end - p < 3) {
+        break;
+      }
+      nals = mp4_rb16(p + 1);
+      p += 3;
+    } else {
+      nals = i == 0 ? (*p & 0x1f) : *p;
+      p++;
+    }
+    for (j = 0; j < nals && end - p >= 2; j++) {
+      uint32_t nal_len = mp4_rb16(p);
+      if (nal_len > (uint32_t)(end - p - 2)) {
+        break;
+      }
+      // a 3 byte start code replaces each 2 byte length, so twice the
+      // record always fits
+      annexb[len++] = 0;
+      annexb[len++] = 0;
+      annexb[len++] = 1;
+      memcpy(annexb + len, p + 2, nal_len);
+      len += nal_len;
+      p += 2 + nal_len;
+    }
+  }
+
+  fp_annexb_stream_info(annexb, len, h265, &h->video_info, &h->ps_cache);
+  free(annexb);
+}
+
+static int mp4_open(media_parser_t *h, const char *path)
+{
+  uint64_t offset = 0, payload, size, moov = 0, moov_size = 0;
+  uint32_t type;
+  mp4_track_t t;
+  uint32_t i;
+
+  if (h->is_stream) {
+    AGO_LOGE("parser: mp4 can't be read from a stream");
+    return -1;
+  }
+
+  ctx_t *p_ctx = (ctx_t *)calloc(1, sizeof(ctx_t));
+  if (!p_ctx) {
+    return -1;
+  }
+  if (fp_map_open(&p_ctx->map_, path, FP_MAP_WINDOW_SIZE) < 0) {
+    AGO_LOGE("open %s failed", path);
+    free(p_ctx);
+    return -1;
+  }
+  p_ctx->p_index_ = (fp_index_t *)calloc(1, sizeof(fp_index_t));
+  if (!p_ctx->p_index_) {
+    goto fail;
+  }
+  p_ctx->min_cts_ = INT64_MAX;
+
+  while (mp4_top_box(&p_ctx->map_, offset, &type, &payload, &size) == 0) {
+    if (type == MP4_TAG('m', 'o', 'o', 'v')) {
+      moov = payload;
+      moov_size = size;
+      break;
+    }
+    offset = payload + size;
+  }
+  if (!moov || moov_size > UINT32_MAX ||
+      fp_map_view(&p_ctx->map_, moov, moov_size) < 0) {
+    AGO_LOGE("parser: no usable moov in %s", path);
+    goto fail;
+  }
+  if (!mp4_pick_track(p_ctx->map_.view + (moov - p_ctx->map_.view_offset), (uint32_t)moov_size, h->codec, &t)) {
+    AGO_LOGE("parser: %s has no track of type %d", path, h->codec);
+    goto fail;
+  }
+
+  p_ctx->track_id_ = t.track_id;
+  p_ctx->timescale_ = t.timescale;
+  p_ctx->sample_rate_ = t.sample_rate;
+  p_ctx->nal_length_size_ = t.nal_length_size;
+  p_ctx->trex_duration_ = t.trex_duration;
+  p_ctx->trex_size_ = t.trex_size;
+  p_ctx->trex_flags_ = t.trex_flags;
+  if (t.config_len) {
+    p_ctx->config_ = (uint8_t *)malloc(t.config_len);
+    if (!p_ctx->config_) {
+      goto fail;
+    }
+    memcpy(p_ctx->config_, t.config, t.config_len);
+    h->codec_config = p_ctx->config_;
+    h->codec_config_len = t.config_len;
+  }
+  h->nal_length_size = t.nal_length_size;
+  if (t.nal_length_size) {
+    mp4_load_param_sets(h, &t);
+  }
+  if (h->video_info.width == 0) {
+    h->video_info.width = t.width;
+    h->video_info.height = t.height;
+  }
+  if (mp4_build_stbl(p_ctx, &t) < 0) {
+    goto fail;
+  }
+
+  // fragments follow the moov
+  offset = 0;
+  while (mp4_top_box(&p_ctx->map_, offset, &type, &payload, &size) == 0) {
+    if (type == MP4_TAG('m', 'o', 'o', 'f') && size <= UINT32_MAX && fp_map_view(&p_ctx->map_, payload, size) == 0 &&
+        mp4_parse_moof(p_ctx, p_ctx->map_.view + (payload - p_ctx->map_.view_offset), (uint32_t)size, offset) < 0) {
+      goto fail;
+    }
+    offset = payload + size;
+  }
+
+  if (p_ctx->p_index_->count == 0) {
+    AGO_LOGE("parser: no samples in %s", path);
+    goto fail;
+  }
+
+  // presentation starts at 0; the frame rate, if the SPS had none, comes
+  // from the first sample's duration
+  if (fp_is_video_codec(h->codec) && h->video_info.fps_num == 0 && p_ctx->p_index_->entries[0].duration_us) {
+    h->video_info.fps_num = t.timescale;
+    h->video_info.fps_den = p_ctx->p_index_->entries[0].duration_us;
+  }
+  for (i = 0; i < p_ctx->p_index_->count; i++) {
+    fp_index_entry_t *e = &p_ctx->p_index_->entries[i];
+    uint64_t cts = (uint64_t)(e->pts_us - p_ctx->min_cts_);
+    uint32_t duration = e->duration_us;
+
+    if (!fp_is_video_codec(h->codec)) {
+      uint64_t samples = t.sample_rate ? (uint64_t)duration * t.sample_rate / t.timescale : 0;
+      e->samples_per_channel = samples > 0xffff ? 0 : (uint16_t)samples;
+      e->flags = 0;
+      e->frame_class = 0;
+    }
+    e->pts_us = fp_ticks_to_us(cts, t.timescale);
+    e->duration_us = (uint32_t)(fp_ticks_to_us(cts + duration, t.timescale) - e->pts_us);
+  }
+
+  AGO_LOGI("mp4 track %u: %u samples", t.track_id, p_ctx->p_index_->count);
+  // the sample table serves as the frame index
+  h->p_index = p_ctx->p_index_;
+  h->p_ctx = (void *)p_ctx;
+  return 0;
+
+fail:
+  fp_index_free(p_ctx->p_index_);
+  free(p_ctx->config_);
+  h->codec_config = NULL;
+  h->codec_config_len = 0;
+  fp_map_close(&p_ctx->map_);
+  free(p_ctx);
+  return -1;
+}
+
+static int mp4_frame_at(media_parser_t *h, uint64_t offset, uint32_t len, frame_t *p_frame)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  uint32_t nls, pos = 0;
+
+  if (!p_ctx || offset + len > p_ctx->map_.size || fp_map_view(&p_ctx->map_, offset, len) < 0) {
+    return -1;
+  }
+
+  p_frame->ptr = p_ctx->map_.view + (offset - p_ctx->map_.view_offset);
+  p_frame->offset = offset;
+  p_frame->len = len;
+  p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+
+  // the nal list comes from the length fields, without any scanning
+  fp_frame_clear_nals(p_frame);
+  nls = p_ctx->nal_length_size_;
+  if (!nls || !p_frame->ext) {
+    return 0;
+  }
+  while (pos + nls <= len) {
+    uint32_t nal_len = 0, k;
+    for (k = 0; k < nls; k++) {
+      nal_len = (nal_len << 8) | p_frame->ptr[pos + k];
+    }
+    pos += nls;
+    if (nal_len > len - pos) {
+      break;
+    }
+    if (nal_len == 0) {
+      continue;
+    }
+    uint8_t hdr = p_frame->ptr[pos];
+    if (fp_frame_ext_add_nal(p_frame->ext, pos, nal_len,
+                             h->codec == MEDIA_FILE_TYPE_H265 ? (hdr >> 1) & 0x3f : hdr & 0x1f) < 0) {
+      AGO_LOGE("parser: out of memory for the nals of the mp4 sample at %llu", (unsigned long long)offset);
+      break;
+    }
+    pos += nal_len;
+  }
+  // the rest would go out with its length fields taken for nal data
+  if (pos != len) {
+    AGO_LOGE("parser: mp4 sample at %llu doesn't split into nals", (unsigned long long)offset);
+    fp_map_unref((fp_map_window_t *)p_frame->p_priv);
+    p_frame->p_priv = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static int mp4_obtain_frame(media_parser_t *h, frame_t *p_frame)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  fp_index_entry_t *e;
+
+  if (!p_ctx) {
+    AGO_LOGE("parser: invalid ctx");
+    return -1;
+  }
+  if (p_ctx->next_ >= p_ctx->p_index_->count) {
+    return -2;
+  }
+
+  e = &p_ctx->p_index_->entries[p_ctx->next_];
+  if (mp4_frame_at(h, e->offset, e->len, p_frame) < 0) {
+    return -1;
+  }
+  p_ctx->next_++;
+  p_frame->type = h->type;
+  p_frame->pts_us = e->pts_us;
+  p_frame->duration_us = e->duration_us;
+  if (fp_is_video_codec(h->codec)) {
+    p_frame->u.video.is_key_frame = (e->flags & FP_INDEX_FLAG_KEY) != 0;
+    p_frame->u.video.has_param_sets = false;
+    p_frame->u.video.frame_class = e->frame_class;
+    p_frame->u.video.temporal_id = 0;
+  } else {
+    p_frame->u.audio.samples_per_channel = e->samples_per_channel;
+  }
+  return 0;
+}
+
+static int mp4_release_frame(media_parser_t *h, frame_t *p_frame)
+{
+  fp_map_unref((fp_map_window_t *)p_frame->p_priv);
+  p_frame->p_priv = NULL;
+  return 0;
+}
+
+static int mp4_reset(media_parser_t *h)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    return -1;
+  }
+
+  p_ctx->next_ = 0;
+  return 0;
+}
+
+static int mp4_close(media_parser_t *h)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    return -1;
+  }
+
+  // the index itself belongs to the parser now
+  fp_map_close(&p_ctx->map_);
+  free(p_ctx->config_);
+  free(p_ctx);
+  h->p_ctx = NULL;
+
+  return 0;
+}
+
+bool fp_mp4_is_mp4(const char *path)
+{
+  uint8_t hdr[8];
+  bool is_mp4 = false;
+  int fd;
+
+  if (fp_map_path_is_stream(path)) {
+    return false;
+  }
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  if (read(fd, hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr)) {
+    uint32_t type = mp4_rb32(hdr + 4);
+    is_mp4 = type == MP4_TAG('f', 't', 'y', 'p') || type == MP4_TAG('s', 't', 'y', 'p') ||
+             type == MP4_TAG('m', 'o', 'o', 'v');
+  }
+  close(fd);
+  return is_mp4;
+}
+
+int fp_mp4_probe(const char *path, bool audio, media_file_type_e *p_type, parser_cfg_t *p_cfg)
+{
+  uint64_t offset = 0, payload, size;
+  uint32_t type;
+  mp4_track_t t;
+  fp_map_t map;
+  int ret = -1;
+
+  if (fp_map_open(&map, path, FP_MAP_WINDOW_SIZE) < 0) {
+    return -1;
+  }
+  while (mp4_top_box(&map, offset, &type, &payload, &size) == 0) {
+    if (type == MP4_TAG('m', 'o', 'o', 'v')) {
+      if (size <= UINT32_MAX && fp_map_view(&map, payload, size) == 0 &&
+          mp4_pick_track(map.view + (payload - map.view_offset), (uint32_t)size, audio ? -2 : -1, &t)) {
+        ret = 0;
+      }
+      break;
+    }
+    offset = payload + size;
+  }
+  fp_map_close(&map);
+  if (ret < 0) {
+    return -1;
+  }
+
+  *p_type = (media_file_type_e)t.codec;
+  if (!fp_is_video_codec(t.codec)) {
+    p_cfg->u.audio_cfg.sampleRateHz = t.sample_rate;
+    p_cfg->u.audio_cfg.numberOfChannels = t.channels;
+    // an AAC frame always carries 1024 samples
+    p_cfg->u.audio_cfg.framePeriodMs =
+      t.codec == MEDIA_FILE_TYPE_OPUS || t.sample_rate == 0 ? 20 : (1024 * 1000 + t.sample_rate / 2) / t.sample_rate;
+  }
+  return 0;
+}
+
+media_parser_t media_parser_mp4 = {
+  .codec = -1,
+  .name = "mp4",
+  .p_ctx = NULL,
+
+  .open = mp4_open,
+  .obtain_frame = mp4_obtain_frame,
+  .release_frame = mp4_release_frame,
+  .reset = mp4_reset,
+  .close = mp4_close,
+  .frame_at = mp4_frame_at,
+};
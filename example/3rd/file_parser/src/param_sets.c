@@ -0,0 +1,648 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * H.264 SPS and H.265 VPS/SPS parsing for the stream properties:
+ * picture size after cropping and the frame rate from the VUI/VPS
+ * timing info. Also the cache of the latest parameter sets that gets
+ * put in front of key frames lacking their own.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_parser_priv.h"
+
+static void h264_skip_scaling_list(fp_bitreader_t *br, int size)
+{
+  int last_scale = 8;
+  int next_scale = 8;
+  int j;
+
+  for (j = 0; j < size && next_scale != 0 && !br->overrun; j++) {
+    int delta_scale = fp_br_se(br);
+    next_scale = (last_scale + delta_scale + 256) % 256;
+    if (next_scale != 0) {
+      last_scale = next_scale;
+    }
+  }
+}
+
+int fp_h264_parse_sps(const uint8_t *nal, int len, video_stream_info_t *info)
+{
+  fp_bitreader_t br;
+  int i;
+
+  // skip the one byte nal header
+  if (len < 2) {
+    return -1;
+  }
+  fp_br_init_nal(&br, nal + 1, len - 1);
+
+  int profile_idc = fp_br_read(&br, 8);
+  fp_br_skip(&br, 16); // constraint flags, level_idc
+  fp_br_ue(&br);       // seq_parameter_set_id
+
+  // 4:2:0 unless a high profile says otherwise
+  int chroma_array_type = 1;
+  if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 || profile_idc == 244 || profile_idc == 44 ||
+      profile_idc == 83 || profile_idc == 86 || profile_idc == 118 || profile_idc == 128 || profile_idc == 138 ||
+      profile_idc == 139 || profile_idc == 134 || profile_idc == 135) {
+    int chroma_format_idc = fp_br_ue(&br);
+    chroma_array_type = chroma_format_idc;
+    if (chroma_format_idc == 3 && fp_br_read(&br, 1)) { // separate_colour_plane_flag
+      chroma_array_type = 0;
+    }
+    fp_br_ue(&br);        // bit_depth_luma_minus8
+    fp_br_ue(&br);        // bit_depth_chroma_minus8
+    fp_br_skip(&br, 1);   // qpprime_y_zero_transform_bypass_flag
+    if (fp_br_read(&br, 1)) { // seq_scaling_matrix_present_flag
+      for (i = 0; i < (chroma_format_idc != 3 ? 8 : 12); i++) {
+        if (fp_br_read(&br, 1)) {
+          h264_skip_scaling_list(&br, i < 6 ? 16 : 64);
+        }
+      }
+    }
+  }
+
+  fp_br_ue(&br); // log2_max_frame_num_minus4
+  int pic_order_cnt_type = fp_br_ue(&br);
+  if (pic_order_cnt_type == 0) {
+    fp_br_ue(&br); // log2_max_pic_order_cnt_lsb_minus4
+  } else if (pic_order_cnt_type == 1) {
+    fp_br_skip(&br, 1); // delta_pic_order_always_zero_flag
+    fp_br_se(&br);      // offset_for_non_ref_pic
+    fp_br_se(&br);      // offset_for_top_to_bottom_field
+    int cycle = fp_br_ue(&br);
+    for (i = 0; i < cycle && !br.overrun; i++) {
+      fp_br_se(&br);
+    }
+  }
+
+  fp_br_ue(&br);      // max_num_ref_frames
+  fp_br_skip(&br, 1); // gaps_in_frame_num_value_allowed_flag
+  int width_in_mbs = fp_br_ue(&br) + 1;
+  int height_in_map_units = fp_br_ue(&br) + 1;
+  int frame_mbs_only = fp_br_read(&br, 1);
+  if (!frame_mbs_only) {
+    fp_br_skip(&br, 1); // mb_adaptive_frame_field_flag
+  }
+  fp_br_skip(&br, 1); // direct_8x8_inference_flag
+
+  // field coded streams count the height in field macroblock pairs
+  info->width = width_in_mbs * 16;
+  info->height = (2 - frame_mbs_only) * height_in_map_units * 16;
+  if (fp_br_read(&br, 1)) { // frame_cropping_flag
+    int crop_unit_x = (chroma_array_type == 1 || chroma_array_type == 2) ? 2 : 1;
+    int crop_unit_y = (chroma_array_type == 1 ? 2 : 1) * (2 - frame_mbs_only);
+    int left = fp_br_ue(&br);
+    int right = fp_br_ue(&br);
+    int top = fp_br_ue(&br);
+    int bottom = fp_br_ue(&br);
+    info->width -= (left + right) * crop_unit_x;
+    info->height -= (top + bottom) * crop_unit_y;
+  }
+  if (br.overrun || info->width <= 0 || info->height <= 0) {
+    info->width = 0;
+    info->height = 0;
+    return -1;
+  }
+
+  info->fps_num = 0;
+  info->fps_den = 0;
+  if (fp_br_read(&br, 1)) { // vui_parameters_present_flag
+    if (fp_br_read(&br, 1)) { // aspect_ratio_info_present_flag
+      if (fp_br_read(&br, 8) == 255) { // Extended_SAR
+        fp_br_skip(&br, 32);
+      }
+    }
+    if (fp_br_read(&br, 1)) { // overscan_info_present_flag
+      fp_br_skip(&br, 1);
+    }
+    if (fp_br_read(&br, 1)) { // video_signal_type_present_flag
+      fp_br_skip(&br, 4);
+      if (fp_br_read(&br, 1)) { // colour_description_present_flag
+        fp_br_skip(&br, 24);
+      }
+    }
+    if (fp_br_read(&br, 1)) { // chroma_loc_info_present_flag
+      fp_br_ue(&br);
+      fp_br_ue(&br);
+    }
+    if (fp_br_read(&br, 1)) { // timing_info_present_flag
+      uint32_t num_units_in_tick = fp_br_read(&br, 32);
+      uint32_t time_scale = fp_br_read(&br, 32);
+      // a frame is two field ticks
+      if (!br.overrun && num_units_in_tick && time_scale) {
+        info->fps_num = time_scale;
+        info->fps_den = 2 * num_units_in_tick;
+      }
+    }
+  }
+
+  // a damaged VUI still leaves the picture size usable
+  if (br.overrun) {
+    info->fps_num = 0;
+    info->fps_den = 0;
+  }
+  return 0;
+}
+
+static void h265_skip_profile_tier_level(fp_bitreader_t *br, int max_sub_layers_minus1)
+{
+  int sub_layer_profile_present[8];
+  int sub_layer_level_present[8];
+  int i;
+
+  // general profile space/tier/idc, compatibility flags, constraint flags, level
+  fp_br_skip(br, 96);
+  for (i = 0; i < max_sub_layers_minus1; i++) {
+    sub_layer_profile_present[i] = fp_br_read(br, 1);
+    sub_layer_level_present[i] = fp_br_read(br, 1);
+  }
+  if (max_sub_layers_minus1 > 0) {
+    fp_br_skip(br, 2 * (8 - max_sub_layers_minus1));
+  }
+  for (i = 0; i < max_sub_layers_minus1; i++) {
+    if (sub_layer_profile_present[i]) {
+      fp_br_skip(br, 88);
+    }
+    if (sub_layer_level_present[i]) {
+      fp_br_skip(br, 8);
+    }
+  }
+}
+
+static void h265_skip_scaling_list_data(fp_bitreader_t *br)
+{
+  int size_id, matrix_id, i;
+
+  for (size_id = 0; size_id < 4; size_id++) {
+    for (matrix_id = 0; matrix_id < 6; matrix_id += (size_id == 3) ? 3 : 1) {
+      if (!fp_br_read(br, 1)) { // scaling_list_pred_mode_flag
+        fp_br_ue(br);           // scaling_list_pred_matrix_id_delta
+        continue;
+      }
+      int coef_num = 1 << (4 + (size_id << 1));
+      if (coef_num > 64) {
+        coef_num = 64;
+      }
+      if (size_id > 1) {
+        fp_br_se(br); // scaling_list_dc_coef_minus8
+      }
+      for (i = 0; i < coef_num && !br->overrun; i++) {
+        fp_br_se(br); // scaling_list_delta_coef
+      }
+    }
+  }
+}
+
+// st_ref_pic_set() as found in the SPS; returns NumDeltaPocs of the set
+static int h265_skip_st_ref_pic_set(fp_bitreader_t *br, int idx, const int *num_delta_pocs)
+{
+  int num = 0;
+  int i;
+
+  if (idx != 0 && fp_br_read(br, 1)) { // inter_ref_pic_set_prediction_flag
+    fp_br_skip(br, 1);                 // delta_rps_sign
+    fp_br_ue(br);                      // abs_delta_rps_minus1
+    // in the SPS the reference set is always the previous one
+    for (i = 0; i <= num_delta_pocs[idx - 1] && !br->overrun; i++) {
+      int used = fp_br_read(br, 1);
+      if (used || fp_br_read(br, 1)) { // use_delta_flag
+        num++;
+      }
+    }
+    return num;
+  }
+
+  int num_negative = fp_br_ue(br);
+  int num_positive = fp_br_ue(br);
+  if (num_negative > 16 || num_positive > 16) {
+    br->overrun = true;
+    return 0;
+  }
+  for (i = 0; i < num_negative + num_positive; i++) {
+    fp_br_ue(br);       // delta_poc_minus1
+    fp_br_skip(br, 1);  // used_by_curr_pic_flag
+  }
+  return num_negative + num_positive;
+}
+
+int fp_h265_parse_sps(const uint8_t *nal, int len, video_stream_info_t *info)
+{
+  int num_delta_pocs[64];
+  fp_bitreader_t br;
+  int i;
+
+  // skip the two byte nal header
+  if (len < 3) {
+    return -1;
+  }
+  fp_br_init_nal(&br, nal + 2, len - 2);
+
+  fp_br_skip(&br, 4); // sps_video_parameter_set_id
+  int max_sub_layers_minus1 = fp_br_read(&br, 3);
+  fp_br_skip(&br, 1); // sps_temporal_id_nesting_flag
+  h265_skip_profile_tier_level(&br, max_sub_layers_minus1);
+
+  fp_br_ue(&br); // sps_seq_parameter_set_id
+  int chroma_format_idc = fp_br_ue(&br);
+  if (chroma_format_idc == 3 && fp_br_read(&br, 1)) { // separate_colour_plane_flag
+    chroma_format_idc = 0;
+  }
+  info->width = fp_br_ue(&br);
+  info->height = fp_br_ue(&br);
+  if (fp_br_read(&br, 1)) { // conformance_window_flag, in chroma samples
+    int sub_width = (chroma_format_idc == 1 || chroma_format_idc == 2) ? 2 : 1;
+    int sub_height = chroma_format_idc == 1 ? 2 : 1;
+    int left = fp_br_ue(&br);
+    int right = fp_br_ue(&br);
+    int top = fp_br_ue(&br);
+    int bottom = fp_br_ue(&br);
+    info->width -= (left + right) * sub_width;
+    info->height -= (top + bottom) * sub_height;
+  }
+  if (br.overrun || info->width <= 0 || info->height <= 0) {
+    info->width = 0;
+    info->height = 0;
+    return -1;
+  }
+  fp_br_ue(&br); // bit_depth_luma_minus8
+  fp_br_ue(&br); // bit_depth_chroma_minus8
+  int log2_max_poc_lsb = fp_br_ue(&br) + 4;
+
+  int ordering_info_present = fp_br_read(&br, 1);
+  for (i = ordering_info_present ? 0 : max_sub_layers_minus1; i <= max_sub_layers_minus1; i++) {
+    fp_br_ue(&br); // sps_max_dec_pic_buffering_minus1
+    fp_br_ue(&br); // sps_max_num_reorder_pics
+    fp_br_ue(&br); // sps_max_latency_increase_plus1
+  }
+
+  // coding and transform block sizes, transform hierarchy depths
+  for (i = 0; i < 6; i++) {
+    fp_br_ue(&br);
+  }
+  if (fp_br_read(&br, 1) && fp_br_read(&br, 1)) { // scaling_list_enabled, sps_scaling_list_data_present
+    h265_skip_scaling_list_data(&br);
+  }
+  fp_br_skip(&br, 2); // amp_enabled_flag, sample_adaptive_offset_enabled_flag
+  if (fp_br_read(&br, 1)) { // pcm_enabled_flag
+    fp_br_skip(&br, 8);     // pcm sample bit depths
+    fp_br_ue(&br);
+    fp_br_ue(&br);
+    fp_br_skip(&br, 1);     // pcm_loop_filter_disabled_flag
+  }
+
+  int num_st_rps = fp_br_ue(&br);
+  if (num_st_rps > 64) {
+    return -1;
+  }
+  for (i = 0; i < num_st_rps && !br.overrun; i++) {
+    num_delta_pocs[i] = h265_skip_st_ref_pic_set(&br, i, num_delta_pocs);
+  }
+  if (fp_br_read(&br, 1)) { // long_term_ref_pics_present_flag
+    int num_lt = fp_br_ue(&br);
+    for (i = 0; i < num_lt && !br.overrun; i++) {
+      fp_br_skip(&br, log2_max_poc_lsb + 1); // lt_ref_pic_poc_lsb_sps, used_by_curr_pic_lt_sps_flag
+    }
+  }
+  fp_br_skip(&br, 2); // sps_temporal_mvp_enabled_flag, strong_intra_smoothing_enabled_flag
+
+  info->fps_num = 0;
+  info->fps_den = 0;
+  if (fp_br_read(&br, 1)) { // vui_parameters_present_flag
+    if (fp_br_read(&br, 1)) { // aspect_ratio_info_present_flag
+      if (fp_br_read(&br, 8) == 255) { // EXTENDED_SAR
+        fp_br_skip(&br, 32);
+      }
+    }
+    if (fp_br_read(&br, 1)) { // overscan_info_present_flag
+      fp_br_skip(&br, 1);
+    }
+    if (fp_br_read(&br, 1)) { // video_signal_type_present_flag
+      fp_br_skip(&br, 4);
+      if (fp_br_read(&br, 1)) { // colour_description_present_flag
+        fp_br_skip(&br, 24);
+      }
+    }
+    if (fp_br_read(&br, 1)) { // chroma_loc_info_present_flag
+      fp_br_ue(&br);
+      fp_br_ue(&br);
+    }
+    fp_br_skip(&br, 3); // neutral_chroma, field_seq, frame_field_info_present
+    if (fp_br_read(&br, 1)) { // default_display_window_flag
+      for (i = 0; i < 4; i++) {
+        fp_br_ue(&br);
+      }
+    }
+    if (fp_br_read(&br, 1)) { // vui_timing_info_present_flag
+      uint32_t num_units_in_tick = fp_br_read(&br, 32);
+      uint32_t time_scale = fp_br_read(&br, 32);
+      if (!br.overrun && num_units_in_tick && time_scale) {
+        info->fps_num = time_scale;
+        info->fps_den = num_units_in_tick;
+      }
+    }
+  }
+
+  // a damaged VUI still leaves the picture size usable
+  if (br.overrun) {
+    info->fps_num = 0;
+    info->fps_den = 0;
+  }
+  return 0;
+}
+
+int fp_h265_parse_vps(const uint8_t *nal, int len, video_stream_info_t *info)
+{
+  fp_bitreader_t br;
+  int i, j;
+
+  // skip the two byte nal header
+  if (len < 3) {
+    return -1;
+  }
+  fp_br_init_nal(&br, nal + 2, len - 2);
+
+  fp_br_skip(&br, 4 + 1 + 1 + 6); // vps id, base layer flags, vps_max_layers_minus1
+  int max_sub_layers_minus1 = fp_br_read(&br, 3);
+  fp_br_skip(&br, 1 + 16); // temporal id nesting, reserved 0xffff
+  h265_skip_profile_tier_level(&br, max_sub_layers_minus1);
+
+  int ordering_info_present = fp_br_read(&br, 1);
+  for (i = ordering_info_present ? 0 : max_sub_layers_minus1; i <= max_sub_layers_minus1; i++) {
+    fp_br_ue(&br); // vps_max_dec_pic_buffering_minus1
+    fp_br_ue(&br); // vps_max_num_reorder_pics
+    fp_br_ue(&br); // vps_max_latency_increase_plus1
+  }
+
+  int max_layer_id = fp_br_read(&br, 6);
+  int num_layer_sets_minus1 = fp_br_ue(&br);
+  for (i = 1; i <= num_layer_sets_minus1 && !br.overrun; i++) {
+    for (j = 0; j <= max_layer_id; j++) {
+      fp_br_skip(&br, 1); // layer_id_included_flag
+    }
+  }
+
+  info->fps_num = 0;
+  info->fps_den = 0;
+  if (fp_br_read(&br, 1)) { // vps_timing_info_present_flag
+    uint32_t num_units_in_tick = fp_br_read(&br, 32);
+    uint32_t time_scale = fp_br_read(&br, 32);
+    if (!br.overrun && num_units_in_tick && time_scale) {
+      info->fps_num = time_scale;
+      info->fps_den = num_units_in_tick;
+    }
+  }
+
+  return br.overrun ? -1 : 0;
+}
+
+int fp_annexb_stream_info(const uint8_t *buf, int size, bool h265, video_stream_info_t *info, fp_ps_cache_t *cache)
+{
+  video_stream_info_t ps;
+  int nal_start, hdr_start, nal_end;
+  int pos = 0;
+  int ret = -1;
+
+  memset(info, 0, sizeof(video_stream_info_t));
+  while (pos < size) {
+    int found = fp_find_nal_unit(buf + pos, size - pos, &nal_start, &hdr_start, &nal_end);
+    if (found == 0) {
+      break;
+    }
+    const uint8_t *nal = buf + pos + hdr_start;
+    int len = nal_end - hdr_start + 1;
+
+    memset(&ps, 0, sizeof(ps));
+    if (h265) {
+      int nal_type = (nal[0] >> 1) & 0x3f;
+      if (nal_type < 32) { // the first slice
+        break;
+      }
+      if (cache) {
+        fp_ps_cache_put(cache, true, nal, len);
+      }
+      if (nal_type == 32 && fp_h265_parse_vps(nal, len, &ps) == 0 && ps.fps_num) {
+        info->fps_num = ps.fps_num;
+        info->fps_den = ps.fps_den;
+      } else if (nal_type == 33 && fp_h265_parse_sps(nal, len, &ps) == 0) {
+        info->width = ps.width;
+        info->height = ps.height;
+        // the SPS VUI timing takes precedence over the VPS one
+        if (ps.fps_num) {
+          info->fps_num = ps.fps_num;
+          info->fps_den = ps.fps_den;
+        }
+        ret = 0;
+      }
+    } else {
+      int nal_type = nal[0] & 0x1f;
+      if (nal_type >= 1 && nal_type <= 5) {
+        break;
+      }
+      if (cache) {
+        fp_ps_cache_put(cache, false, nal, len);
+      }
+      if (nal_type == 7 && fp_h264_parse_sps(nal, len, &ps) == 0) {
+        *info = ps;
+        ret = 0;
+      }
+    }
+
+    // -1: the nal runs to the end of the buffer
+    if (found < 0) {
+      break;
+    }
+    pos += nal_end + 1;
+  }
+  return ret;
+}
+
+void fp_annexb_cache_param_sets(const uint8_t *buf, int size, bool h265, fp_ps_cache_t *cache)
+{
+  int nal_start, hdr_start, nal_end;
+  int pos = 0;
+
+  while (pos < size) {
+    int found = fp_find_nal_unit(buf + pos, size - pos, &nal_start, &hdr_start, &nal_end);
+    if (found == 0) {
+      break;
+    }
+    const uint8_t *nal = buf + pos + hdr_start;
+    int len = nal_end - hdr_start + 1;
+
+    if (h265) {
+      int nal_type = (nal[0] >> 1) & 0x3f;
+      if (nal_type < 32) { // the first slice
+        break;
+      }
+    } else {
+      int nal_type = nal[0] & 0x1f;
+      if (nal_type >= 1 && nal_type <= 5) {
+        break;
+      }
+    }
+    fp_ps_cache_put(cache, h265, nal, len);
+
+    if (found < 0) {
+      break;
+    }
+    pos += nal_end + 1;
+  }
+}
+
+// The slot (VPS, SPS or PPS) and id of a parameter set nal; -1 if it isn't
+// one or its id is out of range
+static int ps_nal_slot(bool h265, const uint8_t *nal, uint32_t len, uint32_t *p_id)
+{
+  static const uint32_t h264_ids[FP_PS_SLOTS] = { 0, 32, 256 };
+  static const uint32_t h265_ids[FP_PS_SLOTS] = { 16, 16, 64 };
+  fp_bitreader_t br;
+  uint32_t id;
+  int slot;
+
+  if (h265) {
+    slot = ((nal[0] >> 1) & 0x3f) - 32;
+    if (len < 3 || slot < 0 || slot >= FP_PS_SLOTS) {
+      return -1;
+    }
+    fp_br_init_nal(&br, nal + 2, len - 2);
+    if (slot == 0) {
+      id = fp_br_read(&br, 4); // vps_video_parameter_set_id
+    } else if (slot == 1) {
+      fp_br_skip(&br, 4); // sps_video_parameter_set_id
+      int max_sub_layers_minus1 = fp_br_read(&br, 3);
+      fp_br_skip(&br, 1); // sps_temporal_id_nesting_flag
+      h265_skip_profile_tier_level(&br, max_sub_layers_minus1);
+      id = fp_br_ue(&br); // sps_seq_parameter_set_id
+    } else {
+      id = fp_br_ue(&br); // pps_pic_parameter_set_id
+    }
+  } else {
+    int nal_type = nal[0] & 0x1f;
+    if (len < 2 || (nal_type != 7 && nal_type != 8)) {
+      return -1;
+    }
+    slot = nal_type == 7 ? 1 : 2;
+    fp_br_init_nal(&br, nal + 1, len - 1);
+    if (slot == 1) {
+      fp_br_skip(&br, 24); // profile_idc, constraint flags, level_idc
+    }
+    id = fp_br_ue(&br); // seq_parameter_set_id or pic_parameter_set_id
+  }
+
+  if (br.overrun || id >= (h265 ? h265_ids : h264_ids)[slot]) {
+    return -1;
+  }
+  *p_id = id;
+  return slot;
+}
+
+void fp_ps_cache_put(fp_ps_cache_t *c, bool h265, const uint8_t *nal, uint32_t len)
+{
+  uint8_t *copy;
+  uint32_t id;
+  int slot;
+
+  if (len == 0 || (slot = ps_nal_slot(h265, nal, len, &id)) < 0) {
+    return;
+  }
+  // the same sets come around again on every rewind
+  if (c->nal[slot][id] && c->len[slot][id] == len && memcmp(c->nal[slot][id], nal, len) == 0) {
+    return;
+  }
+  copy = (uint8_t *)malloc(len);
+  if (!copy) {
+    return;
+  }
+  memcpy(copy, nal, len);
+  free(c->nal[slot][id]);
+  c->nal[slot][id] = copy;
+  c->len[slot][id] = len;
+  c->has_sps |= slot == 1;
+  c->dirty = true;
+}
+
+void fp_ps_blob_unref(fp_ps_blob_t *blob)
+{
+  if (blob && atomic_fetch_sub(&blob->refs, 1) == 1) {
+    free(blob);
+  }
+}
+
+// The cached sets by kind and id as one Annex-B blob
+static fp_ps_blob_t *ps_cache_build(fp_ps_cache_t *c)
+{
+  static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+  fp_ps_blob_t *blob;
+  uint32_t len = 0;
+  int i, id;
+
+  if (!c->has_sps) {
+    return NULL;
+  }
+  for (i = 0; i < FP_PS_SLOTS; i++) {
+    for (id = 0; id < FP_PS_IDS; id++) {
+      len += c->nal[i][id] ? sizeof(start_code) + c->len[i][id] : 0;
+    }
+  }
+  blob = (fp_ps_blob_t *)malloc(sizeof(fp_ps_blob_t) + len);
+  if (!blob) {
+    return NULL;
+  }
+
+  atomic_init(&blob->refs, 1);
+  blob->len = 0;
+  for (i = 0; i < FP_PS_SLOTS; i++) {
+    for (id = 0; id < FP_PS_IDS; id++) {
+      if (c->nal[i][id]) {
+        memcpy(blob->data + blob->len, start_code, sizeof(start_code));
+        memcpy(blob->data + blob->len + sizeof(start_code), c->nal[i][id], c->len[i][id]);
+        blob->len += sizeof(start_code) + c->len[i][id];
+      }
+    }
+  }
+  return blob;
+}
+
+fp_ps_blob_t *fp_ps_cache_blob(fp_ps_cache_t *c)
+{
+  if (c->dirty) {
+    fp_ps_blob_t *blob = ps_cache_build(c);
+    // out of memory keeps the previous sets, better than none
+    if (blob) {
+      // frames still prepended with the old blob keep it until released
+      fp_ps_blob_unref(c->blob);
+      c->blob = blob;
+      c->dirty = false;
+    }
+  }
+
+  if (c->blob) {
+    atomic_fetch_add(&c->blob->refs, 1);
+  }
+  return c->blob;
+}
+
+void fp_ps_cache_free(fp_ps_cache_t *c)
+{
+  int i, id;
+
+  for (i = 0; i < FP_PS_SLOTS; i++) {
+    for (id = 0; id < FP_PS_IDS; id++) {
+      free(c->nal[i][id]);
+      c->nal[i][id] = NULL;
+      c->len[i][id] = 0;
+    }
+  }
+  fp_ps_blob_unref(c->blob);
+  c->blob = NULL;
+  c->has_sps = false;
+  c->dirty = false;
+}
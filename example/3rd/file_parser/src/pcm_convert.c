@@ -0,0 +1,154 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * Conversion of 24-bit, 32-bit and float PCM to 16-bit for the WAV
+ * parser. Scalar versions are always available; SSE2/SSSE3 ones are
+ * selected at runtime on x86.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include "file_parser_priv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FP_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Samples are little-endian. Integer samples keep their top 16 bits; float
+// ones are scaled, rounded to nearest even and clipped, NaN giving -32768,
+// all as the SSE conversion does.
+#define PCM_ROUND_MAGIC 12582912.0f // 1.5 * 2^23
+static inline int16_t pcm_f32_sample(const uint8_t *p)
+{
+  union {
+    uint32_t u;
+    float f;
+  } v;
+  v.u = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  float s = v.f * 32768.0f;
+  if (!(s > -32768.0f)) {
+    return -32768;
+  }
+  if (s >= 32767.0f) {
+    return 32767;
+  }
+  // adding 1.5 * 2^23 leaves no fraction bits, so the FPU rounds
+  return (int16_t)((s + PCM_ROUND_MAGIC) - PCM_ROUND_MAGIC);
+}
+
+void fp_pcm_to_s16_c(const uint8_t *src, int bits, bool is_float, int16_t *dst, size_t samples)
+{
+  size_t i;
+
+  if (is_float) {
+    for (i = 0; i < samples; i++) {
+      dst[i] = pcm_f32_sample(src + 4 * i);
+    }
+  } else if (bits == 32) {
+    for (i = 0; i < samples; i++) {
+      dst[i] = (int16_t)(src[4 * i + 2] | (src[4 * i + 3] << 8));
+    }
+  } else if (bits == 24) {
+    for (i = 0; i < samples; i++) {
+      dst[i] = (int16_t)(src[3 * i + 1] | (src[3 * i + 2] << 8));
+    }
+  } else {
+    for (i = 0; i < samples; i++) {
+      dst[i] = (int16_t)(src[2 * i] | (src[2 * i + 1] << 8));
+    }
+  }
+}
+
+#ifdef FP_HAVE_X86_SIMD
+__attribute__((target("sse2"))) static void pcm_f32_to_s16_sse2(const uint8_t *src, int16_t *dst, size_t samples)
+{
+  const __m128 scale = _mm_set1_ps(32768.0f);
+  const __m128 lo = _mm_set1_ps(-32768.0f);
+  const __m128 hi = _mm_set1_ps(32767.0f);
+  size_t i = 0;
+
+  // clip before cvtps, which turns anything out of int32 range into
+  // 0x80000000; maxps returns its second operand for NaN
+  for (; i + 8 <= samples; i += 8) {
+    __m128 a = _mm_mul_ps(_mm_loadu_ps((const float *)(src + 4 * i)), scale);
+    __m128 b = _mm_mul_ps(_mm_loadu_ps((const float *)(src + 4 * i + 16)), scale);
+    a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+    b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+  }
+  fp_pcm_to_s16_c(src + 4 * i, 32, true, dst + i, samples - i);
+}
+
+__attribute__((target("sse2"))) static void pcm_s32_to_s16_sse2(const uint8_t *src, int16_t *dst, size_t samples)
+{
+  size_t i = 0;
+
+  for (; i + 8 <= samples; i += 8) {
+    __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + 4 * i)), 16);
+    __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + 4 * i + 16)), 16);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+  }
+  fp_pcm_to_s16_c(src + 4 * i, 32, false, dst + i, samples - i);
+}
+
+__attribute__((target("ssse3"))) static void pcm_s24_to_s16_ssse3(const uint8_t *src, int16_t *dst, size_t samples)
+{
+  // the top two bytes of four packed 24-bit samples into the low half
+  const __m128i top = _mm_setr_epi8(1, 2, 4, 5, 7, 8, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1);
+  size_t i = 0;
+
+  // each 16 byte load covers 4 samples and 4 bytes beyond; keep them in
+  // the buffer
+  for (; i + 10 <= samples; i += 8) {
+    __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 3 * i)), top);
+    __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 3 * i + 12)), top);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi64(a, b));
+  }
+  fp_pcm_to_s16_c(src + 3 * i, 24, false, dst + i, samples - i);
+}
+
+__attribute__((target("ssse3"))) void fp_pcm_to_s16_simd(const uint8_t *src, int bits, bool is_float, int16_t *dst,
+                                                         size_t samples)
+{
+  if (is_float) {
+    pcm_f32_to_s16_sse2(src, dst, samples);
+  } else if (bits == 32) {
+    pcm_s32_to_s16_sse2(src, dst, samples);
+  } else if (bits == 24) {
+    pcm_s24_to_s16_ssse3(src, dst, samples);
+  } else {
+    fp_pcm_to_s16_c(src, bits, is_float, dst, samples);
+  }
+}
+#endif
+
+static fp_pcm_convert_fn pcm_convert_select(void)
+{
+#ifdef FP_HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) {
+    return fp_pcm_to_s16_simd;
+  }
+#endif
+  return fp_pcm_to_s16_c;
+}
+
+static void pcm_to_s16_resolve(const uint8_t *src, int bits, bool is_float, int16_t *dst, size_t samples);
+
+// Resolved on first use, like the start code scanner
+static fp_pcm_convert_fn gs_pcm_to_s16 = pcm_to_s16_resolve;
+
+static void pcm_to_s16_resolve(const uint8_t *src, int bits, bool is_float, int16_t *dst, size_t samples)
+{
+  gs_pcm_to_s16 = pcm_convert_select();
+  gs_pcm_to_s16(src, bits, is_float, dst, samples);
+}
+
+void fp_pcm_to_s16(const uint8_t *src, int bits, bool is_float, int16_t *dst, size_t samples)
+{
+  gs_pcm_to_s16(src, bits, is_float, dst, samples);
+}
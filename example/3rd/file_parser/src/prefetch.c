@@ -0,0 +1,282 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * Optional read-ahead stage. A producer thread runs the parser ahead
+ * of the consumer, touches every page of each frame so page faults
+ * happen off the send path, and publishes the frames through a
+ * bounded single-producer/single-consumer ring.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "file_parser_priv.h"
+
+#define FP_PREFETCH_PAGE_SIZE 4096
+#define FP_PREFETCH_WAIT_MS 10
+#define FP_CACHE_LINE 64
+
+typedef struct {
+  int ret;
+  frame_t frame;
+} fp_prefetch_slot_t;
+
+struct fp_prefetch_s {
+  // written by the producer only
+  _Alignas(FP_CACHE_LINE) atomic_uint head;
+  // written by the consumer only
+  _Alignas(FP_CACHE_LINE) atomic_uint tail;
+
+  _Alignas(FP_CACHE_LINE) atomic_int running;
+  atomic_int producer_done;
+  atomic_int producer_waiting;
+  atomic_int consumer_waiting;
+
+  uint32_t mask;
+  int depth;
+  fp_prefetch_slot_t *slots;
+  media_parser_t *parser;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static void prefetch_touch(const frame_t *p_frame)
+{
+  volatile uint8_t sink = 0;
+  uint32_t off;
+
+  if (!p_frame->ptr) {
+    return;
+  }
+  for (off = 0; off < p_frame->len; off += FP_PREFETCH_PAGE_SIZE) {
+    sink ^= p_frame->ptr[off];
+  }
+  if (p_frame->len) {
+    sink ^= p_frame->ptr[p_frame->len - 1];
+  }
+  (void)sink;
+}
+
+// Sleep until the other side flags progress. The waiting flag and the ring
+// index are both seq_cst, so either the waiter sees the new index on its
+// re-check or the notifier sees the flag; the timeout is only a backstop.
+static void prefetch_wait(fp_prefetch_t *pf, atomic_int *waiting, int (*ready)(fp_prefetch_t *pf))
+{
+  struct timeval now;
+  struct timespec ts;
+
+  pthread_mutex_lock(&pf->lock);
+  atomic_store(waiting, 1);
+  if (!ready(pf)) {
+    gettimeofday(&now, NULL);
+    ts.tv_sec = now.tv_sec;
+    ts.tv_nsec = now.tv_usec * 1000 + FP_PREFETCH_WAIT_MS * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&pf->cond, &pf->lock, &ts);
+  }
+  atomic_store(waiting, 0);
+  pthread_mutex_unlock(&pf->lock);
+}
+
+static void prefetch_notify(fp_prefetch_t *pf, atomic_int *waiting)
+{
+  if (atomic_load(waiting)) {
+    pthread_mutex_lock(&pf->lock);
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+  }
+}
+
+static int prefetch_has_space(fp_prefetch_t *pf)
+{
+  return !atomic_load(&pf->running) ||
+         atomic_load(&pf->head) - atomic_load(&pf->tail) < (uint32_t)pf->depth;
+}
+
+static int prefetch_has_data(fp_prefetch_t *pf)
+{
+  return atomic_load(&pf->producer_done) || atomic_load(&pf->head) != atomic_load(&pf->tail);
+}
+
+static void *prefetch_thread(void *arg)
+{
+  fp_prefetch_t *pf = (fp_prefetch_t *)arg;
+
+  while (atomic_load_explicit(&pf->running, memory_order_relaxed)) {
+    uint32_t head = atomic_load_explicit(&pf->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&pf->tail, memory_order_acquire);
+
+    if (head - tail >= (uint32_t)pf->depth) {
+      prefetch_wait(pf, &pf->producer_waiting, prefetch_has_space);
+      continue;
+    }
+
+    fp_prefetch_slot_t *slot = &pf->slots[head & pf->mask];
+    memset(&slot->frame, 0, sizeof(frame_t));
+    slot->ret = fp_parser_read_frame(pf->parser, &slot->frame);
+    if (slot->ret == 0) {
+      prefetch_touch(&slot->frame);
+    }
+
+    atomic_store(&pf->head, head + 1);
+    prefetch_notify(pf, &pf->consumer_waiting);
+
+    if (slot->ret < 0) {
+      break;
+    }
+  }
+
+  atomic_store(&pf->producer_done, 1);
+  prefetch_notify(pf, &pf->consumer_waiting);
+  return NULL;
+}
+
+fp_prefetch_t *fp_prefetch_start(media_parser_t *parser, int depth)
+{
+  fp_prefetch_t *pf;
+  uint32_t cap = 1;
+
+  if (depth <= 0) {
+    return NULL;
+  }
+  while (cap < (uint32_t)depth) {
+    cap <<= 1;
+  }
+
+  pf = (fp_prefetch_t *)calloc(1, sizeof(fp_prefetch_t));
+  if (!pf) {
+    return NULL;
+  }
+  pf->slots = (fp_prefetch_slot_t *)calloc(cap, sizeof(fp_prefetch_slot_t));
+  if (!pf->slots) {
+    free(pf);
+    return NULL;
+  }
+  pf->mask = cap - 1;
+  pf->depth = depth;
+  pf->parser = parser;
+  atomic_init(&pf->head, 0);
+  atomic_init(&pf->tail, 0);
+  atomic_init(&pf->running, 1);
+  atomic_init(&pf->producer_done, 0);
+  atomic_init(&pf->producer_waiting, 0);
+  atomic_init(&pf->consumer_waiting, 0);
+  pthread_mutex_init(&pf->lock, NULL);
+  pthread_cond_init(&pf->cond, NULL);
+
+  if (pthread_create(&pf->thread, NULL, prefetch_thread, pf) != 0) {
+    AGO_LOGE("Can't start prefetch thread, errno=%d", errno);
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond);
+    free(pf->slots);
+    free(pf);
+    return NULL;
+  }
+
+  return pf;
+}
+
+int fp_prefetch_depth(fp_prefetch_t *pf)
+{
+  return pf->depth;
+}
+
+int fp_prefetch_pop_frames(fp_prefetch_t *pf, frame_t *p_frames, int max)
+{
+  uint32_t tail = atomic_load_explicit(&pf->tail, memory_order_relaxed);
+  uint32_t head;
+  int n = 0;
+
+  while ((head = atomic_load(&pf->head)) == tail) {
+    if (atomic_load(&pf->producer_done)) {
+      // the producer may have published its last slot right before quitting
+      head = atomic_load(&pf->head);
+      if (head == tail) {
+        return -1;
+      }
+      break;
+    }
+    prefetch_wait(pf, &pf->consumer_waiting, prefetch_has_data);
+  }
+
+  // a failed read ends the run; it is returned on its own
+  for (; tail != head && n < max; tail++) {
+    fp_prefetch_slot_t *slot = &pf->slots[tail & pf->mask];
+    if (slot->ret != 0) {
+      if (n == 0) {
+        n = slot->ret;
+        tail++;
+      }
+      break;
+    }
+    p_frames[n++] = slot->frame;
+  }
+
+  // one release of the slots and one wakeup for the whole run
+  atomic_store(&pf->tail, tail);
+  prefetch_notify(pf, &pf->producer_waiting);
+  return n;
+}
+
+int fp_prefetch_pop(fp_prefetch_t *pf, frame_t *p_frame)
+{
+  int n = fp_prefetch_pop_frames(pf, p_frame, 1);
+  return n > 0 ? 0 : n;
+}
+
+int fp_prefetch_stop(fp_prefetch_t *pf, frame_t **pp_left)
+{
+  int left = 0;
+
+  if (pp_left) {
+    *pp_left = NULL;
+  }
+  if (!pf) {
+    return 0;
+  }
+
+  atomic_store(&pf->running, 0);
+  pthread_mutex_lock(&pf->lock);
+  pthread_cond_broadcast(&pf->cond);
+  pthread_mutex_unlock(&pf->lock);
+  pthread_join(pf->thread, NULL);
+
+  // whatever was read ahead but never consumed goes back to the caller, or is
+  // released when the caller doesn't want it
+  uint32_t tail = atomic_load(&pf->tail);
+  uint32_t head = atomic_load(&pf->head);
+  frame_t *frames = pp_left && head != tail ? (frame_t *)malloc((head - tail) * sizeof(frame_t)) : NULL;
+  for (; tail != head; tail++) {
+    fp_prefetch_slot_t *slot = &pf->slots[tail & pf->mask];
+    if (slot->ret != 0) {
+      continue;
+    }
+    if (frames) {
+      frames[left++] = slot->frame;
+    } else {
+      fp_parser_release_frame(pf->parser, &slot->frame);
+    }
+  }
+  if (pp_left) {
+    *pp_left = frames;
+  }
+
+  pthread_mutex_destroy(&pf->lock);
+  pthread_cond_destroy(&pf->cond);
+  free(pf->slots);
+  free(pf);
+  return left;
+}
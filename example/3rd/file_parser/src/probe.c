@@ -0,0 +1,319 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * Content based format detection. Looks at the first few KB of a
+ * file and recognizes Annex-B H.264/H.265, IVF VP8, MP4, ADTS AAC, Ogg Opus,
+ * WAV/RIFF, Y4M and JPEG, filling the parser config from the headers.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file_parser_priv.h"
+
+#define FP_PROBE_SIZE (16 * 1024)
+#define FP_PROBE_AAC_FRAMES 3
+#define FP_PROBE_FRAME_PERIOD_MS 20
+
+static const int gs_adts_sample_rates[16] = { 96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+                                              16000, 12000, 11025, 8000,  7350,  0,     0,     0 };
+
+static uint16_t probe_rl16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t probe_rl32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool probe_h264_nal(const uint8_t *hdr)
+{
+  int nal_type = hdr[0] & 0x1f;
+  if (hdr[0] & 0x80) {
+    return false;
+  }
+  return nal_type == 1 || (nal_type >= 5 && nal_type <= 9);
+}
+
+static bool probe_h265_nal(const uint8_t *hdr)
+{
+  int nal_type = (hdr[0] >> 1) & 0x3f;
+  int layer_id = ((hdr[0] & 1) << 5) | (hdr[1] >> 3);
+  if ((hdr[0] & 0x80) || layer_id != 0 || (hdr[1] & 0x07) == 0) {
+    return false;
+  }
+  return nal_type <= 9 || (nal_type >= 16 && nal_type <= 21) || (nal_type >= 32 && nal_type <= 40);
+}
+
+// Annex-B: the file has to open with a start code. Every NAL header then
+// votes; parameter sets are much stronger evidence than slice types, which
+// overlap between the two codecs, and at least one has to be seen.
+static int probe_annexb(const uint8_t *buf, int size, media_file_type_e *p_type)
+{
+  const uint8_t *end = buf + size;
+  const uint8_t *p = buf;
+  int score_264 = 0, score_265 = 0;
+  bool ps_264 = false, ps_265 = false;
+  int i;
+
+  for (i = 0; i < size && buf[i] == 0; i++) {
+  }
+  if (i < 2 || i >= size || buf[i] != 1) {
+    return -1;
+  }
+
+  while ((p = fp_find_startcode(p, end)) != end) {
+    const uint8_t *hdr = p + 3;
+    p = hdr;
+    if (end - hdr < 2) {
+      break;
+    }
+
+    if (probe_h264_nal(hdr)) {
+      int nal_type = hdr[0] & 0x1f;
+      ps_264 |= nal_type == 7 || nal_type == 8;
+      score_264 += (nal_type == 7 || nal_type == 8) ? 4 : 1;
+    }
+    if (probe_h265_nal(hdr)) {
+      int nal_type = (hdr[0] >> 1) & 0x3f;
+      ps_265 |= nal_type >= 32 && nal_type <= 34;
+      score_265 += (nal_type >= 32 && nal_type <= 34) ? 4 : 1;
+    }
+  }
+
+  if (ps_265 && score_265 > score_264) {
+    *p_type = MEDIA_FILE_TYPE_H265;
+    return 0;
+  }
+  if (ps_264 && score_264 >= score_265) {
+    *p_type = MEDIA_FILE_TYPE_H264;
+    return 0;
+  }
+  return -1;
+}
+
+// ADTS: the first header has to be followed by a few more at the offsets its
+// frame lengths announce, with the same fixed header.
+static int probe_adts(const uint8_t *buf, int size, parser_cfg_t *p_cfg)
+{
+  int pos = 0;
+  int frames = 0;
+
+  while (pos + 7 <= size && frames < FP_PROBE_AAC_FRAMES) {
+    const uint8_t *hdr = buf + pos;
+    int frame_length = ((hdr[3] & 0x3) << 11) | (hdr[4] << 3) | (hdr[5] >> 5);
+
+    // syncword and layer 0
+    if (hdr[0] != 0xff || (hdr[1] & 0xf6) != 0xf0 || frame_length < 7) {
+      return -1;
+    }
+    if (frames > 0 && (hdr[1] != buf[1] || (hdr[2] & 0xfd) != (buf[2] & 0xfd) || (hdr[3] & 0xf0) != (buf[3] & 0xf0))) {
+      return -1;
+    }
+    frames++;
+    pos += frame_length;
+  }
+  // a lone header is only believable when it is the whole file
+  if (frames < FP_PROBE_AAC_FRAMES && pos != size) {
+    return -1;
+  }
+
+  int sample_rate = gs_adts_sample_rates[(buf[2] >> 2) & 0x0f];
+  int channels = ((buf[2] & 0x1) << 2) | (buf[3] >> 6);
+  if (sample_rate == 0) {
+    return -1;
+  }
+
+  p_cfg->u.audio_cfg.sampleRateHz = sample_rate;
+  // 0 means the layout is in a program config element; stereo is the norm
+  p_cfg->u.audio_cfg.numberOfChannels = channels ? (channels == 7 ? 8 : channels) : 2;
+  // an AAC frame always carries 1024 samples
+  p_cfg->u.audio_cfg.framePeriodMs = (1024 * 1000 + sample_rate / 2) / sample_rate;
+  return 0;
+}
+
+static int probe_ogg_opus(const uint8_t *buf, int size, parser_cfg_t *p_cfg)
+{
+  const uint8_t *head;
+  int segments;
+
+  if (size < 27 || memcmp(buf, "OggS", 4) != 0) {
+    return -1;
+  }
+  segments = buf[26];
+  head = buf + 27 + segments;
+  if (head + 19 > buf + size || memcmp(head, "OpusHead", 8) != 0) {
+    return -1;
+  }
+
+  // Opus always decodes at 48 kHz; the header's input rate is informational
+  p_cfg->u.audio_cfg.sampleRateHz = 48000;
+  p_cfg->u.audio_cfg.numberOfChannels = head[9];
+  p_cfg->u.audio_cfg.framePeriodMs = FP_PROBE_FRAME_PERIOD_MS;
+  return 0;
+}
+
+static int probe_wav(const uint8_t *buf, int size, media_file_type_e *p_type, parser_cfg_t *p_cfg)
+{
+  size_t pos = 12;
+
+  if (size < 12 || memcmp(buf, "RIFF", 4) != 0 || memcmp(buf + 8, "WAVE", 4) != 0) {
+    return -1;
+  }
+
+  while (pos + 8 <= (size_t)size) {
+    uint32_t chunk_size = probe_rl32(buf + pos + 4);
+    if (memcmp(buf + pos, "fmt ", 4) == 0 && chunk_size >= 16 && pos + 8 + 16 <= (size_t)size) {
+      const uint8_t *fmt = buf + pos + 8;
+      int format = probe_rl16(fmt);
+      int channels = probe_rl16(fmt + 2);
+      int sample_rate = probe_rl32(fmt + 4);
+      int bits = probe_rl16(fmt + 14);
+
+      // WAVE_FORMAT_EXTENSIBLE carries the real format in its sub-format GUID
+      if (format == 0xfffe && chunk_size >= 40 && pos + 8 + 26 <= (size_t)size) {
+        format = probe_rl16(fmt + 24);
+      }
+      if ((format == 1 && (bits == 16 || bits == 24 || bits == 32)) || (format == 3 && bits == 32)) {
+        *p_type = MEDIA_FILE_TYPE_PCM;
+      } else if ((format == 6 || format == 7) && bits == 8) {
+        *p_type = MEDIA_FILE_TYPE_G711;
+        p_cfg->u.audio_cfg.g711Ulaw = format == 7;
+      } else {
+        AGO_LOGW("probe: unsupported wav format %d, %d bits", format, bits);
+        return -1;
+      }
+
+      p_cfg->u.audio_cfg.sampleRateHz = sample_rate;
+      p_cfg->u.audio_cfg.numberOfChannels = channels;
+      p_cfg->u.audio_cfg.framePeriodMs = FP_PROBE_FRAME_PERIOD_MS;
+      return 0;
+    }
+    // the fmt chunk isn't within the probed bytes once a chunk runs past them
+    if (chunk_size > (size_t)size - pos - 8) {
+      break;
+    }
+    // chunks are padded to an even size
+    pos += 8 + (size_t)chunk_size + (chunk_size & 1);
+  }
+
+  return -1;
+}
+
+// YUV4MPEG2 stream header: "YUV4MPEG2 W640 H360 F30000:1001 ..."
+static int probe_y4m(const uint8_t *buf, int size, parser_cfg_t *p_cfg)
+{
+  const uint8_t *end = memchr(buf, '\n', size);
+  const uint8_t *p = buf + 10;
+
+  if (size < 10 || memcmp(buf, "YUV4MPEG2 ", 10) != 0 || !end) {
+    return -1;
+  }
+  while (p < end) {
+    if (*p == 'W') {
+      p_cfg->u.video_cfg.width = atoi((const char *)p + 1);
+    } else if (*p == 'H') {
+      p_cfg->u.video_cfg.height = atoi((const char *)p + 1);
+    } else if (*p == 'F') {
+      char *colon;
+      unsigned long num = strtoul((const char *)p + 1, &colon, 10);
+      unsigned long den = *colon == ':' ? strtoul(colon + 1, NULL, 10) : 1;
+      if (den > 0) {
+        p_cfg->u.video_cfg.fps = (int)((num + den / 2) / den);
+      }
+    }
+    while (p < end && *p != ' ') {
+      p++;
+    }
+    while (p < end && *p == ' ') {
+      p++;
+    }
+  }
+  return p_cfg->u.video_cfg.width > 0 && p_cfg->u.video_cfg.height > 0 ? 0 : -1;
+}
+
+static int probe_file(const char *path, bool audio, media_file_type_e *p_type, parser_cfg_t *p_cfg)
+{
+  uint8_t buf[FP_PROBE_SIZE];
+  ssize_t size = 0;
+  int fd;
+
+  if (!path || !p_type || !p_cfg) {
+    return -1;
+  }
+  // reading ahead would eat input that the parser needs later
+  if (fp_map_path_is_stream(path)) {
+    return -1;
+  }
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  while (size < FP_PROBE_SIZE) {
+    ssize_t n = read(fd, buf + size, FP_PROBE_SIZE - size);
+    if (n <= 0) {
+      break;
+    }
+    size += n;
+  }
+  close(fd);
+  if (size < 4) {
+    return -1;
+  }
+
+  memset(p_cfg, 0, sizeof(parser_cfg_t));
+
+  // the tracks are described in the moov, which may be anywhere in the file
+  if (fp_mp4_is_mp4(path)) {
+    return fp_mp4_probe(path, audio, p_type, p_cfg);
+  }
+
+  if (buf[0] == 0xff && buf[1] == 0xd8 && buf[2] == 0xff) {
+    *p_type = MEDIA_FILE_TYPE_JPEG;
+    return 0;
+  }
+  // only VP8 has a parser; other IVF codecs aren't recognized
+  if (memcmp(buf, "DKIF", 4) == 0 && size >= 12 && memcmp(buf + 8, "VP80", 4) == 0) {
+    *p_type = MEDIA_FILE_TYPE_VP8;
+    return 0;
+  }
+  if (probe_wav(buf, size, p_type, p_cfg) == 0) {
+    return 0;
+  }
+  if (probe_y4m(buf, size, p_cfg) == 0) {
+    *p_type = MEDIA_FILE_TYPE_YUV420;
+    return 0;
+  }
+  if (probe_ogg_opus(buf, size, p_cfg) == 0) {
+    *p_type = MEDIA_FILE_TYPE_OPUS;
+    return 0;
+  }
+  if (probe_adts(buf, size, p_cfg) == 0) {
+    *p_type = MEDIA_FILE_TYPE_AACLC;
+    return 0;
+  }
+  if (probe_annexb(buf, size, p_type) == 0) {
+    return 0;
+  }
+
+  return -1;
+}
+
+int file_parser_probe(const char *path, media_file_type_e *p_type, parser_cfg_t *p_cfg)
+{
+  return probe_file(path, false, p_type, p_cfg);
+}
+
+int file_parser_probe_audio(const char *path, media_file_type_e *p_type, parser_cfg_t *p_cfg)
+{
+  return probe_file(path, true, p_type, p_cfg);
+}
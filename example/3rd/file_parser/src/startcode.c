@@ -0,0 +1,211 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * Annex-B start code scanner shared by the H264/H265 parsers.
+ * A scalar skip-ahead loop is always available; SSE2/AVX2
+ * versions are selected at runtime on x86.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include "file_parser_priv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FP_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+const uint8_t *fp_find_startcode_c(const uint8_t *p, const uint8_t *end)
+{
+  const uint8_t *last = end - 2;
+
+  // p[2] decides how far we can skip: a byte > 1 can't be part of a start code
+  // beginning at p, p + 1 or p + 2.
+  while (p < last) {
+    if (p[2] > 1) {
+      p += 3;
+    } else if (p[1]) {
+      p += 2;
+    } else if (p[0] || p[2] != 1) {
+      p += 1;
+    } else {
+      return p;
+    }
+  }
+
+  return end;
+}
+
+#ifdef FP_HAVE_X86_SIMD
+__attribute__((target("sse2"))) const uint8_t *fp_find_startcode_sse2(const uint8_t *p, const uint8_t *end)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+
+  // Compare the three shifted views (p, p + 1, p + 2) against 00 00 01 at once
+  while (end - p >= 18) {
+    __m128i b0 = _mm_loadu_si128((const __m128i *)p);
+    __m128i b1 = _mm_loadu_si128((const __m128i *)(p + 1));
+    __m128i b2 = _mm_loadu_si128((const __m128i *)(p + 2));
+    __m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+                              _mm_cmpeq_epi8(b2, one));
+    int mask = _mm_movemask_epi8(m);
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+
+  return fp_find_startcode_c(p, end);
+}
+
+__attribute__((target("avx2"))) const uint8_t *fp_find_startcode_avx2(const uint8_t *p, const uint8_t *end)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi8(1);
+
+  while (end - p >= 34) {
+    __m256i b0 = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+    __m256i b2 = _mm256_loadu_si256((const __m256i *)(p + 2));
+    __m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)),
+                                 _mm256_cmpeq_epi8(b2, one));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(m);
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 32;
+  }
+
+  return fp_find_startcode_sse2(p, end);
+}
+#endif
+
+static const fp_startcode_impl_t gs_startcode_impls[] = {
+#ifdef FP_HAVE_X86_SIMD
+  { "avx2", fp_find_startcode_avx2 },
+  { "sse2", fp_find_startcode_sse2 },
+#endif
+  { "c", fp_find_startcode_c },
+};
+static const int gs_startcode_impl_cnt = sizeof(gs_startcode_impls) / sizeof(gs_startcode_impls[0]);
+
+static int startcode_impl_supported(const fp_startcode_impl_t *impl)
+{
+#ifdef FP_HAVE_X86_SIMD
+  if (impl->fn == fp_find_startcode_avx2) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  }
+  if (impl->fn == fp_find_startcode_sse2) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+  }
+#endif
+  return 1;
+}
+
+static const fp_startcode_impl_t *startcode_select(void)
+{
+  int i;
+  for (i = 0; i < gs_startcode_impl_cnt; i++) {
+    if (startcode_impl_supported(&gs_startcode_impls[i])) {
+      break;
+    }
+  }
+  return &gs_startcode_impls[i < gs_startcode_impl_cnt ? i : gs_startcode_impl_cnt - 1];
+}
+
+static const uint8_t *find_startcode_resolve(const uint8_t *p, const uint8_t *end);
+
+// Resolved on first use; every thread resolves to the same function, so the
+// unsynchronized store is harmless.
+static fp_startcode_fn gs_find_startcode = find_startcode_resolve;
+
+static const uint8_t *find_startcode_resolve(const uint8_t *p, const uint8_t *end)
+{
+  gs_find_startcode = startcode_select()->fn;
+  return gs_find_startcode(p, end);
+}
+
+const uint8_t *fp_find_startcode(const uint8_t *p, const uint8_t *end)
+{
+  return gs_find_startcode(p, end);
+}
+
+const char *fp_startcode_impl_name(void)
+{
+  return startcode_select()->name;
+}
+
+int fp_startcode_impls(const fp_startcode_impl_t **impls, int max)
+{
+  int i, n = 0;
+  for (i = 0; i < gs_startcode_impl_cnt && n < max; i++) {
+    if (startcode_impl_supported(&gs_startcode_impls[i])) {
+      impls[n++] = &gs_startcode_impls[i];
+    }
+  }
+  return n;
+}
+
+int fp_find_nal_unit(const uint8_t *buf, int size, int *nal_start, int *hdr_start, int *nal_end)
+{
+  const uint8_t *end = buf + size;
+  const uint8_t *sc;
+  int i;
+
+  *nal_start = 0;
+  *nal_end = 0;
+
+  if (size < 4) {
+    return 0;
+  }
+
+  // find start; a leading zero turns 00 00 01 into the 4-byte form
+  sc = fp_find_startcode(buf, end);
+  if (sc == end) {
+    return 0;
+  }
+  i = sc - buf;
+  if (i > 0 && buf[i - 1] == 0) {
+    i--;
+  }
+  if (size < i + 4) {
+    return 0;
+  }
+  *nal_start = i;
+
+  if (buf[i + 2] == 1) {
+    *hdr_start = i + 3;
+  } else if (size > i + 4) {
+    *hdr_start = i + 4;
+  } else {
+    return 0;
+  }
+  i = *hdr_start + 1;
+
+  if (size < i + 4) {
+    *nal_end = size - 1;
+    return -1;
+  }
+
+  // find end, i.e. the start of the next nal
+  sc = fp_find_startcode(buf + i, end);
+  if (sc != end) {
+    int k = sc - buf;
+    if (k > i && buf[k - 1] == 0) {
+      k--;
+    }
+    if (size >= k + 4) {
+      *nal_end = k - 1;
+      return (*nal_end - *nal_start);
+    }
+  }
+
+  *nal_end = size - 1;
+  return -1;
+}
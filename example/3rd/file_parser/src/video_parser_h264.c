@@ -10,19 +10,18 @@
  *
  *************************************************************/
 
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <unistd.h>
-
 #include "file_parser.h"
 #include "file_parser_priv.h"
 
 typedef struct {
-  int data_offset_;
-  int data_size_;
-  uint8_t *data_buffer_;
-  int fd_;
+  uint64_t data_offset_;
+  fp_map_t map_;
+  // set when a scan ran into the end of a window that isn't the end of file
+  int need_more_;
+  // frame rate from the SPS timing info, else the configured one
+  uint32_t fps_num_;
+  uint32_t fps_den_;
+  uint64_t frames_;
 } ctx_t;
 
 /**
@@ -35,110 +34,60 @@ typedef struct {
  @return                 the length of the nal, or 0 if did not find start of
  nal, or -1 if did not find end of nal
  */
-// DEPRECATED - this will be replaced by a similar function with a slightly
-// different API
 static int find_nal_unit(uint8_t *buf, int size, uint8_t *nal_type, int *nal_start, int *nal_end)
 {
-  if (size < 4) {
-    return 0;
-  }
-  int i = 0;
-  // find start
-  *nal_start = 0;
-  *nal_end = 0;
-
-  while (buf[i] != 0 || buf[i + 1] != 0 || !(buf[i + 2] == 1 || (buf[i + 2] == 0 && buf[i + 3] == 1))) {
-    i++;
-    if (size < i + 4) {
-      return 0;
-    } // did not find nal start
+  int hdr_start = 0;
+  int ret = fp_find_nal_unit(buf, size, nal_start, &hdr_start, nal_end);
+  if (ret != 0) {
+    *nal_type = buf[hdr_start] & 0x1f;
   }
-
-  *nal_start = i;
-
-  if (buf[i + 2] == 1) {
-    *nal_type = buf[i + 3] & 0x1f;
-    i += 4;
-  } else if (size > i + 4) {
-    *nal_type = buf[i + 4] & 0x1f;
-    i += 5;
-  } else {
-    return 0;
-  }
-
-  if (size < i + 4) {
-    *nal_end = size - 1;
-    return -1;
-  }
-
-  while (buf[i] != 0 || buf[i + 1] != 0 || !(buf[i + 2] == 1 || (buf[i + 2] == 0 && buf[i + 3] == 1))) {
-    i++;
-    if (size < i + 4) {
-      *nal_end = size - 1;
-      return -1;
-    } // did not find nal end, stream ended first
-  }
-
-  *nal_end = i - 1;
-  return (*nal_end - *nal_start);
+  return ret;
 }
 
-#define BIT(num, bit) (((num) & (1 << (7 - bit))) > 0)
-static int exp_golomb_decode(uint8_t *buffer, int size, int *bitOffset)
+// first_mb_in_slice and slice_type from the slice header of the nal at
+// [nal_start, nal_end]
+static void h264_slice_header(const uint8_t *buf, int nal_start, int nal_end, int *first_mb_in_slice,
+                              int *slice_type)
 {
-  int totalBits = size << 3;
-  int leadingZeroBits = 0;
-  int i;
-  for (i = *bitOffset; i < totalBits && !BIT(buffer[i / 8], i % 8); i++) {
-    leadingZeroBits++;
+  int hdr = nal_start + (buf[nal_start + 2] == 1 ? 3 : 4);
+  fp_bitreader_t br;
+
+  // skip the one byte nal header
+  fp_br_init_nal(&br, buf + hdr + 1, nal_end - hdr);
+  *first_mb_in_slice = fp_br_ue(&br);
+  if (slice_type) {
+    *slice_type = fp_br_ue(&br);
   }
-  int offset = 0;
-  int bitPos = *bitOffset + leadingZeroBits + 1;
-  for (i = 0; i < leadingZeroBits; i++) {
-    offset = (offset << 1) + BIT(buffer[bitPos / 8], bitPos % 8);
-    bitPos++;
-  }
-  *bitOffset += leadingZeroBits + 1 + leadingZeroBits;
-  return (1 << leadingZeroBits) - 1 + offset;
 }
 
 static int h264_open(media_parser_t *h, const char *path)
 {
-  int rval = -1;
-
-  int fd = -1;
-  do {
-    struct stat sb;
-    void *mapped;
-
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-      break;
-    }
-
-    if ((fstat(fd, &sb)) == -1) {
-      break;
-    }
-
-    mapped = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mapped == (void *)-1) {
-      break;
-    }
+  ctx_t *p_ctx = (ctx_t *)malloc(sizeof(ctx_t));
+  if (!p_ctx) {
+    return -1;
+  }
 
-    ctx_t *p_ctx = (ctx_t *)malloc(sizeof(ctx_t));
-    if (!p_ctx) {
-      break;
+  if (fp_map_open(&p_ctx->map_, path, FP_MAP_WINDOW_SIZE) < 0) {
+    free(p_ctx);
+    return -1;
+  }
+  p_ctx->data_offset_ = 0;
+  p_ctx->need_more_ = 0;
+  p_ctx->fps_num_ = fp_cfg_fps(h);
+  p_ctx->fps_den_ = 1;
+  p_ctx->frames_ = 0;
+
+  // the parameter sets ahead of the first slice describe the stream up front
+  if (fp_map_view(&p_ctx->map_, 0, FP_STREAM_INFO_SCAN_SIZE) == 0) {
+    int len = p_ctx->map_.view_len < FP_STREAM_INFO_SCAN_SIZE ? p_ctx->map_.view_len : FP_STREAM_INFO_SCAN_SIZE;
+    if (fp_annexb_stream_info(p_ctx->map_.view, len, false, &h->video_info, &h->ps_cache) == 0 && h->video_info.fps_num) {
+      p_ctx->fps_num_ = h->video_info.fps_num;
+      p_ctx->fps_den_ = h->video_info.fps_den;
     }
-    p_ctx->data_size_ = sb.st_size;
-    p_ctx->data_buffer_ = (uint8_t *)mapped;
-    p_ctx->data_offset_ = 0;
-    p_ctx->fd_ = fd;
-
-    h->p_ctx = (void *)p_ctx;
-    rval = 0;
-  } while (0);
+  }
 
-  return rval;
+  h->p_ctx = (void *)p_ctx;
+  return 0;
 }
 
 static void _getH264Frame(media_parser_t *h, frame_t *p_frame, int is_key_frame, int frame_start, int frame_end)
@@ -147,59 +96,87 @@ static void _getH264Frame(media_parser_t *h, frame_t *p_frame, int is_key_frame,
   ctx_t *p_ctx = (ctx_t *)h->p_ctx;
 
   p_frame->type = h->type;
-  p_frame->ptr = p_ctx->data_buffer_ + frame_start;
+  p_frame->ptr = p_ctx->map_.view + frame_start;
+  p_frame->offset = p_ctx->map_.view_offset + frame_start;
   p_frame->len = datalen;
   p_frame->u.video.is_key_frame = is_key_frame;
 }
 
-static int h264_obtain_frame(media_parser_t *h, frame_t *p_frame)
+// Scan the mapped window from data_offset_ on; offsets come back window relative
+static int h264_find_nal(ctx_t *p_ctx, int *pos, uint8_t *nal_type, int *nal_start, int *nal_end)
 {
-  int rval = -1;
+  int ret;
+
+  *pos = p_ctx->data_offset_ - p_ctx->map_.view_offset;
+  ret = find_nal_unit(p_ctx->map_.view + *pos, p_ctx->map_.view_len - *pos, nal_type, nal_start, nal_end);
+  if (ret <= 0 && !fp_map_view_at_eof(&p_ctx->map_)) {
+    p_ctx->need_more_ = 1;
+  }
+  return ret;
+}
 
+// Cache a SPS or PPS and pick up the frame rate from a SPS; nal_start and
+// nal_end are relative to pos
+static void h264_param_set(media_parser_t *h, int pos, uint8_t nal_type, int nal_start, int nal_end)
+{
   ctx_t *p_ctx = (ctx_t *)h->p_ctx;
-  if (!p_ctx) {
-    AGO_LOGE("parser: invalid ctx");
-    return -1;
+  const uint8_t *nal = p_ctx->map_.view + pos + nal_start;
+  int hdr = nal[2] == 1 ? 3 : 4;
+  int len = nal_end - nal_start + 1 - hdr;
+  video_stream_info_t info;
+
+  // cut off by the end of the window; it is seen again once the window grew
+  if (p_ctx->need_more_) {
+    return;
+  }
+  fp_ps_cache_put(&h->ps_cache, false, nal + hdr, len);
+  if (nal_type == 7 && fp_h264_parse_sps(nal + hdr, len, &info) == 0 && info.fps_num) {
+    p_ctx->fps_num_ = info.fps_num;
+    p_ctx->fps_den_ = info.fps_den;
   }
+}
 
+static int h264_parse_frame(media_parser_t *h, frame_t *p_frame)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  uint8_t *buf = p_ctx->map_.view;
   uint8_t nal_type = 0;
+  int pos = 0;
   int nal_start = 0;
   int nal_end = 0;
   int is_key_frame;
+  bool has_param_sets = false;
   int frame_start = 0;
   int frame_end = 0;
   int ret;
 
+  fp_frame_clear_nals(p_frame);
+
   // get first nalu for frame_start
-  ret = find_nal_unit(p_ctx->data_buffer_ + p_ctx->data_offset_, p_ctx->data_size_ - p_ctx->data_offset_, &nal_type,
-                      &nal_start, &nal_end);
+  ret = h264_find_nal(p_ctx, &pos, &nal_type, &nal_start, &nal_end);
   if (ret == 0) {
-    // AGO_LOGW("End of video file, offset:%d, size:%d", p_ctx->data_offset_, p_ctx->data_size_);
-    // p_ctx->data_offset_ = 0;
-    rval = -2;
-    return rval;
+    return -2;
   }
-  frame_start = p_ctx->data_offset_ + nal_start;
+  frame_start = pos + nal_start;
 
   // get first I slice or P slice for frame_type
   while (nal_type != 1 && nal_type != 5) {
+    fp_frame_add_nal(p_frame, buf, pos + nal_start, pos + nal_end, nal_type);
+    if (nal_type == 7 || nal_type == 8) {
+      h264_param_set(h, pos, nal_type, nal_start, nal_end);
+      has_param_sets |= nal_type == 7;
+    }
     p_ctx->data_offset_ += nal_end + 1;
-    ret = find_nal_unit(p_ctx->data_buffer_ + p_ctx->data_offset_, p_ctx->data_size_ - p_ctx->data_offset_, &nal_type,
-                        &nal_start, &nal_end);
+    ret = h264_find_nal(p_ctx, &pos, &nal_type, &nal_start, &nal_end);
     if (ret == 0) {
-      // AGO_LOGW("End of video file, offset:%d, size:%d", p_ctx->data_offset_, p_ctx->data_size_);
-      // p_ctx->data_offset_ = 0;
-      rval = -2;
-      return rval;
+      return -2;
     }
   }
 
-  int offset = p_ctx->data_offset_ + nal_start;
-  offset += p_ctx->data_buffer_[offset + 2] ? 3 : 4 + 1;
-
-  int bitOffset = 0;
-  int first_mb_in_slice = exp_golomb_decode(p_ctx->data_buffer_ + offset, p_ctx->data_size_ - offset, &bitOffset);
-  int slice_type = exp_golomb_decode(p_ctx->data_buffer_ + offset, p_ctx->data_size_ - offset, &bitOffset);
+  int first_mb_in_slice, slice_type;
+  h264_slice_header(buf, pos + nal_start, pos + nal_end, &first_mb_in_slice, &slice_type);
+  // nal_ref_idc 0: no other picture predicts from this one
+  int nal_ref_idc = buf[pos + nal_start + (buf[pos + nal_start + 2] == 1 ? 3 : 4)] >> 5;
 
   if (nal_type == 5) { // IDR
     is_key_frame = 1;
@@ -213,45 +190,97 @@ static int h264_obtain_frame(media_parser_t *h, frame_t *p_frame)
   }
   int prev_first_mb_in_slice = first_mb_in_slice;
   int prev_nal_type = nal_type;
+  fp_frame_add_nal(p_frame, buf, pos + nal_start, pos + nal_end, nal_type);
 
   // judge the slice is the last slice in a frame or not
   while (1) {
     p_ctx->data_offset_ += nal_end + 1;
-    ret = find_nal_unit(p_ctx->data_buffer_ + p_ctx->data_offset_, p_ctx->data_size_ - p_ctx->data_offset_, &nal_type,
-                        &nal_start, &nal_end);
-    if (nal_type != prev_nal_type)
+    ret = h264_find_nal(p_ctx, &pos, &nal_type, &nal_start, &nal_end);
+    if (ret == 0 || nal_type != prev_nal_type) {
       break;
-    offset = p_ctx->data_offset_ + nal_start;
-    offset += p_ctx->data_buffer_[offset + 2] ? 3 : 4 + 1;
-    bitOffset = 0;
-    //int Last_FNIS = first_mb_in_slice;
-    first_mb_in_slice = exp_golomb_decode(p_ctx->data_buffer_ + offset, p_ctx->data_size_ - offset, &bitOffset);
+    }
+    h264_slice_header(buf, pos + nal_start, pos + nal_end, &first_mb_in_slice, NULL);
     if ((prev_first_mb_in_slice > first_mb_in_slice) ||
         (prev_first_mb_in_slice == first_mb_in_slice && prev_first_mb_in_slice == 0)) {
       break;
     }
+    fp_frame_add_nal(p_frame, buf, pos + nal_start, pos + nal_end, nal_type);
+  }
 
-    if (ret == 0) {
-      // AGO_LOGW("End of video file, offset:%d, size:%d", p_ctx->data_offset_, p_ctx->data_size_);
-      // //printf("num_I is %d,num_P is %d",num_I,num_P);
-      // _getH264Frame(h, p_frame, is_key_frame, frame_start, frame_end);
-      // p_ctx->data_offset_ = 0;
-      // rval = 0;
-      // return rval;
+  frame_end = p_ctx->data_offset_ - p_ctx->map_.view_offset - 1;
+  fp_frame_rebase_nals(p_frame, frame_start);
+  _getH264Frame(h, p_frame, is_key_frame, frame_start, frame_end);
+  p_frame->u.video.has_param_sets = has_param_sets;
+  if (is_key_frame) {
+    p_frame->u.video.frame_class = VIDEO_FRAME_CLASS_KEY;
+  } else if (nal_ref_idc) {
+    p_frame->u.video.frame_class = VIDEO_FRAME_CLASS_REFERENCE;
+  } else {
+    p_frame->u.video.frame_class = VIDEO_FRAME_CLASS_DISPOSABLE;
+  }
+  return 0;
+}
+
+static int h264_obtain_frame(media_parser_t *h, frame_t *p_frame)
+{
+  uint64_t frame_offset;
+  int rval = -1;
+
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    AGO_LOGE("parser: invalid ctx");
+    return -1;
+  }
+
+  frame_offset = p_ctx->data_offset_;
+  rval = fp_map_view(&p_ctx->map_, frame_offset, 0);
+  if (rval < 0) {
+    return rval;
+  }
+
+  // a frame that runs past the end of the window is parsed again from a
+  // window starting at the frame, grown until the whole frame fits; on a
+  // stream that means waiting for more input
+  while (1) {
+    p_ctx->need_more_ = 0;
+    rval = h264_parse_frame(h, p_frame);
+    if (!p_ctx->need_more_) {
       break;
     }
+    p_ctx->data_offset_ = frame_offset;
+    if (fp_map_grow(&p_ctx->map_, frame_offset) < 0) {
+      return -1;
+    }
   }
 
-  frame_end = p_ctx->data_offset_ - 1;
-  //frame_end = data_offset_ + nal_end;
-  //data_offset_ += nal_end + 1;
-  _getH264Frame(h, p_frame, is_key_frame, frame_start, frame_end);
-  rval = 0;
+  if (rval == 0) {
+    p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+    fp_frame_timing(p_frame, p_ctx->frames_ * p_ctx->fps_den_, p_ctx->fps_den_, p_ctx->fps_num_);
+    p_ctx->frames_++;
+  }
   return rval;
 }
 
 static int h264_release_frame(media_parser_t *h, frame_t *p_frame)
 {
+  fp_map_unref((fp_map_window_t *)p_frame->p_priv);
+  p_frame->p_priv = NULL;
+  return 0;
+}
+
+static int h264_frame_at(media_parser_t *h, uint64_t offset, uint32_t len, frame_t *p_frame)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx || offset + len > p_ctx->map_.size || fp_map_view(&p_ctx->map_, offset, len) < 0) {
+    return -1;
+  }
+
+  p_frame->ptr = p_ctx->map_.view + (offset - p_ctx->map_.view_offset);
+  p_frame->offset = offset;
+  p_frame->len = len;
+  p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+  fp_annexb_list_nals(p_frame, false);
+  p_ctx->data_offset_ = offset + len;
   return 0;
 }
 
@@ -265,6 +294,7 @@ static int h264_reset(media_parser_t *h)
     }
 
     p_ctx->data_offset_ = 0;
+    p_ctx->frames_ = 0;
     rval = 0;
   } while (0);
 
@@ -280,15 +310,7 @@ static int h264_close(media_parser_t *h)
       break;
     }
 
-    if (p_ctx->data_buffer_) {
-      munmap(p_ctx->data_buffer_, p_ctx->data_size_);
-      p_ctx->data_buffer_ = NULL;
-      p_ctx->data_size_ = 0;
-    }
-
-    if (p_ctx->fd_ > 0) {
-      close(p_ctx->fd_);
-    }
+    fp_map_close(&p_ctx->map_);
 
     free(p_ctx);
     h->p_ctx = NULL;
@@ -308,4 +330,5 @@ media_parser_t video_parser_h264 = {
   .release_frame = h264_release_frame,
   .reset = h264_reset,
   .close = h264_close,
+  .frame_at = h264_frame_at,
 };
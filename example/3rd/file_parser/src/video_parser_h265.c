@@ -13,11 +13,7 @@
 #include "file_parser.h"
 #include "file_parser_priv.h"
 
-#include <fcntl.h>
 #include <string.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <unistd.h>
 
 /**
  Find the beginning and end of a NAL (Network Abstraction Layer) unit in a byte
@@ -29,79 +25,25 @@
  @return                 the length of the nal, or 0 if did not find start of
  nal, or -1 if did not find end of nal
  */
-// DEPRECATED - this will be replaced by a similar function with a slightly
-// different API
 static int find_nal_unit(uint8_t *buf, int size, uint8_t *nal_type, int *nal_start, int *nal_end)
 {
-  if (size < 4) {
-    return 0;
+  int hdr_start = 0;
+  int ret = fp_find_nal_unit(buf, size, nal_start, &hdr_start, nal_end);
+  if (ret != 0) {
+    *nal_type = (buf[hdr_start] & 0x7e) >> 1;
   }
-  int i = 0;
-  // find start
-  *nal_start = 0;
-  *nal_end = 0;
-
-  while (buf[i] != 0 || buf[i + 1] != 0 ||
-       !(buf[i + 2] == 1 || (buf[i + 2] == 0 && buf[i + 3] == 1))) {
-    i++;
-    if (size < i + 4) {
-      return 0;
-    } // did not find nal start
-  }
-
-  *nal_start = i;
-
-  if (buf[i + 2] == 1) {
-    *nal_type = (buf[i + 3] & 0x7e)>>1;
-    i += 4;
-  } else if (size > i + 4) {
-    *nal_type = (buf[i + 4] & 0x7e)>>1;
-    i += 5;
-  } else {
-    return 0;
-  }
-  if (size < i + 4) {
-    *nal_end = size - 1;
-    return -1;
-  }
-
-  while (buf[i] != 0 || buf[i + 1] != 0 ||
-       !(buf[i + 2] == 1 || (buf[i + 2] == 0 && buf[i + 3] == 1))) {
-    i++;
-    if (size < i + 4) {
-      *nal_end = size - 1;
-      return -1;
-    } // did not find nal end, stream ended first
-  }
-
-  *nal_end = i - 1;
-  return (*nal_end - *nal_start);
-}
-
-#define BIT(num, bit) (((num) & (1 << (7 - bit))) > 0)
-static int exp_golomb_decode(uint8_t *buffer, int size, int *bitOffset)
-{
-  int totalBits = size << 3;
-  int leadingZeroBits = 0;
-  for (int i = *bitOffset; i < totalBits && !BIT(buffer[i / 8], i % 8); i++) {
-    leadingZeroBits++;
-  }
-  int offset = 0;
-  int bitPos = *bitOffset + leadingZeroBits + 1;
-  for (int i = 0; i < leadingZeroBits; i++) {
-    offset = (offset << 1) + BIT(buffer[bitPos / 8], bitPos % 8);
-    bitPos++;
-  }
-  *bitOffset += leadingZeroBits + 1 + leadingZeroBits;
-  return (1 << leadingZeroBits) - 1 + offset;
+  return ret;
 }
 
-
 typedef struct {
-  int data_offset_;
-  int data_size_;
-  uint8_t *data_buffer_;
-  int fd_;
+  uint64_t data_offset_;
+  fp_map_t map_;
+  // set when a scan ran into the end of a window that isn't the end of file
+  int need_more_;
+  // frame rate from the VPS or SPS timing info, else the configured one
+  uint32_t fps_num_;
+  uint32_t fps_den_;
+  uint64_t frames_;
 } ctx_t;
 
 static void _getH265Frame(media_parser_t *h, frame_t *p_frame, int is_key_frame, int frame_start, int frame_end)
@@ -110,20 +52,114 @@ static void _getH265Frame(media_parser_t *h, frame_t *p_frame, int is_key_frame,
   ctx_t *p_ctx = (ctx_t *)h->p_ctx;
 
   p_frame->type = h->type;
-  p_frame->ptr = p_ctx->data_buffer_ + frame_start;
+  p_frame->ptr = p_ctx->map_.view + frame_start;
+  p_frame->offset = p_ctx->map_.view_offset + frame_start;
   p_frame->len = datalen;
   p_frame->u.video.is_key_frame = is_key_frame;
 }
 
-static int h265_obtain_frame(media_parser_t *h, frame_t *p_frame)
+// Scan the mapped window from data_offset_ on; offsets come back window relative
+static int h265_find_nal(ctx_t *p_ctx, int *pos, uint8_t *nal_type, int *nal_start, int *nal_end)
+{
+  int ret;
+
+  *pos = p_ctx->data_offset_ - p_ctx->map_.view_offset;
+  ret = find_nal_unit(p_ctx->map_.view + *pos, p_ctx->map_.view_len - *pos, nal_type, nal_start, nal_end);
+  if (ret <= 0 && !fp_map_view_at_eof(&p_ctx->map_)) {
+    p_ctx->need_more_ = 1;
+  }
+  return ret;
+}
+
+// Cache a VPS, SPS or PPS and pick up the frame rate from a VPS or SPS;
+// nal_start and nal_end are relative to pos
+static void h265_param_set(media_parser_t *h, int pos, uint8_t nal_type, int nal_start, int nal_end)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  const uint8_t *nal = p_ctx->map_.view + pos + nal_start;
+  int hdr = nal[2] == 1 ? 3 : 4;
+  int len = nal_end - nal_start + 1 - hdr;
+  video_stream_info_t info;
+  int ret;
+
+  // cut off by the end of the window; it is seen again once the window grew
+  if (p_ctx->need_more_) {
+    return;
+  }
+  fp_ps_cache_put(&h->ps_cache, true, nal + hdr, len);
+  if (nal_type == 34) {
+    return;
+  }
+  ret = nal_type == 32 ? fp_h265_parse_vps(nal + hdr, len, &info) : fp_h265_parse_sps(nal + hdr, len, &info);
+  if (ret == 0 && info.fps_num) {
+    p_ctx->fps_num_ = info.fps_num;
+    p_ctx->fps_den_ = info.fps_den;
+  }
+}
+
+static int h265_parse_frame(media_parser_t *h, frame_t *p_frame)
 {
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  uint8_t *buf = p_ctx->map_.view;
   uint8_t nal_type = 0;
+  int pos = 0;
   int nal_start = 0;
   int nal_end = 0;
   bool is_key_frame;
+  bool has_param_sets = false;
   int frame_start = 0;
   int frame_end = 0;
   int ret = 0;
+
+  fp_frame_clear_nals(p_frame);
+
+  // get first nalu for frame_start
+  ret = h265_find_nal(p_ctx, &pos, &nal_type, &nal_start, &nal_end);
+  if (ret == 0) {
+    return -2;
+  }
+  frame_start = pos + nal_start;
+
+  // get the first slice for frame_type; types below 32 are VCL
+  while (nal_type >= 32) {
+    fp_frame_add_nal(p_frame, buf, pos + nal_start, pos + nal_end, nal_type);
+    if (nal_type >= 32 && nal_type <= 34) {
+      h265_param_set(h, pos, nal_type, nal_start, nal_end);
+      has_param_sets |= nal_type == 33;
+    }
+    p_ctx->data_offset_ += nal_end + 1;
+    ret = h265_find_nal(p_ctx, &pos, &nal_type, &nal_start, &nal_end);
+    if (ret == 0) {
+      return -2;
+    }
+  }
+  // BLA, IDR and CRA pictures are random access points
+  is_key_frame = nal_type >= 16 && nal_type <= 21;
+  // nuh_temporal_id_plus1
+  uint8_t temporal_id = (buf[pos + nal_start + (buf[pos + nal_start + 2] == 1 ? 3 : 4) + 1] & 0x07) - 1;
+  // TRAIL_N, TSA_N, STSA_N, RADL_N, RASL_N and the reserved RSV_VCL_N types
+  bool sub_layer_non_ref = nal_type <= 14 && (nal_type & 1) == 0;
+
+  frame_end = pos + nal_end;
+  p_ctx->data_offset_ += nal_end + 1;
+  fp_frame_add_nal(p_frame, buf, pos + nal_start, pos + nal_end, nal_type);
+  fp_frame_rebase_nals(p_frame, frame_start);
+  _getH265Frame(h, p_frame, is_key_frame, frame_start, frame_end);
+  p_frame->u.video.has_param_sets = has_param_sets;
+  p_frame->u.video.temporal_id = temporal_id;
+  if (is_key_frame) {
+    p_frame->u.video.frame_class = VIDEO_FRAME_CLASS_KEY;
+  } else if (sub_layer_non_ref || temporal_id > 0) {
+    p_frame->u.video.frame_class = VIDEO_FRAME_CLASS_DISPOSABLE;
+  } else {
+    p_frame->u.video.frame_class = VIDEO_FRAME_CLASS_REFERENCE;
+  }
+  return 0;
+}
+
+static int h265_obtain_frame(media_parser_t *h, frame_t *p_frame)
+{
+  uint64_t frame_offset;
   int rval = -1;
 
   ctx_t *p_ctx = (ctx_t *)h->p_ctx;
@@ -132,96 +168,86 @@ static int h265_obtain_frame(media_parser_t *h, frame_t *p_frame)
     return -1;
   }
 
-  // get first nalu for frame_start
-  ret = find_nal_unit(p_ctx->data_buffer_ + p_ctx->data_offset_, p_ctx->data_size_ - p_ctx->data_offset_, &nal_type,
-                      &nal_start, &nal_end);
-  if (ret == 0) {
-    printf("End of video file, offset:%d, size:%d\n", p_ctx->data_offset_, p_ctx->data_size_);
-    rval = -2;
+  frame_offset = p_ctx->data_offset_;
+  rval = fp_map_view(&p_ctx->map_, frame_offset, 0);
+  if (rval < 0) {
     return rval;
   }
-  frame_start = p_ctx->data_offset_ + nal_start;
 
-  // get first I slice or P slice for frame_type
-  while (nal_type != 1 && nal_type != 19) {
-    p_ctx->data_offset_ += nal_end + 1;
-    ret = find_nal_unit(p_ctx->data_buffer_ + p_ctx->data_offset_, p_ctx->data_size_ - p_ctx->data_offset_, &nal_type,
-                        &nal_start, &nal_end);
-    if (ret == 0) {
-      printf("End of video file, offset:%d, size:%d\n", p_ctx->data_offset_, p_ctx->data_size_);
-      rval = -2;
-      return rval;
+  // a frame that runs past the end of the window is parsed again from a
+  // window starting at the frame, grown until the whole frame fits; on a
+  // stream that means waiting for more input
+  while (1) {
+    p_ctx->need_more_ = 0;
+    rval = h265_parse_frame(h, p_frame);
+    if (!p_ctx->need_more_) {
+      break;
+    }
+    p_ctx->data_offset_ = frame_offset;
+    if (fp_map_grow(&p_ctx->map_, frame_offset) < 0) {
+      return -1;
     }
   }
-  int offset = p_ctx->data_offset_ + nal_start;
-  offset += p_ctx->data_buffer_[offset + 2] ? 3 : 4 + 1;
 
-  int bitOffset = 0;
-  int first_mb_in_slice =
-      exp_golomb_decode(p_ctx->data_buffer_ + offset, p_ctx->data_size_ - offset, &bitOffset);
-  int slice_type = exp_golomb_decode(p_ctx->data_buffer_ + offset, p_ctx->data_size_ - offset, &bitOffset);
-  (void)slice_type; // 标记变量有意未使用
-
-  if (nal_type == 19) { // IDR
-    is_key_frame = true;
-  } else {
-    is_key_frame = false;
+  if (rval == 0) {
+    p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+    fp_frame_timing(p_frame, p_ctx->frames_ * p_ctx->fps_den_, p_ctx->fps_den_, p_ctx->fps_num_);
+    p_ctx->frames_++;
   }
-  int prev_first_mb_in_slice = first_mb_in_slice;
-  (void)prev_first_mb_in_slice; // 标记变量有意未使用
-  int prev_nal_type = nal_type;
-  (void)prev_nal_type; // 标记变量有意未使用
-
-  frame_end = p_ctx->data_offset_ - 1;
-  frame_end = p_ctx->data_offset_ + nal_end;
-  p_ctx->data_offset_ += nal_end + 1;
-  _getH265Frame(h, p_frame, is_key_frame, frame_start, frame_end);
-  rval = 0;
   return rval;
 }
 
 static int h265_release_frame(media_parser_t *h, frame_t *p_frame)
 {
+  fp_map_unref((fp_map_window_t *)p_frame->p_priv);
+  p_frame->p_priv = NULL;
   return 0;
 }
 
 static int h265_open(media_parser_t *h, const char *path)
 {
-  int rval = -1;
-
-  int fd = -1;
-  do {
-    struct stat sb;
-    void *mapped;
-
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-      break;
-    }
-
-    if ((fstat(fd, &sb)) == -1) {
-      break;
-    }
+  ctx_t *p_ctx = (ctx_t *)malloc(sizeof(ctx_t));
+  if (!p_ctx) {
+    return -1;
+  }
 
-    mapped = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mapped == (void *)-1) {
-      break;
+  if (fp_map_open(&p_ctx->map_, path, FP_MAP_WINDOW_SIZE) < 0) {
+    free(p_ctx);
+    return -1;
+  }
+  p_ctx->data_offset_ = 0;
+  p_ctx->need_more_ = 0;
+  p_ctx->fps_num_ = fp_cfg_fps(h);
+  p_ctx->fps_den_ = 1;
+  p_ctx->frames_ = 0;
+
+  // the parameter sets ahead of the first slice describe the stream up front
+  if (fp_map_view(&p_ctx->map_, 0, FP_STREAM_INFO_SCAN_SIZE) == 0) {
+    int len = p_ctx->map_.view_len < FP_STREAM_INFO_SCAN_SIZE ? p_ctx->map_.view_len : FP_STREAM_INFO_SCAN_SIZE;
+    if (fp_annexb_stream_info(p_ctx->map_.view, len, true, &h->video_info, &h->ps_cache) == 0 && h->video_info.fps_num) {
+      p_ctx->fps_num_ = h->video_info.fps_num;
+      p_ctx->fps_den_ = h->video_info.fps_den;
     }
+  }
 
-    ctx_t *p_ctx = (ctx_t *)malloc(sizeof(ctx_t));
-    if (!p_ctx) {
-      break;
-    }
-    p_ctx->data_size_ = sb.st_size;
-    p_ctx->data_buffer_ = (uint8_t *)mapped;
-    p_ctx->data_offset_ = 0;
-    p_ctx->fd_ = fd;
+  h->p_ctx = (void *)p_ctx;
+  return 0;
+}
 
-    h->p_ctx = (void *)p_ctx;
-    rval = 0;
-  } while (0);
+static int h265_frame_at(media_parser_t *h, uint64_t offset, uint32_t len, frame_t *p_frame)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx || offset + len > p_ctx->map_.size || fp_map_view(&p_ctx->map_, offset, len) < 0) {
+    return -1;
+  }
 
-  return rval;
+  p_frame->ptr = p_ctx->map_.view + (offset - p_ctx->map_.view_offset);
+  p_frame->offset = offset;
+  p_frame->len = len;
+  p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+  fp_annexb_list_nals(p_frame, true);
+  p_ctx->data_offset_ = offset + len;
+  return 0;
 }
 
 static int h265_reset(media_parser_t *h)
@@ -234,6 +260,7 @@ static int h265_reset(media_parser_t *h)
     }
 
     p_ctx->data_offset_ = 0;
+    p_ctx->frames_ = 0;
     rval = 0;
   } while (0);
 
@@ -249,15 +276,7 @@ static int h265_close(media_parser_t *h)
       break;
     }
 
-    if (p_ctx->data_buffer_) {
-      munmap(p_ctx->data_buffer_, p_ctx->data_size_);
-      p_ctx->data_buffer_ = NULL;
-      p_ctx->data_size_ = 0;
-    }
-
-    if (p_ctx->fd_ > 0) {
-      close(p_ctx->fd_);
-    }
+    fp_map_close(&p_ctx->map_);
 
     free(p_ctx);
     h->p_ctx = NULL;
@@ -277,4 +296,5 @@ media_parser_t video_parser_h265 = {
   .release_frame = h265_release_frame,
   .reset = h265_reset,
   .close = h265_close,
+  .frame_at = h265_frame_at,
 };
\ No newline at end of file
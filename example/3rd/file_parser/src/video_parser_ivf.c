@@ -0,0 +1,249 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * IVF demuxer for VP8. Every frame carries its size and timestamp
+ * in a 12 byte header, so frames are handed out straight from the
+ * mapped file without scanning.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <string.h>
+
+#include "file_parser.h"
+#include "file_parser_priv.h"
+
+#define IVF_FILE_HEADER_SIZE 32
+#define IVF_FRAME_HEADER_SIZE 12
+// a time base coarser than this is taken to be the frame rate
+#define IVF_MAX_FPS 240
+
+typedef struct {
+  // header of the next frame
+  uint64_t data_offset_;
+  fp_map_t map_;
+  uint32_t header_len_;
+  // seconds per tick as a fraction
+  uint32_t rate_;
+  uint32_t scale_;
+  // pts of the first frame, so that time starts at 0
+  uint64_t first_pts_;
+  bool have_first_pts_;
+  // used for the last frame, which has no successor to measure against
+  uint64_t last_duration_;
+} ctx_t;
+
+static inline uint16_t ivf_rl16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t ivf_rl32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t ivf_rl64(const uint8_t *p)
+{
+  return ivf_rl32(p) | ((uint64_t)ivf_rl32(p + 4) << 32);
+}
+
+// VP8 frame tag (RFC 6386 9.1): bit 0 clear on a key frame, which is followed
+// by the 9d 01 2a start code and the picture size
+static bool vp8_is_key_frame(const uint8_t *buf, uint32_t len)
+{
+  return len >= 10 && !(buf[0] & 1) && buf[3] == 0x9d && buf[4] == 0x01 && buf[5] == 0x2a;
+}
+
+static int ivf_open(media_parser_t *h, const char *path)
+{
+  const uint8_t *hdr;
+
+  ctx_t *p_ctx = (ctx_t *)calloc(1, sizeof(ctx_t));
+  if (!p_ctx) {
+    return -1;
+  }
+
+  if (fp_map_open(&p_ctx->map_, path, FP_MAP_WINDOW_SIZE) < 0) {
+    AGO_LOGE("open %s failed", path);
+    free(p_ctx);
+    return -1;
+  }
+
+  if (fp_map_view(&p_ctx->map_, 0, IVF_FILE_HEADER_SIZE) < 0 || p_ctx->map_.size < IVF_FILE_HEADER_SIZE) {
+    AGO_LOGE("parser: %s is too short for IVF", path);
+    goto fail;
+  }
+  hdr = p_ctx->map_.view;
+  if (memcmp(hdr, "DKIF", 4) != 0) {
+    AGO_LOGE("parser: %s is not an IVF file", path);
+    goto fail;
+  }
+  if (memcmp(hdr + 8, "VP80", 4) != 0) {
+    AGO_LOGE("parser: unsupported IVF codec %.4s", (const char *)hdr + 8);
+    goto fail;
+  }
+
+  p_ctx->header_len_ = ivf_rl16(hdr + 6);
+  if (p_ctx->header_len_ < IVF_FILE_HEADER_SIZE) {
+    p_ctx->header_len_ = IVF_FILE_HEADER_SIZE;
+  }
+  p_ctx->rate_ = ivf_rl32(hdr + 16);
+  p_ctx->scale_ = ivf_rl32(hdr + 20);
+  if (p_ctx->rate_ == 0 || p_ctx->scale_ == 0) {
+    // no usable time base: count frames at the configured rate
+    p_ctx->rate_ = fp_cfg_fps(h);
+    p_ctx->scale_ = 1;
+  }
+  p_ctx->data_offset_ = p_ctx->header_len_;
+  p_ctx->last_duration_ = 1;
+
+  h->video_info.width = ivf_rl16(hdr + 12);
+  h->video_info.height = ivf_rl16(hdr + 14);
+  // writers like libvpx use 1/fps as the time base; a millisecond clock
+  // says nothing about the frame rate
+  if (p_ctx->rate_ / p_ctx->scale_ <= IVF_MAX_FPS) {
+    h->video_info.fps_num = p_ctx->rate_;
+    h->video_info.fps_den = p_ctx->scale_;
+  }
+
+  h->p_ctx = (void *)p_ctx;
+  return 0;
+
+fail:
+  fp_map_close(&p_ctx->map_);
+  free(p_ctx);
+  return -1;
+}
+
+static int ivf_obtain_frame(media_parser_t *h, frame_t *p_frame)
+{
+  const uint8_t *hdr;
+  uint64_t offset, pts, duration;
+  uint32_t size;
+  int ret;
+
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    AGO_LOGE("parser: invalid ctx");
+    return -1;
+  }
+
+  offset = p_ctx->data_offset_;
+  ret = fp_map_view(&p_ctx->map_, offset, IVF_FRAME_HEADER_SIZE);
+  if (ret < 0) {
+    return ret;
+  }
+  if (offset + IVF_FRAME_HEADER_SIZE > p_ctx->map_.size) {
+    return -2;
+  }
+  hdr = p_ctx->map_.view + (offset - p_ctx->map_.view_offset);
+  size = ivf_rl32(hdr);
+  pts = ivf_rl64(hdr + 4);
+
+  // the next frame's header too, for the duration
+  if (fp_map_view(&p_ctx->map_, offset, IVF_FRAME_HEADER_SIZE + (uint64_t)size + IVF_FRAME_HEADER_SIZE) < 0) {
+    return -1;
+  }
+  // a truncated last frame
+  if (offset + IVF_FRAME_HEADER_SIZE + size > p_ctx->map_.size) {
+    return -2;
+  }
+  hdr = p_ctx->map_.view + (offset - p_ctx->map_.view_offset);
+
+  if (!p_ctx->have_first_pts_) {
+    p_ctx->first_pts_ = pts;
+    p_ctx->have_first_pts_ = true;
+  }
+  // timestamps going backwards are not trusted
+  pts = pts > p_ctx->first_pts_ ? pts - p_ctx->first_pts_ : 0;
+  duration = p_ctx->last_duration_;
+  if (offset + 2 * IVF_FRAME_HEADER_SIZE + size <= p_ctx->map_.size) {
+    uint64_t next_pts = ivf_rl64(hdr + IVF_FRAME_HEADER_SIZE + size + 4);
+    if (next_pts > pts + p_ctx->first_pts_) {
+      duration = next_pts - p_ctx->first_pts_ - pts;
+    }
+  }
+  p_ctx->last_duration_ = duration;
+
+  p_frame->ptr = (uint8_t *)hdr + IVF_FRAME_HEADER_SIZE;
+  p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+  p_frame->type = h->type;
+  p_frame->len = size;
+  p_frame->offset = offset + IVF_FRAME_HEADER_SIZE;
+  p_frame->u.video.is_key_frame = vp8_is_key_frame(p_frame->ptr, size);
+  p_frame->u.video.has_param_sets = false;
+  // which frames refresh a reference buffer is only known deep in the
+  // compressed header, so every inter frame counts as a reference
+  p_frame->u.video.frame_class = p_frame->u.video.is_key_frame ? VIDEO_FRAME_CLASS_KEY : VIDEO_FRAME_CLASS_REFERENCE;
+  p_frame->u.video.temporal_id = 0;
+  fp_frame_timing(p_frame, pts * p_ctx->scale_, (uint32_t)(duration * p_ctx->scale_), p_ctx->rate_);
+  p_ctx->data_offset_ = offset + IVF_FRAME_HEADER_SIZE + size;
+
+  return 0;
+}
+
+static int ivf_release_frame(media_parser_t *h, frame_t *p_frame)
+{
+  fp_map_unref((fp_map_window_t *)p_frame->p_priv);
+  p_frame->p_priv = NULL;
+  return 0;
+}
+
+static int ivf_frame_at(media_parser_t *h, uint64_t offset, uint32_t len, frame_t *p_frame)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx || offset + len > p_ctx->map_.size || fp_map_view(&p_ctx->map_, offset, len) < 0) {
+    return -1;
+  }
+
+  p_frame->ptr = p_ctx->map_.view + (offset - p_ctx->map_.view_offset);
+  p_frame->offset = offset;
+  p_frame->len = len;
+  p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+  p_ctx->data_offset_ = offset + len;
+  return 0;
+}
+
+static int ivf_reset(media_parser_t *h)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    return -1;
+  }
+
+  p_ctx->data_offset_ = p_ctx->header_len_;
+  p_ctx->have_first_pts_ = false;
+  return 0;
+}
+
+static int ivf_close(media_parser_t *h)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    return -1;
+  }
+
+  fp_map_close(&p_ctx->map_);
+
+  free(p_ctx);
+  h->p_ctx = NULL;
+
+  return 0;
+}
+
+media_parser_t video_parser_ivf = {
+  .codec = MEDIA_FILE_TYPE_VP8,
+  .name = "ivf",
+  .p_ctx = NULL,
+
+  .open = ivf_open,
+  .obtain_frame = ivf_obtain_frame,
+  .release_frame = ivf_release_frame,
+  .reset = ivf_reset,
+  .close = ivf_close,
+  .frame_at = ivf_frame_at,
+};
@@ -3,6 +3,10 @@
  * Date	 :	Oct 21th, 2020
  * Module:	Agora SD-RTN SDK RTC C API demo application.
  *
+ * JPEG and MJPEG (concatenated JPEG pictures). Pictures are found by
+ * walking the marker segments from SOI to EOI; the entropy coded data
+ * after SOS is skipped with a SIMD scan for the next marker. Frames
+ * point straight into the mapped file.
  *
  * This is a part of the Agora RTC Service SDK.
  * Copyright (C) 2020 Agora IO
@@ -10,84 +14,340 @@
  *
  *************************************************************/
 
-#include <stdio.h>
+#include <string.h>
 
 #include "file_parser.h"
 #include "file_parser_priv.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define FP_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#define JPEG_SOI 0xd8
+#define JPEG_EOI 0xd9
+#define JPEG_SOS 0xda
+#define JPEG_TEM 0x01
+
+// the picture is cut off by the end of the window
+#define JPEG_NEED_MORE 1
+
 typedef struct {
-  FILE *file;
-  size_t file_size;
+  uint64_t data_offset_;
+  fp_map_t map_;
+  // pictures handed out since the start, for the timestamps
+  uint64_t frames_;
 } ctx_t;
 
-extern long get_file_size(FILE *f);
+typedef const uint8_t *(*jpeg_scan_fn)(const uint8_t *p, const uint8_t *end);
 
-static int jpeg_open(media_parser_t *h, const char *path)
+static inline bool jpeg_is_rst(uint8_t m)
 {
-  FILE *file = NULL;
+  return (m & 0xf8) == 0xd0;
+}
 
-  file = fopen(path, "r");
+// The first 0xff in [p, end - 1) starting a marker, i.e. not followed by a
+// stuffed zero or a restart marker, which both belong to the entropy coded
+// data; end if there is none
+static const uint8_t *jpeg_find_marker_c(const uint8_t *p, const uint8_t *end)
+{
+  for (; end - p >= 2; p++) {
+    p = memchr(p, 0xff, end - 1 - p);
+    if (!p) {
+      break;
+    }
+    if (p[1] != 0 && !jpeg_is_rst(p[1])) {
+      return p;
+    }
+  }
+  return end;
+}
 
-  if (!file) {
-    AGO_LOGE("open %s failed", path);
-    return -1;
+#ifdef FP_HAVE_X86_SIMD
+__attribute__((target("sse2"))) static const uint8_t *jpeg_find_marker_sse2(const uint8_t *p, const uint8_t *end)
+{
+  const __m128i ff = _mm_set1_epi8((char)0xff);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i rst_mask = _mm_set1_epi8((char)0xf8);
+  const __m128i rst = _mm_set1_epi8((char)0xd0);
+
+  // each byte against 0xff and the byte after it against 00 and d0-d7
+  while (end - p >= 17) {
+    __m128i b0 = _mm_loadu_si128((const __m128i *)p);
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(b0, ff));
+    if (mask) {
+      __m128i b1 = _mm_loadu_si128((const __m128i *)(p + 1));
+      __m128i skip = _mm_or_si128(_mm_cmpeq_epi8(b1, zero), _mm_cmpeq_epi8(_mm_and_si128(b1, rst_mask), rst));
+      mask &= ~_mm_movemask_epi8(skip);
+      if (mask) {
+        return p + __builtin_ctz(mask);
+      }
+    }
+    p += 16;
   }
 
-  ctx_t *p_ctx = (ctx_t *)malloc(sizeof(ctx_t));
+  return jpeg_find_marker_c(p, end);
+}
+
+__attribute__((target("avx2"))) static const uint8_t *jpeg_find_marker_avx2(const uint8_t *p, const uint8_t *end)
+{
+  const __m256i ff = _mm256_set1_epi8((char)0xff);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i rst_mask = _mm256_set1_epi8((char)0xf8);
+  const __m256i rst = _mm256_set1_epi8((char)0xd0);
+
+  while (end - p >= 33) {
+    __m256i b0 = _mm256_loadu_si256((const __m256i *)p);
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b0, ff));
+    if (mask) {
+      __m256i b1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+      __m256i skip =
+        _mm256_or_si256(_mm256_cmpeq_epi8(b1, zero), _mm256_cmpeq_epi8(_mm256_and_si256(b1, rst_mask), rst));
+      mask &= ~(uint32_t)_mm256_movemask_epi8(skip);
+      if (mask) {
+        return p + __builtin_ctz(mask);
+      }
+    }
+    p += 32;
+  }
+
+  return jpeg_find_marker_sse2(p, end);
+}
+#endif
+
+static jpeg_scan_fn jpeg_scan_select(void)
+{
+#ifdef FP_HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return jpeg_find_marker_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return jpeg_find_marker_sse2;
+  }
+#endif
+  return jpeg_find_marker_c;
+}
+
+static const uint8_t *jpeg_find_marker_resolve(const uint8_t *p, const uint8_t *end);
+
+// Resolved on first use, like the start code scanner
+static jpeg_scan_fn gs_jpeg_find_marker = jpeg_find_marker_resolve;
+
+static const uint8_t *jpeg_find_marker_resolve(const uint8_t *p, const uint8_t *end)
+{
+  gs_jpeg_find_marker = jpeg_scan_select();
+  return gs_jpeg_find_marker(p, end);
+}
+
+// Offset of the next SOI in buf, -1 if there is none
+static int64_t jpeg_find_soi(const uint8_t *buf, uint64_t size)
+{
+  const uint8_t *p = buf, *end = buf + size;
+
+  while (end - p >= 2) {
+    p = memchr(p, 0xff, end - 1 - p);
+    if (!p) {
+      break;
+    }
+    if (p[1] == JPEG_SOI) {
+      return p - buf;
+    }
+    p++;
+  }
+  return -1;
+}
+
+// Walk the segments of the picture starting with the SOI at buf[start]. On
+// success *p_end is one past its EOI. APPn and other segments are skipped by
+// their length, so that markers inside them, e.g. in an Exif thumbnail,
+// aren't taken for the picture's own.
+static int jpeg_walk_picture(const uint8_t *buf, uint64_t size, uint64_t start, uint64_t *p_end)
+{
+  uint64_t pos = start + 2;
+
+  while (1) {
+    uint8_t m;
+
+    // fill bytes may pad any marker
+    while (pos + 1 < size && buf[pos] == 0xff && buf[pos + 1] == 0xff) {
+      pos++;
+    }
+    if (pos + 2 > size) {
+      return JPEG_NEED_MORE;
+    }
+    if (buf[pos] != 0xff) {
+      return -1;
+    }
+    m = buf[pos + 1];
+    if (m == JPEG_EOI) {
+      *p_end = pos + 2;
+      return 0;
+    }
+    if (m == JPEG_SOI || m == 0) {
+      return -1;
+    }
+    if (jpeg_is_rst(m) || m == JPEG_TEM) {
+      pos += 2;
+      continue;
+    }
+
+    if (pos + 4 > size) {
+      return JPEG_NEED_MORE;
+    }
+    if (((buf[pos + 2] << 8) | buf[pos + 3]) < 2) {
+      return -1;
+    }
+    pos += 2 + ((buf[pos + 2] << 8) | buf[pos + 3]);
+    if (m == JPEG_SOS) {
+      const uint8_t *next;
+      if (pos > size) {
+        return JPEG_NEED_MORE;
+      }
+      next = gs_jpeg_find_marker(buf + pos, buf + size);
+      if (next == buf + size) {
+        return JPEG_NEED_MORE;
+      }
+      pos = next - buf;
+    }
+  }
+}
+
+// Find the next picture in the window from data_offset_ on; offsets are
+// window relative. Damaged pictures are skipped.
+static int jpeg_parse_frame(ctx_t *p_ctx, uint64_t *p_start, uint64_t *p_end)
+{
+  const uint8_t *buf = p_ctx->map_.view;
+  uint64_t size = p_ctx->map_.view_len;
+  uint64_t pos = p_ctx->data_offset_ - p_ctx->map_.view_offset;
+  int ret;
+
+  while (1) {
+    int64_t soi = jpeg_find_soi(buf + pos, size - pos);
+    if (soi < 0) {
+      // a lone 0xff at the end may be the start of the next SOI
+      p_ctx->data_offset_ = p_ctx->map_.view_offset + (size > pos && buf[size - 1] == 0xff ? size - 1 : size);
+      return fp_map_view_at_eof(&p_ctx->map_) ? -2 : JPEG_NEED_MORE;
+    }
+    pos += soi;
+    p_ctx->data_offset_ = p_ctx->map_.view_offset + pos;
+
+    ret = jpeg_walk_picture(buf, size, pos, p_end);
+    if (ret == 0) {
+      *p_start = pos;
+      return 0;
+    }
+    if (ret == JPEG_NEED_MORE) {
+      // a picture cut off by the end of file is dropped
+      return fp_map_view_at_eof(&p_ctx->map_) ? -2 : JPEG_NEED_MORE;
+    }
+    AGO_LOGW("parser: damaged jpeg at %llu, looking for the next picture",
+             (unsigned long long)(p_ctx->map_.view_offset + pos));
+    pos += 2;
+  }
+}
+
+static int jpeg_open(media_parser_t *h, const char *path)
+{
+  ctx_t *p_ctx = (ctx_t *)calloc(1, sizeof(ctx_t));
   if (!p_ctx) {
     return -1;
   }
 
-  p_ctx->file = file;
-  p_ctx->file_size = get_file_size(file);
-  h->p_ctx = (void *)p_ctx;
+  if (fp_map_open(&p_ctx->map_, path, FP_MAP_WINDOW_SIZE) < 0) {
+    AGO_LOGE("open %s failed", path);
+    free(p_ctx);
+    return -1;
+  }
+  p_ctx->data_offset_ = 0;
+  p_ctx->frames_ = 0;
 
+  h->p_ctx = (void *)p_ctx;
   return 0;
 }
 
 static int jpeg_obtain_frame(media_parser_t *h, frame_t *p_frame)
 {
+  uint64_t start = 0, end = 0;
+  int rval;
+
   ctx_t *p_ctx = (ctx_t *)h->p_ctx;
   if (!p_ctx) {
     AGO_LOGE("parser: invalid ctx");
     return -1;
   }
 
-  if (feof(p_ctx->file)) {
-    return -2;
+  rval = fp_map_view(&p_ctx->map_, p_ctx->data_offset_, 0);
+  if (rval < 0) {
+    return rval;
   }
 
-  p_frame->ptr = malloc(p_ctx->file_size);
-  fseek(p_ctx->file, 0L, SEEK_SET);
-  fread(p_frame->ptr, 1, p_ctx->file_size, p_ctx->file);
+  // a picture that runs past the end of the window is looked at again from
+  // a window starting at it, grown until the whole picture fits
+  while ((rval = jpeg_parse_frame(p_ctx, &start, &end)) == JPEG_NEED_MORE) {
+    if (fp_map_grow(&p_ctx->map_, p_ctx->data_offset_) < 0) {
+      return -1;
+    }
+  }
+  if (rval < 0) {
+    return rval;
+  }
 
+  p_frame->ptr = p_ctx->map_.view + start;
   p_frame->type = h->type;
-  p_frame->len = p_ctx->file_size;
+  p_frame->len = (uint32_t)(end - start);
+  p_frame->offset = p_ctx->map_.view_offset + start;
+  p_frame->p_priv = fp_map_ref(&p_ctx->map_);
   p_frame->u.video.is_key_frame = 1;
+  p_frame->u.video.has_param_sets = false;
+  fp_frame_timing(p_frame, p_ctx->frames_++, 1, fp_cfg_fps(h));
+  p_ctx->data_offset_ = p_ctx->map_.view_offset + end;
 
   return 0;
 }
 
 static int jpeg_release_frame(media_parser_t *h, frame_t *p_frame)
 {
-  free(p_frame->ptr);
+  fp_map_unref((fp_map_window_t *)p_frame->p_priv);
+  p_frame->p_priv = NULL;
   return 0;
 }
 
-static int jpeg_reset(media_parser_t *h)
+static int jpeg_frame_at(media_parser_t *h, uint64_t offset, uint32_t len, frame_t *p_frame)
 {
   ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx || offset + len > p_ctx->map_.size || fp_map_view(&p_ctx->map_, offset, len) < 0) {
+    return -1;
+  }
+
+  p_frame->ptr = p_ctx->map_.view + (offset - p_ctx->map_.view_offset);
+  p_frame->offset = offset;
+  p_frame->len = len;
+  p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+  p_ctx->data_offset_ = offset + len;
+  return 0;
+}
 
-  fseek(p_ctx->file, 0L, SEEK_SET);
+static int jpeg_reset(media_parser_t *h)
+{
+  ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    return -1;
+  }
 
+  p_ctx->data_offset_ = 0;
+  p_ctx->frames_ = 0;
   return 0;
 }
 
 static int jpeg_close(media_parser_t *h)
 {
   ctx_t *p_ctx = (ctx_t *)h->p_ctx;
+  if (!p_ctx) {
+    return -1;
+  }
 
-  fclose(p_ctx->file);
+  fp_map_close(&p_ctx->map_);
 
   free(p_ctx);
   h->p_ctx = NULL;
@@ -105,4 +365,5 @@ media_parser_t video_parser_jpeg = {
   .release_frame = jpeg_release_frame,
   .reset = jpeg_reset,
   .close = jpeg_close,
+  .frame_at = jpeg_frame_at,
 };
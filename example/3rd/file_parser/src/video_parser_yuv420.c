@@ -3,6 +3,9 @@
  * Date	 :	Oct 21th, 2020
  * Module:	Agora SD-RTN SDK RTC C API demo application.
  *
+ * Raw planar YUV 4:2:0 (I420), sized by the configured width and height,
+ * or YUV4MPEG2 (y4m), which carries the size and frame rate in its
+ * header. Frames are handed out straight from the mapped file.
  *
  * This is a part of the Agora RTC Service SDK.
  * Copyright (C) 2020 Agora IO
@@ -10,64 +13,176 @@
  *
  *************************************************************/
 
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include <string.h>
 
 #include "file_parser.h"
 #include "file_parser_priv.h"
 
+#define Y4M_MAGIC "YUV4MPEG2 "
+#define Y4M_FRAME_MAGIC "FRAME"
+// longest stream or frame header line accepted
+#define Y4M_MAX_HEADER 256
+
 typedef struct {
-  int32_t data_offset_;
-  int32_t data_size_;
-  uint8_t *data_buffer_;
-  int fd_;
+  uint64_t data_offset_;
+  fp_map_t map_;
+  // first frame, past the y4m stream header
+  uint64_t data_start_;
+  int width_;
+  int height_;
+  // bytes of a picture, without the y4m frame header
+  uint64_t frame_size_;
+  bool y4m_;
+  // frame number of the next frame, for timestamps
+  uint64_t frame_no_;
+  uint32_t fps_num_;
+  uint32_t fps_den_;
 } ctx_t;
 
-int32_t yuv420_open(media_parser_t *h, const char *path)
+static inline int yuv420_chroma_size(int luma)
 {
-  int32_t rval = -1;
+  return (luma + 1) / 2;
+}
 
-  int32_t fd = -1;
-  do {
-    struct stat sb;
-    void *mapped;
+static bool y4m_is_8bit_420(const char *val, size_t len)
+{
+  static const char *const names[] = { "420", "420jpeg", "420paldv", "420mpeg2" };
+  size_t i;
 
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-      break;
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (len == strlen(names[i]) && memcmp(val, names[i], len) == 0) {
+      return true;
     }
+  }
+  return false;
+}
 
-    if ((fstat(fd, &sb)) == -1) {
+// "W640 H360 F30000:1001 Ip A1:1 C420jpeg"; unknown tags are skipped
+static int y4m_parse_header(ctx_t *p_ctx, const char *line, const char *end)
+{
+  const char *p = line + strlen(Y4M_MAGIC);
+
+  while (p < end) {
+    char tag = *p++;
+    const char *val = p;
+
+    while (p < end && *p != ' ') {
+      p++;
+    }
+    switch (tag) {
+    case 'W':
+      p_ctx->width_ = atoi(val);
+      break;
+    case 'H':
+      p_ctx->height_ = atoi(val);
+      break;
+    case 'F': {
+      const char *colon = memchr(val, ':', p - val);
+      p_ctx->fps_num_ = (uint32_t)strtoul(val, NULL, 10);
+      p_ctx->fps_den_ = colon ? (uint32_t)strtoul(colon + 1, NULL, 10) : 1;
       break;
     }
-
-    mapped = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mapped == (void *)-1) {
+    case 'C':
+      // 420jpeg, 420paldv, 420mpeg2 and 420 differ only in chroma siting;
+      // 420p10 and the like have 16-bit samples
+      if (!y4m_is_8bit_420(val, p - val)) {
+        AGO_LOGE("parser: y4m colorspace C%.*s isn't 8-bit 4:2:0", (int)(p - val), val);
+        return -1;
+      }
+      break;
+    default:
       break;
     }
+    while (p < end && *p == ' ') {
+      p++;
+    }
+  }
+  return 0;
+}
 
-    ctx_t *p_ctx = (ctx_t *)malloc(sizeof(ctx_t));
-    if (!p_ctx) {
-      break;
+// Length of the header line at offset without its newline; -1 if there is
+// none, -2 past the end of file
+static int y4m_line_len(ctx_t *p_ctx, uint64_t offset, const uint8_t **pp_line)
+{
+  const uint8_t *line, *nl;
+  uint64_t avail;
+  int ret;
+
+  ret = fp_map_view(&p_ctx->map_, offset, Y4M_MAX_HEADER);
+  if (ret < 0) {
+    return ret;
+  }
+  line = p_ctx->map_.view + (offset - p_ctx->map_.view_offset);
+  avail = p_ctx->map_.view_offset + p_ctx->map_.view_len - offset;
+  nl = memchr(line, '\n', avail < Y4M_MAX_HEADER ? avail : Y4M_MAX_HEADER);
+  if (!nl) {
+    return -1;
+  }
+  *pp_line = line;
+  return (int)(nl - line);
+}
+
+int32_t yuv420_open(media_parser_t *h, const char *path)
+{
+  const uint8_t *line;
+  uint64_t chroma;
+  int len;
+
+  ctx_t *p_ctx = (ctx_t *)calloc(1, sizeof(ctx_t));
+  if (!p_ctx) {
+    return -1;
+  }
+
+  if (fp_map_open(&p_ctx->map_, path, FP_MAP_WINDOW_SIZE) < 0) {
+    free(p_ctx);
+    return -1;
+  }
+
+  p_ctx->width_ = h->parser_cfg.u.video_cfg.width;
+  p_ctx->height_ = h->parser_cfg.u.video_cfg.height;
+  p_ctx->fps_num_ = fp_cfg_fps(h);
+  p_ctx->fps_den_ = 1;
+
+  len = y4m_line_len(p_ctx, 0, &line);
+  if (len >= (int)strlen(Y4M_MAGIC) && memcmp(line, Y4M_MAGIC, strlen(Y4M_MAGIC)) == 0) {
+    if (y4m_parse_header(p_ctx, (const char *)line, (const char *)line + len) < 0) {
+      goto fail;
+    }
+    p_ctx->y4m_ = true;
+    p_ctx->data_start_ = len + 1;
+    if (p_ctx->fps_num_ == 0 || p_ctx->fps_den_ == 0) {
+      p_ctx->fps_num_ = fp_cfg_fps(h);
+      p_ctx->fps_den_ = 1;
     }
-    p_ctx->data_size_ = sb.st_size;
-    p_ctx->data_buffer_ = (uint8_t *)mapped;
-    p_ctx->data_offset_ = 0;
-    p_ctx->fd_ = fd;
+  }
 
-    h->p_ctx = (void *)p_ctx;
-    rval = 0;
-  } while (0);
+  if (p_ctx->width_ <= 0 || p_ctx->height_ <= 0) {
+    AGO_LOGE("parser: raw yuv needs the picture size in video_cfg.width/height");
+    goto fail;
+  }
+  chroma = (uint64_t)yuv420_chroma_size(p_ctx->width_) * yuv420_chroma_size(p_ctx->height_);
+  p_ctx->frame_size_ = (uint64_t)p_ctx->width_ * p_ctx->height_ + 2 * chroma;
+  p_ctx->data_offset_ = p_ctx->data_start_;
 
-  return rval;
+  h->video_info.width = p_ctx->width_;
+  h->video_info.height = p_ctx->height_;
+  h->video_info.fps_num = p_ctx->fps_num_;
+  h->video_info.fps_den = p_ctx->fps_den_;
+
+  h->p_ctx = (void *)p_ctx;
+  return 0;
+
+fail:
+  fp_map_close(&p_ctx->map_);
+  free(p_ctx);
+  return -1;
 }
 
-#define LENGTH_PER_FRAME (16 * 1024)
 static int32_t yuv420_obtain_frame(media_parser_t *h, frame_t *p_frame)
 {
-  int32_t rval = -1;
+  uint64_t offset;
+  uint8_t *pic;
+  int32_t rval;
 
   ctx_t *p_ctx = (ctx_t *)h->p_ctx;
   if (!p_ctx) {
@@ -75,23 +190,62 @@ static int32_t yuv420_obtain_frame(media_parser_t *h, frame_t *p_frame)
     return -1;
   }
 
-  if (p_ctx->data_offset_ + LENGTH_PER_FRAME > p_ctx->data_size_) {
-    p_frame->ptr = p_ctx->data_buffer_ + p_ctx->data_offset_;
-    p_frame->len = p_ctx->data_size_ - p_ctx->data_offset_;
-    p_ctx->data_offset_ = p_ctx->data_size_;
+  offset = p_ctx->data_offset_;
+  if (offset >= p_ctx->map_.size) {
     return -2;
-  } else {
-    p_frame->ptr = p_ctx->data_buffer_ + p_ctx->data_offset_;
-    p_frame->len = LENGTH_PER_FRAME;
-    p_ctx->data_offset_ += LENGTH_PER_FRAME;
+  }
+  if (p_ctx->y4m_) {
+    const uint8_t *line;
+    int len = y4m_line_len(p_ctx, offset, &line);
+    if (len == -2) {
+      return -2;
+    }
+    if (len < (int)strlen(Y4M_FRAME_MAGIC) || memcmp(line, Y4M_FRAME_MAGIC, strlen(Y4M_FRAME_MAGIC)) != 0) {
+      // a truncated frame header at the end is taken as EOF
+      if (offset + Y4M_MAX_HEADER > p_ctx->map_.size) {
+        return -2;
+      }
+      AGO_LOGE("parser: no y4m FRAME header at %llu", (unsigned long long)offset);
+      return -1;
+    }
+    offset += len + 1;
   }
 
-  rval = 0;
-  return rval;
+  rval = fp_map_view(&p_ctx->map_, offset, p_ctx->frame_size_);
+  if (rval < 0) {
+    return rval;
+  }
+  // a partial picture at the end is dropped
+  if (offset + p_ctx->frame_size_ > p_ctx->map_.size) {
+    return -2;
+  }
+
+  pic = p_ctx->map_.view + (offset - p_ctx->map_.view_offset);
+  p_frame->ptr = pic;
+  p_frame->len = (uint32_t)p_ctx->frame_size_;
+  p_frame->offset = offset;
+  p_frame->p_priv = fp_map_ref(&p_ctx->map_);
+  p_frame->type = h->type;
+  p_frame->u.video.is_key_frame = true;
+  p_frame->u.video.has_param_sets = false;
+  p_frame->u.video.planes[0] = pic;
+  p_frame->u.video.planes[1] = pic + (uint64_t)p_ctx->width_ * p_ctx->height_;
+  p_frame->u.video.planes[2] = p_frame->u.video.planes[1] +
+                               (uint64_t)yuv420_chroma_size(p_ctx->width_) * yuv420_chroma_size(p_ctx->height_);
+  p_frame->u.video.strides[0] = p_ctx->width_;
+  p_frame->u.video.strides[1] = yuv420_chroma_size(p_ctx->width_);
+  p_frame->u.video.strides[2] = yuv420_chroma_size(p_ctx->width_);
+  fp_frame_timing(p_frame, p_ctx->frame_no_ * p_ctx->fps_den_, p_ctx->fps_den_, p_ctx->fps_num_);
+  p_ctx->frame_no_++;
+  p_ctx->data_offset_ = offset + p_ctx->frame_size_;
+
+  return 0;
 }
 
 static int yuv420_release_frame(media_parser_t *h, frame_t *p_frame)
 {
+  fp_map_unref((fp_map_window_t *)p_frame->p_priv);
+  p_frame->p_priv = NULL;
   return 0;
 }
 
@@ -104,7 +258,8 @@ static int32_t yuv420_reset(media_parser_t *h)
       break;
     }
 
-    p_ctx->data_offset_ = 0;
+    p_ctx->data_offset_ = p_ctx->data_start_;
+    p_ctx->frame_no_ = 0;
     rval = 0;
   } while (0);
 
@@ -120,15 +275,7 @@ static int32_t yuv420_close(media_parser_t *h)
       break;
     }
 
-    if (p_ctx->data_buffer_) {
-      munmap(p_ctx->data_buffer_, p_ctx->data_size_);
-      p_ctx->data_buffer_ = NULL;
-      p_ctx->data_size_ = 0;
-    }
-
-    if (p_ctx->fd_ > 0) {
-      close(p_ctx->fd_);
-    }
+    fp_map_close(&p_ctx->map_);
 
     free(p_ctx);
     h->p_ctx = NULL;
@@ -0,0 +1,463 @@
+#include "g711.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define G711_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// 16-bit input as in the ITU reference code: u-law clips the magnitude and
+// adds the bias before finding the segment, A-law works on the top 13 bits.
+#define ULAW_BIAS 0x84
+#define ULAW_CLIP 32635
+
+static const int16_t gs_seg_uend[8] = {0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF, 0x1FFF, 0x3FFF, 0x7FFF};
+static const int16_t gs_seg_aend[8] = {0x1F, 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF};
+
+// Segment of a magnitude by its bits above segment 0 (v >> 7 biased for
+// u-law, v >> 4 of the 13-bit value for A-law); both laws share it
+static const uint8_t gs_seg_lut[256] = {
+	0, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
+	4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+	5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+	5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+	6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+};
+
+// Linear value of every code
+static const int16_t gs_ulaw_to_linear[256] = {
+	-32124, -31100, -30076, -29052, -28028, -27004, -25980, -24956,
+	-23932, -22908, -21884, -20860, -19836, -18812, -17788, -16764,
+	-15996, -15484, -14972, -14460, -13948, -13436, -12924, -12412,
+	-11900, -11388, -10876, -10364, -9852, -9340, -8828, -8316,
+	-7932, -7676, -7420, -7164, -6908, -6652, -6396, -6140,
+	-5884, -5628, -5372, -5116, -4860, -4604, -4348, -4092,
+	-3900, -3772, -3644, -3516, -3388, -3260, -3132, -3004,
+	-2876, -2748, -2620, -2492, -2364, -2236, -2108, -1980,
+	-1884, -1820, -1756, -1692, -1628, -1564, -1500, -1436,
+	-1372, -1308, -1244, -1180, -1116, -1052, -988, -924,
+	-876, -844, -812, -780, -748, -716, -684, -652,
+	-620, -588, -556, -524, -492, -460, -428, -396,
+	-372, -356, -340, -324, -308, -292, -276, -260,
+	-244, -228, -212, -196, -180, -164, -148, -132,
+	-120, -112, -104, -96, -88, -80, -72, -64,
+	-56, -48, -40, -32, -24, -16, -8, 0,
+	32124, 31100, 30076, 29052, 28028, 27004, 25980, 24956,
+	23932, 22908, 21884, 20860, 19836, 18812, 17788, 16764,
+	15996, 15484, 14972, 14460, 13948, 13436, 12924, 12412,
+	11900, 11388, 10876, 10364, 9852, 9340, 8828, 8316,
+	7932, 7676, 7420, 7164, 6908, 6652, 6396, 6140,
+	5884, 5628, 5372, 5116, 4860, 4604, 4348, 4092,
+	3900, 3772, 3644, 3516, 3388, 3260, 3132, 3004,
+	2876, 2748, 2620, 2492, 2364, 2236, 2108, 1980,
+	1884, 1820, 1756, 1692, 1628, 1564, 1500, 1436,
+	1372, 1308, 1244, 1180, 1116, 1052, 988, 924,
+	876, 844, 812, 780, 748, 716, 684, 652,
+	620, 588, 556, 524, 492, 460, 428, 396,
+	372, 356, 340, 324, 308, 292, 276, 260,
+	244, 228, 212, 196, 180, 164, 148, 132,
+	120, 112, 104, 96, 88, 80, 72, 64,
+	56, 48, 40, 32, 24, 16, 8, 0,
+};
+
+static const int16_t gs_alaw_to_linear[256] = {
+	-5504, -5248, -6016, -5760, -4480, -4224, -4992, -4736,
+	-7552, -7296, -8064, -7808, -6528, -6272, -7040, -6784,
+	-2752, -2624, -3008, -2880, -2240, -2112, -2496, -2368,
+	-3776, -3648, -4032, -3904, -3264, -3136, -3520, -3392,
+	-22016, -20992, -24064, -23040, -17920, -16896, -19968, -18944,
+	-30208, -29184, -32256, -31232, -26112, -25088, -28160, -27136,
+	-11008, -10496, -12032, -11520, -8960, -8448, -9984, -9472,
+	-15104, -14592, -16128, -15616, -13056, -12544, -14080, -13568,
+	-344, -328, -376, -360, -280, -264, -312, -296,
+	-472, -456, -504, -488, -408, -392, -440, -424,
+	-88, -72, -120, -104, -24, -8, -56, -40,
+	-216, -200, -248, -232, -152, -136, -184, -168,
+	-1376, -1312, -1504, -1440, -1120, -1056, -1248, -1184,
+	-1888, -1824, -2016, -1952, -1632, -1568, -1760, -1696,
+	-688, -656, -752, -720, -560, -528, -624, -592,
+	-944, -912, -1008, -976, -816, -784, -880, -848,
+	5504, 5248, 6016, 5760, 4480, 4224, 4992, 4736,
+	7552, 7296, 8064, 7808, 6528, 6272, 7040, 6784,
+	2752, 2624, 3008, 2880, 2240, 2112, 2496, 2368,
+	3776, 3648, 4032, 3904, 3264, 3136, 3520, 3392,
+	22016, 20992, 24064, 23040, 17920, 16896, 19968, 18944,
+	30208, 29184, 32256, 31232, 26112, 25088, 28160, 27136,
+	11008, 10496, 12032, 11520, 8960, 8448, 9984, 9472,
+	15104, 14592, 16128, 15616, 13056, 12544, 14080, 13568,
+	344, 328, 376, 360, 280, 264, 312, 296,
+	472, 456, 504, 488, 408, 392, 440, 424,
+	88, 72, 120, 104, 24, 8, 56, 40,
+	216, 200, 248, 232, 152, 136, 184, 168,
+	1376, 1312, 1504, 1440, 1120, 1056, 1248, 1184,
+	1888, 1824, 2016, 1952, 1632, 1568, 1760, 1696,
+	688, 656, 752, 720, 560, 528, 624, 592,
+	944, 912, 1008, 976, 816, 784, 880, 848,
+};
+
+/*
+ * Reference: segment search and arithmetic decode
+ */
+
+static inline uint8_t ulaw_encode_ref(int16_t sample)
+{
+	int v = sample;
+	int sign = 0;
+	int seg;
+
+	if (v < 0) {
+		v = -v;
+		sign = 0x80;
+	}
+	if (v > ULAW_CLIP) {
+		v = ULAW_CLIP;
+	}
+	v += ULAW_BIAS;
+	for (seg = 0; seg < 8 && v > gs_seg_uend[seg]; seg++) {
+	}
+	return (uint8_t)~(sign | (seg << 4) | ((v >> (seg + 3)) & 0x0F));
+}
+
+static inline uint8_t alaw_encode_ref(int16_t sample)
+{
+	int v = sample >> 3;
+	int mask = 0xD5;
+	int seg;
+
+	if (v < 0) {
+		v = -v - 1;
+		mask = 0x55;
+	}
+	for (seg = 0; seg < 8 && v > gs_seg_aend[seg]; seg++) {
+	}
+	return (uint8_t)(((seg << 4) | ((v >> (seg < 2 ? 1 : seg)) & 0x0F)) ^ mask);
+}
+
+static inline int16_t ulaw_decode_ref(uint8_t code)
+{
+	int u = ~code & 0xFF;
+	int t = (((u & 0x0F) << 3) + ULAW_BIAS) << ((u & 0x70) >> 4);
+	return (int16_t)((u & 0x80) ? ULAW_BIAS - t : t - ULAW_BIAS);
+}
+
+static inline int16_t alaw_decode_ref(uint8_t code)
+{
+	int a = code ^ 0x55;
+	int seg = (a & 0x70) >> 4;
+	int t = (a & 0x0F) << 4;
+
+	if (seg == 0) {
+		t += 8;
+	} else {
+		t = (t + 0x108) << (seg - 1);
+	}
+	return (int16_t)((a & 0x80) ? t : -t);
+}
+
+static void g711_ulaw_encode_ref(const int16_t *pcm, uint8_t *out, size_t samples)
+{
+	size_t i;
+	for (i = 0; i < samples; i++) {
+		out[i] = ulaw_encode_ref(pcm[i]);
+	}
+}
+
+static void g711_alaw_encode_ref(const int16_t *pcm, uint8_t *out, size_t samples)
+{
+	size_t i;
+	for (i = 0; i < samples; i++) {
+		out[i] = alaw_encode_ref(pcm[i]);
+	}
+}
+
+static void g711_ulaw_decode_ref(const uint8_t *in, int16_t *pcm, size_t samples)
+{
+	size_t i;
+	for (i = 0; i < samples; i++) {
+		pcm[i] = ulaw_decode_ref(in[i]);
+	}
+}
+
+static void g711_alaw_decode_ref(const uint8_t *in, int16_t *pcm, size_t samples)
+{
+	size_t i;
+	for (i = 0; i < samples; i++) {
+		pcm[i] = alaw_decode_ref(in[i]);
+	}
+}
+
+/*
+ * Table driven: one lookup for the segment, one per decoded sample
+ */
+
+static void g711_ulaw_encode_table(const int16_t *pcm, uint8_t *out, size_t samples)
+{
+	size_t i;
+	for (i = 0; i < samples; i++) {
+		int v = pcm[i];
+		int sign = (v >> 8) & 0x80;
+		int seg;
+
+		if (sign) {
+			v = -v;
+		}
+		if (v > ULAW_CLIP) {
+			v = ULAW_CLIP;
+		}
+		v += ULAW_BIAS;
+		seg = gs_seg_lut[v >> 7];
+		out[i] = (uint8_t)~(sign | (seg << 4) | ((v >> (seg + 3)) & 0x0F));
+	}
+}
+
+static void g711_alaw_encode_table(const int16_t *pcm, uint8_t *out, size_t samples)
+{
+	size_t i;
+	for (i = 0; i < samples; i++) {
+		int v = pcm[i] >> 3;
+		int mask = 0xD5;
+		int seg;
+
+		if (v < 0) {
+			v = ~v;
+			mask = 0x55;
+		}
+		seg = gs_seg_lut[v >> 4];
+		out[i] = (uint8_t)(((seg << 4) | ((v >> (seg ? seg : 1)) & 0x0F)) ^ mask);
+	}
+}
+
+static void g711_ulaw_decode_table(const uint8_t *in, int16_t *pcm, size_t samples)
+{
+	size_t i;
+	for (i = 0; i < samples; i++) {
+		pcm[i] = gs_ulaw_to_linear[in[i]];
+	}
+}
+
+static void g711_alaw_decode_table(const uint8_t *in, int16_t *pcm, size_t samples)
+{
+	size_t i;
+	for (i = 0; i < samples; i++) {
+		pcm[i] = gs_alaw_to_linear[in[i]];
+	}
+}
+
+#ifdef G711_HAVE_X86_SIMD
+/*
+ * SIMD: a magnitude below 2^24 converts to float exactly, and its exponent
+ * with the top four mantissa bits is the segment and the step within it
+ * (float bits >> 19). Decoding scales the step by the segment's power of
+ * two, looked up with pshufb.
+ */
+
+// magnitude (as float) -> segment << 4 | step, for segment 0 starting at 2^first
+__attribute__((target("sse2"))) static inline __m128i g711_seg_step_sse2(__m128 mag, int first)
+{
+	__m128i bits = _mm_srli_epi32(_mm_castps_si128(mag), 19);
+	return _mm_sub_epi32(bits, _mm_set1_epi32((127 + first) << 4));
+}
+
+__attribute__((target("sse2"))) static inline __m128i g711_ulaw_encode8_sse2(__m128i x)
+{
+	const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	const __m128 clip = _mm_set1_ps((float)ULAW_CLIP);
+	const __m128 bias = _mm_set1_ps((float)ULAW_BIAS);
+	__m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+	__m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+	__m128i code, sign;
+
+	// |-32768| is fine in float and clipped like the rest
+	lo = _mm_add_ps(_mm_min_ps(_mm_and_ps(lo, abs_mask), clip), bias);
+	hi = _mm_add_ps(_mm_min_ps(_mm_and_ps(hi, abs_mask), clip), bias);
+	code = _mm_packs_epi32(g711_seg_step_sse2(lo, 7), g711_seg_step_sse2(hi, 7));
+	sign = _mm_and_si128(_mm_srai_epi16(x, 15), _mm_set1_epi16(0x80));
+	return _mm_xor_si128(_mm_or_si128(code, sign), _mm_set1_epi16(0xFF));
+}
+
+__attribute__((target("sse2"))) static inline __m128i g711_alaw_encode8_sse2(__m128i x)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i neg = _mm_srai_epi16(x, 15);
+	// ones' complement of the 13-bit value for negative samples
+	__m128i v = _mm_xor_si128(_mm_srai_epi16(x, 3), neg);
+	__m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+	__m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero));
+	__m128i code = _mm_packs_epi32(g711_seg_step_sse2(lo, 4), g711_seg_step_sse2(hi, 4));
+	// segment 0 is linear with the same step as segment 1
+	__m128i small = _mm_cmplt_epi16(v, _mm_set1_epi16(32));
+	__m128i mask = _mm_or_si128(_mm_set1_epi16(0x55), _mm_andnot_si128(neg, _mm_set1_epi16(0x80)));
+
+	code = _mm_or_si128(_mm_andnot_si128(small, code), _mm_and_si128(small, _mm_srli_epi16(v, 1)));
+	return _mm_xor_si128(code, mask);
+}
+
+__attribute__((target("sse2"))) static void g711_ulaw_encode_sse2(const int16_t *pcm, uint8_t *out, size_t samples)
+{
+	size_t i = 0;
+	for (; i + 16 <= samples; i += 16) {
+		__m128i a = g711_ulaw_encode8_sse2(_mm_loadu_si128((const __m128i *)(pcm + i)));
+		__m128i b = g711_ulaw_encode8_sse2(_mm_loadu_si128((const __m128i *)(pcm + i + 8)));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(a, b));
+	}
+	g711_ulaw_encode_table(pcm + i, out + i, samples - i);
+}
+
+__attribute__((target("sse2"))) static void g711_alaw_encode_sse2(const int16_t *pcm, uint8_t *out, size_t samples)
+{
+	size_t i = 0;
+	for (; i + 16 <= samples; i += 16) {
+		__m128i a = g711_alaw_encode8_sse2(_mm_loadu_si128((const __m128i *)(pcm + i)));
+		__m128i b = g711_alaw_encode8_sse2(_mm_loadu_si128((const __m128i *)(pcm + i + 8)));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(a, b));
+	}
+	g711_alaw_encode_table(pcm + i, out + i, samples - i);
+}
+
+// 16 codes in bytes: the step's base value (low, high byte), the power of
+// two of its segment and the samples to negate; a sample is
+// +-(base * power - offset)
+__attribute__((target("ssse3"))) static inline void g711_scale16_ssse3(__m128i base_lo, __m128i base_hi, __m128i pow,
+								       __m128i neg, int16_t offset, int16_t *out)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i off = _mm_set1_epi16(offset);
+	__m128i a = _mm_mullo_epi16(_mm_unpacklo_epi8(base_lo, base_hi), _mm_unpacklo_epi8(pow, zero));
+	__m128i b = _mm_mullo_epi16(_mm_unpackhi_epi8(base_lo, base_hi), _mm_unpackhi_epi8(pow, zero));
+	__m128i na = _mm_unpacklo_epi8(neg, neg);
+	__m128i nb = _mm_unpackhi_epi8(neg, neg);
+
+	a = _mm_sub_epi16(a, off);
+	b = _mm_sub_epi16(b, off);
+	_mm_storeu_si128((__m128i *)out, _mm_sub_epi16(_mm_xor_si128(a, na), na));
+	_mm_storeu_si128((__m128i *)(out + 8), _mm_sub_epi16(_mm_xor_si128(b, nb), nb));
+}
+
+__attribute__((target("ssse3"))) static void g711_ulaw_decode_ssse3(const uint8_t *in, int16_t *pcm, size_t samples)
+{
+	const __m128i pow_lut = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	// (step * 8 + bias) << segment, less the bias
+	for (; i + 16 <= samples; i += 16) {
+		__m128i u = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)), _mm_set1_epi8((char)0xFF));
+		__m128i seg = _mm_and_si128(_mm_srli_epi16(u, 4), _mm_set1_epi8(0x07));
+		__m128i base = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(u, _mm_set1_epi8(0x0F)), 3),
+					    _mm_set1_epi8((char)ULAW_BIAS));
+
+		g711_scale16_ssse3(base, zero, _mm_shuffle_epi8(pow_lut, seg), _mm_cmplt_epi8(u, zero), ULAW_BIAS,
+				   pcm + i);
+	}
+	g711_ulaw_decode_table(in + i, pcm + i, samples - i);
+}
+
+__attribute__((target("ssse3"))) static void g711_alaw_decode_ssse3(const uint8_t *in, int16_t *pcm, size_t samples)
+{
+	// segment 0: step * 16 + 8; segment s: (step * 16 + 0x108) << (s - 1)
+	const __m128i pow_lut = _mm_setr_epi8(1, 1, 2, 4, 8, 16, 32, 64, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i hi_lut = _mm_setr_epi8(0, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0);
+	size_t i = 0;
+
+	for (; i + 16 <= samples; i += 16) {
+		__m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)), _mm_set1_epi8(0x55));
+		__m128i seg = _mm_and_si128(_mm_srli_epi16(a, 4), _mm_set1_epi8(0x07));
+		__m128i base = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(a, 4), _mm_set1_epi8((char)0xF0)),
+					    _mm_set1_epi8(0x08));
+
+		// A-law sets the sign bit for positive samples
+		g711_scale16_ssse3(base, _mm_shuffle_epi8(hi_lut, seg), _mm_shuffle_epi8(pow_lut, seg),
+				   _mm_cmpgt_epi8(a, _mm_set1_epi8(-1)), 0, pcm + i);
+	}
+	g711_alaw_decode_table(in + i, pcm + i, samples - i);
+}
+#endif
+
+static const g711_impl_t gs_g711_impls[] = {
+#ifdef G711_HAVE_X86_SIMD
+	{ "ssse3", g711_ulaw_encode_sse2, g711_alaw_encode_sse2, g711_ulaw_decode_ssse3, g711_alaw_decode_ssse3 },
+#endif
+	{ "table", g711_ulaw_encode_table, g711_alaw_encode_table, g711_ulaw_decode_table, g711_alaw_decode_table },
+	{ "c", g711_ulaw_encode_ref, g711_alaw_encode_ref, g711_ulaw_decode_ref, g711_alaw_decode_ref },
+};
+static const int gs_g711_impl_cnt = sizeof(gs_g711_impls) / sizeof(gs_g711_impls[0]);
+
+static int g711_impl_supported(const g711_impl_t *impl)
+{
+#ifdef G711_HAVE_X86_SIMD
+	if (impl->ulaw_decode == g711_ulaw_decode_ssse3) {
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("ssse3");
+	}
+#endif
+	return 1;
+}
+
+static const g711_impl_t *g711_select(void)
+{
+	int i;
+	for (i = 0; i < gs_g711_impl_cnt; i++) {
+		if (g711_impl_supported(&gs_g711_impls[i])) {
+			break;
+		}
+	}
+	return &gs_g711_impls[i < gs_g711_impl_cnt ? i : gs_g711_impl_cnt - 1];
+}
+
+// Resolved on first use; every thread resolves to the same implementation,
+// so the unsynchronized store is harmless.
+static const g711_impl_t *gs_g711_impl = NULL;
+
+static const g711_impl_t *g711_impl(void)
+{
+	if (!gs_g711_impl) {
+		gs_g711_impl = g711_select();
+	}
+	return gs_g711_impl;
+}
+
+void g711_ulaw_encode(const int16_t *pcm, uint8_t *out, size_t samples)
+{
+	g711_impl()->ulaw_encode(pcm, out, samples);
+}
+
+void g711_alaw_encode(const int16_t *pcm, uint8_t *out, size_t samples)
+{
+	g711_impl()->alaw_encode(pcm, out, samples);
+}
+
+void g711_ulaw_decode(const uint8_t *in, int16_t *pcm, size_t samples)
+{
+	g711_impl()->ulaw_decode(in, pcm, samples);
+}
+
+void g711_alaw_decode(const uint8_t *in, int16_t *pcm, size_t samples)
+{
+	g711_impl()->alaw_decode(in, pcm, samples);
+}
+
+const char *g711_impl_name(void)
+{
+	return g711_impl()->name;
+}
+
+int g711_impls(const g711_impl_t **impls, int max)
+{
+	int i, n = 0;
+	for (i = 0; i < gs_g711_impl_cnt && n < max; i++) {
+		if (g711_impl_supported(&gs_g711_impls[i])) {
+			impls[n++] = &gs_g711_impls[i];
+		}
+	}
+	return n;
+}
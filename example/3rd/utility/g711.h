@@ -0,0 +1,27 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// G.711 companding between 16-bit linear PCM and one byte per sample,
+// u-law (PCMU) or A-law (PCMA). The plain calls use the fastest
+// implementation this CPU has; they all give the same bytes and samples.
+void g711_ulaw_encode(const int16_t *pcm, uint8_t *out, size_t samples);
+void g711_alaw_encode(const int16_t *pcm, uint8_t *out, size_t samples);
+void g711_ulaw_decode(const uint8_t *in, int16_t *pcm, size_t samples);
+void g711_alaw_decode(const uint8_t *in, int16_t *pcm, size_t samples);
+
+typedef void (*g711_encode_fn)(const int16_t *pcm, uint8_t *out, size_t samples);
+typedef void (*g711_decode_fn)(const uint8_t *in, int16_t *pcm, size_t samples);
+
+typedef struct {
+	const char *name;
+	g711_encode_fn ulaw_encode;
+	g711_encode_fn alaw_encode;
+	g711_decode_fn ulaw_decode;
+	g711_decode_fn alaw_decode;
+} g711_impl_t;
+
+// Name of the implementation the plain calls use
+const char *g711_impl_name(void);
+// Fill impls with the implementations usable on this CPU, best first; the
+// last one is the segment search reference
+int g711_impls(const g711_impl_t **impls, int max);
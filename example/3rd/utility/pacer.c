@@ -79,6 +79,34 @@ bool is_time_to_send_video(void *pacer)
 	return false;
 }
 
+void pacer_set_audio_interval(void *pacer, uint32_t audio_send_interval_us)
+{
+	if (pacer == NULL || audio_send_interval_us == 0) {
+		return;
+	}
+
+	pacer_t *pc = pacer;
+	// the deadline was already moved on by the old interval
+	if (pc->audio_predict_time_us != 0) {
+		pc->audio_predict_time_us += (int64_t)audio_send_interval_us - pc->audio_send_interval_us;
+	}
+	pc->audio_send_interval_us = audio_send_interval_us;
+}
+
+void pacer_set_video_interval(void *pacer, uint32_t video_send_interval_us)
+{
+	if (pacer == NULL || video_send_interval_us == 0) {
+		return;
+	}
+
+	pacer_t *pc = pacer;
+	// the deadline was already moved on by the old interval
+	if (pc->video_predict_time_us != 0) {
+		pc->video_predict_time_us += (int64_t)video_send_interval_us - pc->video_send_interval_us;
+	}
+	pc->video_send_interval_us = video_send_interval_us;
+}
+
 void wait_before_next_send(void *pacer)
 {
 	// 添加空指针检查防止crash
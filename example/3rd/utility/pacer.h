@@ -5,4 +5,8 @@ void *pacer_create(uint32_t audio_send_interval_us, uint32_t video_send_interval
 void pacer_destroy(void *pacer);
 bool is_time_to_send_audio(void *pacer);
 bool is_time_to_send_video(void *pacer);
-void wait_before_next_send(void *pacer);
\ No newline at end of file
+void wait_before_next_send(void *pacer);
+// Change the interval of the frame just let through, e.g. to the duration
+// the parser reported for it; later frames keep the new interval.
+void pacer_set_audio_interval(void *pacer, uint32_t audio_send_interval_us);
+void pacer_set_video_interval(void *pacer, uint32_t video_send_interval_us);
\ No newline at end of file
@@ -0,0 +1,362 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "resampler.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RS_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Taps of the filter at unit ratio; downsampling stretches it by the ratio
+// to keep the same transition band relative to the output rate.
+#define RS_BASE_TAPS 64
+// Blackman window: transition band of about 5.5 / taps cycles per sample
+#define RS_TRANSITION (5.5 / RS_BASE_TAPS)
+// Taps are padded to the widest vector, 16 int16
+#define RS_TAP_ALIGN 16
+#define RS_COEF_BITS 15
+
+typedef int32_t (*rs_dot_fn)(const int16_t *coef, const int16_t *x, int taps);
+
+typedef struct {
+	int in_channels;
+	int out_channels;
+	// channels that go through the filter: 1 when mono is upmixed
+	int work_channels;
+	int max_in_frames;
+	// out_rate / in_rate as up / down, reduced
+	int up;
+	int down;
+	// 0 when the rates match and only the channels change
+	int taps;
+	// up phases of taps coefficients, Q15
+	int16_t *bank;
+	rs_dot_fn dot;
+
+	// input of each work channel, buf_cap samples apart: the tail of the
+	// last call followed by the new frames
+	int16_t *buf;
+	int buf_cap;
+	int buf_len;
+	// first sample and phase of the next output's window
+	int pos;
+	int phase;
+} resampler_t;
+
+static int rs_gcd(int a, int b)
+{
+	while (b) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+ * Filter: windowed sinc, one phase per output position between two input
+ * samples. Coefficient k of phase p weighs input sample i0 + k for an output
+ * at i0 + taps / 2 - 1 + p / up.
+ */
+
+static double rs_kernel(double d, double fc, int taps)
+{
+	double half = taps / 2.0;
+	double x = 2.0 * fc * d;
+	double sinc = fabs(x) < 1e-9 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+	double w;
+
+	if (fabs(d) >= half) {
+		return 0.0;
+	}
+	w = 0.42 + 0.5 * cos(M_PI * d / half) + 0.08 * cos(2.0 * M_PI * d / half);
+	return 2.0 * fc * sinc * w;
+}
+
+static int rs_build_bank(resampler_t *rs)
+{
+	double ratio = rs->up < rs->down ? (double)rs->up / rs->down : 1.0;
+	// the cutoff leaves half the transition band below the output Nyquist
+	double fc = ratio * (0.5 - RS_TRANSITION / 2);
+	double *h;
+	int p, k;
+
+	rs->bank = (int16_t *)calloc((size_t)rs->up * rs->taps, sizeof(int16_t));
+	h = (double *)malloc(rs->taps * sizeof(double));
+	if (!rs->bank || !h) {
+		free(h);
+		return -1;
+	}
+
+	for (p = 0; p < rs->up; p++) {
+		int16_t *coef = rs->bank + (size_t)p * rs->taps;
+		double sum = 0;
+		int32_t qsum = 0;
+		int peak = 0;
+
+		for (k = 0; k < rs->taps; k++) {
+			h[k] = rs_kernel(rs->taps / 2 - 1 + (double)p / rs->up - k, fc, rs->taps);
+			sum += h[k];
+		}
+		// unity gain at DC for every phase, exact after rounding: the
+		// rounding error goes to the largest tap
+		for (k = 0; k < rs->taps; k++) {
+			coef[k] = (int16_t)lrint(h[k] / sum * (1 << RS_COEF_BITS));
+			qsum += coef[k];
+			if (abs(coef[k]) > abs(coef[peak])) {
+				peak = k;
+			}
+		}
+		coef[peak] += (1 << RS_COEF_BITS) - qsum;
+	}
+	free(h);
+	return 0;
+}
+
+static int32_t rs_dot_c(const int16_t *coef, const int16_t *x, int taps)
+{
+	int32_t acc = 0;
+	int k;
+	for (k = 0; k < taps; k++) {
+		acc += coef[k] * x[k];
+	}
+	return acc;
+}
+
+#ifdef RS_HAVE_X86_SIMD
+// pmaddwd cannot overflow: no coefficient reaches -32768
+__attribute__((target("sse2"))) static int32_t rs_dot_sse2(const int16_t *coef, const int16_t *x, int taps)
+{
+	__m128i acc = _mm_setzero_si128();
+	int k;
+
+	for (k = 0; k < taps; k += 8) {
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(coef + k)),
+							_mm_loadu_si128((const __m128i *)(x + k))));
+	}
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(acc);
+}
+
+__attribute__((target("avx2"))) static int32_t rs_dot_avx2(const int16_t *coef, const int16_t *x, int taps)
+{
+	__m256i acc = _mm256_setzero_si256();
+	__m128i sum;
+	int k;
+
+	for (k = 0; k < taps; k += 16) {
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)(coef + k)),
+							      _mm256_loadu_si256((const __m256i *)(x + k))));
+	}
+	sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(sum);
+}
+
+// Stereo to mono by the average, rounded down like the scalar path
+__attribute__((target("sse2"))) static int rs_downmix_stereo_sse2(const int16_t *in, int frames, int16_t *out)
+{
+	const __m128i ones = _mm_set1_epi16(1);
+	int i = 0;
+
+	for (; i + 8 <= frames; i += 8) {
+		__m128i a = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(in + 2 * i)), ones);
+		__m128i b = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(in + 2 * i + 8)), ones);
+		_mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(_mm_srai_epi32(a, 1), _mm_srai_epi32(b, 1)));
+	}
+	return i;
+}
+#endif
+
+static const char *rs_select(rs_dot_fn *dot)
+{
+#ifdef RS_HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		*dot = rs_dot_avx2;
+		return "avx2";
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		*dot = rs_dot_sse2;
+		return "sse2";
+	}
+#endif
+	*dot = rs_dot_c;
+	return "c";
+}
+
+const char *resampler_impl_name(void)
+{
+	rs_dot_fn dot;
+	return rs_select(&dot);
+}
+
+void resampler_reset(void *resampler)
+{
+	resampler_t *rs = resampler;
+	if (rs == NULL) {
+		return;
+	}
+	// taps - 1 samples of silence lead in the first window
+	rs->buf_len = rs->taps ? rs->taps - 1 : 0;
+	memset(rs->buf, 0, (size_t)rs->work_channels * rs->buf_cap * sizeof(int16_t));
+	rs->pos = 0;
+	rs->phase = 0;
+}
+
+void *resampler_create(int in_rate, int in_channels, int out_rate, int out_channels, int max_in_frames)
+{
+	resampler_t *rs;
+	int g;
+
+	if (in_rate <= 0 || out_rate <= 0 || in_channels <= 0 || out_channels <= 0 || max_in_frames <= 0) {
+		return NULL;
+	}
+	rs = (resampler_t *)calloc(1, sizeof(resampler_t));
+	if (rs == NULL) {
+		return NULL;
+	}
+
+	g = rs_gcd(in_rate, out_rate);
+	rs->up = out_rate / g;
+	rs->down = in_rate / g;
+	rs->in_channels = in_channels;
+	rs->out_channels = out_channels;
+	rs->work_channels = in_channels == 1 ? 1 : out_channels;
+	rs->max_in_frames = max_in_frames;
+	rs_select(&rs->dot);
+
+	if (rs->up != rs->down) {
+		int taps = RS_BASE_TAPS;
+		if (rs->down > rs->up) {
+			taps = (int)(((int64_t)RS_BASE_TAPS * rs->down + rs->up - 1) / rs->up);
+		}
+		rs->taps = (taps + RS_TAP_ALIGN - 1) / RS_TAP_ALIGN * RS_TAP_ALIGN;
+		if (rs_build_bank(rs) < 0) {
+			resampler_destroy(rs);
+			return NULL;
+		}
+	}
+
+	rs->buf_cap = rs->taps + max_in_frames;
+	rs->buf = (int16_t *)malloc((size_t)rs->work_channels * rs->buf_cap * sizeof(int16_t));
+	if (rs->buf == NULL) {
+		resampler_destroy(rs);
+		return NULL;
+	}
+	resampler_reset(rs);
+	return rs;
+}
+
+void resampler_destroy(void *resampler)
+{
+	resampler_t *rs = resampler;
+	if (rs) {
+		free(rs->bank);
+		free(rs->buf);
+		free(rs);
+	}
+}
+
+int resampler_max_out_frames(void *resampler)
+{
+	resampler_t *rs = resampler;
+	if (rs == NULL) {
+		return 0;
+	}
+	return (int)(((int64_t)rs->max_in_frames * rs->up + rs->down - 1) / rs->down) + 1;
+}
+
+// Append the input, remixed, to the work channel buffers
+static void rs_remix(resampler_t *rs, const int16_t *in, int frames)
+{
+	int16_t *dst = rs->buf + rs->buf_len;
+	int ic = rs->in_channels;
+	int c, i = 0;
+
+	if (rs->work_channels == 1 && ic == 1) {
+		memcpy(dst, in, frames * sizeof(int16_t));
+		return;
+	}
+	if (rs->work_channels == 1) {
+#ifdef RS_HAVE_X86_SIMD
+		if (ic == 2) {
+			i = rs_downmix_stereo_sse2(in, frames, dst);
+		}
+#endif
+		for (; i < frames; i++) {
+			int32_t sum = 0;
+			for (c = 0; c < ic; c++) {
+				sum += in[i * ic + c];
+			}
+			// >> rounds down, as the SIMD path does
+			dst[i] = (int16_t)(ic == 2 ? sum >> 1 : sum / ic);
+		}
+		return;
+	}
+	for (c = 0; c < rs->work_channels; c++) {
+		int16_t *d = dst + (size_t)c * rs->buf_cap;
+		const int16_t *s = in + c % ic;
+		for (i = 0; i < frames; i++) {
+			d[i] = s[i * ic];
+		}
+	}
+}
+
+static inline int16_t rs_round(int32_t acc)
+{
+	acc = (acc + (1 << (RS_COEF_BITS - 1))) >> RS_COEF_BITS;
+	return (int16_t)(acc > 32767 ? 32767 : acc < -32768 ? -32768 : acc);
+}
+
+int resampler_process(void *resampler, const int16_t *in, int in_frames, int16_t *out)
+{
+	resampler_t *rs = resampler;
+	int oc, wc, n = 0;
+	int c, k;
+
+	if (rs == NULL || in_frames < 0 || in_frames > rs->max_in_frames || (in_frames && (!in || !out))) {
+		return -1;
+	}
+	oc = rs->out_channels;
+	wc = rs->work_channels;
+	rs_remix(rs, in, in_frames);
+	rs->buf_len += in_frames;
+
+	if (rs->taps == 0) {
+		for (n = 0; n < rs->buf_len; n++) {
+			for (c = 0; c < oc; c++) {
+				out[n * oc + c] = rs->buf[(size_t)(wc == 1 ? 0 : c) * rs->buf_cap + n];
+			}
+		}
+		rs->buf_len = 0;
+		return n;
+	}
+
+	while (rs->pos + rs->taps <= rs->buf_len) {
+		const int16_t *coef = rs->bank + (size_t)rs->phase * rs->taps;
+		for (c = 0; c < wc; c++) {
+			out[n * oc + c] = rs_round(rs->dot(coef, rs->buf + (size_t)c * rs->buf_cap + rs->pos, rs->taps));
+		}
+		for (c = wc; c < oc; c++) {
+			out[n * oc + c] = out[n * oc];
+		}
+		n++;
+		rs->phase += rs->down;
+		rs->pos += rs->phase / rs->up;
+		rs->phase %= rs->up;
+	}
+
+	// keep what the next windows still need, less than taps samples
+	k = rs->pos < rs->buf_len ? rs->buf_len - rs->pos : 0;
+	for (c = 0; c < wc; c++) {
+		int16_t *b = rs->buf + (size_t)c * rs->buf_cap;
+		memmove(b, b + rs->pos, k * sizeof(int16_t));
+	}
+	rs->pos = rs->pos > rs->buf_len ? rs->pos - rs->buf_len : 0;
+	rs->buf_len = k;
+	return n;
+}
@@ -0,0 +1,24 @@
+#include <stdint.h>
+
+// Streaming conversion of interleaved 16-bit PCM to another sample rate and
+// channel count: remixed first, then a polyphase windowed-sinc resampler
+// whose filter banks are built at create time. All buffers are allocated
+// by resampler_create; processing allocates nothing.
+//
+// Several channels mix down to mono by their average and mono is copied to
+// every output channel; otherwise output channel c takes input channel
+// c % in_channels. The filter delays the output by half its length, which
+// keeps every call putting out in_frames * out_rate / in_rate frames (give
+// or take one) instead of a short first one.
+void *resampler_create(int in_rate, int in_channels, int out_rate, int out_channels, int max_in_frames);
+void resampler_destroy(void *resampler);
+// Frames one call can put out at most; size the output buffer for this
+// times out_channels
+int resampler_max_out_frames(void *resampler);
+// Convert in_frames (at most max_in_frames) into out; returns the frames
+// written, or -1 on bad arguments
+int resampler_process(void *resampler, const int16_t *in, int in_frames, int16_t *out);
+// Drop the buffered input, e.g. when the source loops
+void resampler_reset(void *resampler);
+// Name of the filter implementation in use
+const char *resampler_impl_name(void);
@@ -0,0 +1,234 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * Benchmark for length prefixed (AVCC/HVCC) output of the H264/H265
+ * parsers: the parser's zero-copy iov against a naive rewrite that
+ * rescans every Annex-B frame and copies it into a new buffer.
+ * Usage: bench_avcc [sample_dir]
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "file_parser_priv.h"
+
+#define MIN_RUN_NS (500 * 1000 * 1000LL)
+
+typedef struct {
+  int codec;
+  const char *file;
+} sample_t;
+
+static const sample_t gs_samples[] = {
+  { MEDIA_FILE_TYPE_H264, "send_video.h264.old" },
+  { MEDIA_FILE_TYPE_H265, "send_video.h265" },
+};
+
+typedef struct {
+  int64_t frames;
+  int64_t bytes;
+  int64_t ns;
+} result_t;
+
+// results; stdout gets the parsers' log lines
+static FILE *gs_out;
+static uint8_t *gs_buf;
+static uint32_t gs_buf_size;
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int out_reserve(uint32_t size)
+{
+  if (size > gs_buf_size) {
+    uint8_t *buf = (uint8_t *)realloc(gs_buf, size);
+    if (!buf) {
+      return -1;
+    }
+    gs_buf = buf;
+    gs_buf_size = size;
+  }
+  return 0;
+}
+
+// Rescan the Annex-B frame and copy every nal behind a length header
+static uint32_t naive_rewrite(const uint8_t *buf, uint32_t size)
+{
+  uint32_t pos = 0, len = 0;
+
+  // a 3-byte start code grows into a 4-byte length
+  if (out_reserve(size + size / 3 + 4) < 0) {
+    return 0;
+  }
+  while (pos < size) {
+    int nal_start, hdr_start, nal_end;
+    int found = fp_find_nal_unit(buf + pos, size - pos, &nal_start, &hdr_start, &nal_end);
+    if (found == 0) {
+      break;
+    }
+    uint32_t nal_len = nal_end - hdr_start + 1;
+    gs_buf[len] = (uint8_t)(nal_len >> 24);
+    gs_buf[len + 1] = (uint8_t)(nal_len >> 16);
+    gs_buf[len + 2] = (uint8_t)(nal_len >> 8);
+    gs_buf[len + 3] = (uint8_t)nal_len;
+    memcpy(gs_buf + len + 4, buf + pos + hdr_start, nal_len);
+    len += 4 + nal_len;
+    if (found < 0) {
+      break;
+    }
+    pos += nal_end + 1;
+  }
+  return len;
+}
+
+static uint32_t iov_len(const frame_ext_t *ext)
+{
+  uint32_t len = 0;
+  int i;
+  for (i = 0; i < ext->iov_cnt; i++) {
+    len += ext->iov[i].len;
+  }
+  return len;
+}
+
+static void *open_parser(const sample_t *sample, const char *path, bool length_prefixed)
+{
+  parser_cfg_t cfg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.u.video_cfg.length_prefixed = length_prefixed;
+  return create_file_parser(sample->codec, (char *)path, &cfg);
+}
+
+// Both ways must produce the same bytes for one pass over the file
+static int check_one(const sample_t *sample, const char *path)
+{
+  void *zc = open_parser(sample, path, true);
+  void *naive = open_parser(sample, path, false);
+  frame_t a, b;
+  int i, n, bad = 0, copied = 0;
+
+  if (!zc || !naive) {
+    destroy_file_parser(zc);
+    destroy_file_parser(naive);
+    return -1;
+  }
+  for (n = 0; file_parser_obtain_frame(zc, &a) == 0; n++) {
+    // the parser rewinds at the end of file
+    if (n > 0 && a.offset == 0) {
+      file_parser_release_frame(zc, &a);
+      break;
+    }
+    if (file_parser_obtain_frame(naive, &b) < 0) {
+      bad++;
+      file_parser_release_frame(zc, &a);
+      break;
+    }
+    uint32_t len = naive_rewrite(b.ptr, b.len);
+    if (!a.ext || !a.ext->length_prefixed) {
+      // no nal list for this frame; the caller falls back to a rewrite
+      copied++;
+    } else {
+      uint32_t pos = 0;
+      for (i = 0; i < a.ext->iov_cnt && pos + a.ext->iov[i].len <= len; i++) {
+        if (memcmp(gs_buf + pos, a.ext->iov[i].ptr, a.ext->iov[i].len) != 0) {
+          break;
+        }
+        pos += a.ext->iov[i].len;
+      }
+      bad += i != a.ext->iov_cnt || pos != len;
+    }
+    file_parser_release_frame(zc, &a);
+    file_parser_release_frame(naive, &b);
+  }
+  destroy_file_parser(zc);
+  destroy_file_parser(naive);
+  fprintf(gs_out, "%-24s %d frames checked, %d mismatches, %d without nal list\n", sample->file, n, bad, copied);
+  return bad ? -1 : 0;
+}
+
+static int bench_one(const sample_t *sample, const char *path, bool zero_copy, result_t *res)
+{
+  void *parser = open_parser(sample, path, zero_copy);
+  frame_t f;
+  int64_t start;
+
+  if (!parser) {
+    return -1;
+  }
+  memset(res, 0, sizeof(result_t));
+  start = now_ns();
+  do {
+    int i;
+    // check the clock every few frames only
+    for (i = 0; i < 64; i++) {
+      if (file_parser_obtain_frame(parser, &f) < 0) {
+        destroy_file_parser(parser);
+        return -1;
+      }
+      res->bytes += f.ext && f.ext->length_prefixed ? iov_len(f.ext) : naive_rewrite(f.ptr, f.len);
+      res->frames++;
+      file_parser_release_frame(parser, &f);
+    }
+    res->ns = now_ns() - start;
+  } while (res->ns < MIN_RUN_NS);
+  destroy_file_parser(parser);
+  return 0;
+}
+
+static void print_result(const char *file, const char *mode, const result_t *res)
+{
+  double secs = res->ns / 1e9;
+
+  fprintf(gs_out, "%-24s %-9s %12.0f frames/s %10.2f MB/s %10.1f ns/frame\n", file, mode, res->frames / secs,
+         res->bytes / secs / (1024 * 1024), (double)res->ns / res->frames);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *dir = argc > 1 ? argv[1] : "out";
+  char path[1024];
+  int j;
+
+  // keep the parsers' log lines out of the results
+  int fd = dup(STDOUT_FILENO);
+  if (fd < 0 || (gs_out = fdopen(fd, "w")) == NULL || !freopen("/dev/null", "w", stdout)) {
+    return 1;
+  }
+
+  for (j = 0; j < (int)(sizeof(gs_samples) / sizeof(gs_samples[0])); j++) {
+    const sample_t *sample = &gs_samples[j];
+    result_t res;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, sample->file);
+    if (access(path, R_OK) != 0) {
+      fprintf(gs_out, "%-24s skipped, not found in %s\n", sample->file, dir);
+      continue;
+    }
+    if (check_one(sample, path) < 0) {
+      fprintf(gs_out, "%-24s length prefixed output differs from the rewrite\n", sample->file);
+      continue;
+    }
+    if (bench_one(sample, path, true, &res) == 0) {
+      print_result(sample->file, "zero-copy", &res);
+    }
+    if (bench_one(sample, path, false, &res) == 0) {
+      print_result(sample->file, "rewrite", &res);
+    }
+  }
+  free(gs_buf);
+  fclose(gs_out);
+  return 0;
+}
@@ -0,0 +1,163 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * Microbenchmark for the G.711 encoders and decoders.
+ * Usage: bench_g711 [pcm_file]
+ * The file is 16-bit little-endian PCM; without one a synthetic
+ * 16 M sample signal (tone plus noise over the full range) is used.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "g711.h"
+
+#define SYNTH_SAMPLES (16 * 1024 * 1024)
+#define MIN_RUN_NS (500 * 1000 * 1000LL)
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int16_t *make_synthetic(size_t samples)
+{
+  int16_t *buf = (int16_t *)malloc(samples * sizeof(int16_t));
+  uint32_t seed = 0x12345678;
+  int32_t tri = 0, step = 97;
+  size_t i;
+
+  if (!buf) {
+    return NULL;
+  }
+  // a triangle wave sweeping every segment, with noise on top
+  for (i = 0; i < samples; i++) {
+    int32_t v;
+    seed = seed * 1664525 + 1013904223;
+    tri += step;
+    if (tri > 32000 || tri < -32000) {
+      step = -step;
+    }
+    v = tri + (int32_t)(seed >> 24) - 128;
+    buf[i] = (int16_t)(v > 32767 ? 32767 : v < -32768 ? -32768 : v);
+  }
+  return buf;
+}
+
+static int16_t *load_file(const char *path, size_t *samples)
+{
+  FILE *f = fopen(path, "rb");
+  int16_t *buf = NULL;
+  long len;
+
+  if (!f) {
+    return NULL;
+  }
+  fseek(f, 0L, SEEK_END);
+  len = ftell(f) & ~1L;
+  fseek(f, 0L, SEEK_SET);
+  if (len > 0 && (buf = (int16_t *)malloc(len)) != NULL) {
+    if (fread(buf, 1, len, f) != (size_t)len) {
+      free(buf);
+      buf = NULL;
+    }
+  }
+  fclose(f);
+  *samples = len > 0 ? (size_t)len / 2 : 0;
+  return buf;
+}
+
+// samples per second of one call over the whole buffer
+static double run_encode(g711_encode_fn fn, const int16_t *pcm, uint8_t *out, size_t samples)
+{
+  int64_t start = now_ns(), elapsed;
+  int loops = 0;
+
+  do {
+    fn(pcm, out, samples);
+    loops++;
+    elapsed = now_ns() - start;
+  } while (elapsed < MIN_RUN_NS);
+  return (double)samples * loops * 1e9 / elapsed;
+}
+
+static double run_decode(g711_decode_fn fn, const uint8_t *in, int16_t *pcm, size_t samples)
+{
+  int64_t start = now_ns(), elapsed;
+  int loops = 0;
+
+  do {
+    fn(in, pcm, samples);
+    loops++;
+    elapsed = now_ns() - start;
+  } while (elapsed < MIN_RUN_NS);
+  return (double)samples * loops * 1e9 / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+  const g711_impl_t *impls[4];
+  size_t samples = SYNTH_SAMPLES;
+  int16_t *pcm, *dec, *ref_dec;
+  uint8_t *enc, *ref_enc;
+  int law, i, n;
+
+  pcm = argc > 1 ? load_file(argv[1], &samples) : make_synthetic(samples);
+  if (!pcm) {
+    fprintf(stderr, "failed to prepare input\n");
+    return 1;
+  }
+  enc = (uint8_t *)malloc(samples);
+  ref_enc = (uint8_t *)malloc(samples);
+  dec = (int16_t *)malloc(samples * sizeof(int16_t));
+  ref_dec = (int16_t *)malloc(samples * sizeof(int16_t));
+  if (!enc || !ref_enc || !dec || !ref_dec) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  n = g711_impls(impls, 4);
+  printf("input: %s, %zu samples, runtime dispatch selects \"%s\"\n", argc > 1 ? argv[1] : "synthetic", samples,
+         g711_impl_name());
+
+  for (law = 0; law < 2; law++) {
+    const char *name = law ? "alaw" : "ulaw";
+    double ref_enc_rate = 0, ref_dec_rate = 0;
+
+    // the reference runs first so the others are checked against it
+    for (i = n - 1; i >= 0; i--) {
+      g711_encode_fn encode = law ? impls[i]->alaw_encode : impls[i]->ulaw_encode;
+      g711_decode_fn decode = law ? impls[i]->alaw_decode : impls[i]->ulaw_decode;
+      double enc_rate = run_encode(encode, pcm, enc, samples);
+      double dec_rate = run_decode(decode, i == n - 1 ? enc : ref_enc, dec, samples);
+      int same;
+
+      if (i == n - 1) {
+        memcpy(ref_enc, enc, samples);
+        memcpy(ref_dec, dec, samples * sizeof(int16_t));
+        ref_enc_rate = enc_rate;
+        ref_dec_rate = dec_rate;
+      }
+      same = memcmp(enc, ref_enc, samples) == 0 && memcmp(dec, ref_dec, samples * sizeof(int16_t)) == 0;
+      printf("%s %-6s encode %8.1f Msamples/s (x%5.2f)  decode %8.1f Msamples/s (x%5.2f)%s\n", name,
+             impls[i]->name, enc_rate / 1e6, enc_rate / ref_enc_rate, dec_rate / 1e6, dec_rate / ref_dec_rate,
+             same ? "" : "  MISMATCH");
+    }
+  }
+
+  free(pcm);
+  free(enc);
+  free(ref_enc);
+  free(dec);
+  free(ref_dec);
+  return 0;
+}
@@ -0,0 +1,366 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * Throughput benchmark for the registered file parsers. Every parser
+ * is run over its sample files in example/out, without the frame
+ * index, from open to close.
+ * Usage: bench_parsers [--warm|--cold|--api] [--json] [sample_dir]
+ * Warm runs repeat passes over the cached file; cold runs drop the
+ * file from the page cache before every pass. Api runs go through the
+ * public calls with the frame index, one obtain per frame against
+ * file_parser_obtain_frames, each with and without prefetch. All run
+ * by default.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "file_parser_priv.h"
+
+#define MIN_RUN_NS (500 * 1000 * 1000LL)
+#define COLD_PASSES 5
+// guards against a parser that never reports the end of its file
+#define MAX_FRAMES_PER_PASS (1 << 20)
+// frames per file_parser_obtain_frames call in api runs, and the prefetch
+// depth
+#define API_BATCH 64
+#define API_ROUNDS_PER_CLOCK 16
+
+typedef struct {
+  int codec;
+  const char *file;
+  int sample_rate;
+  int channels;
+} sample_t;
+
+static const sample_t gs_samples[] = {
+  { MEDIA_FILE_TYPE_H264, "send_video.h264.old", 0, 0 },
+  { MEDIA_FILE_TYPE_H265, "send_video.h265", 0, 0 },
+  { MEDIA_FILE_TYPE_VP8, "send_video.ivf", 0, 0 },
+  { MEDIA_FILE_TYPE_JPEG, "send_video.mjpeg", 0, 0 },
+  { MEDIA_FILE_TYPE_AACLC, "send_audio_8k.aac", 8000, 1 },
+  { MEDIA_FILE_TYPE_AACLC, "send_audio_16k.aac", 16000, 1 },
+  { MEDIA_FILE_TYPE_AACLC, "send_audio_32k.aac", 32000, 1 },
+  { MEDIA_FILE_TYPE_AACLC, "send_audio_48k.aac", 48000, 1 },
+  { MEDIA_FILE_TYPE_PCM, "send_audio_8k_1ch.pcm", 8000, 1 },
+  { MEDIA_FILE_TYPE_PCM, "send_audio_16k_1ch.pcm", 16000, 1 },
+  { MEDIA_FILE_TYPE_PCM, "send_audio_16k_2ch.pcm", 16000, 2 },
+  { MEDIA_FILE_TYPE_G711, "send_audio.pcma", 8000, 1 },
+  { MEDIA_FILE_TYPE_G711, "send_audio.pcmu", 8000, 1 },
+  { MEDIA_FILE_TYPE_G722, "send_audio.g722", 16000, 1 },
+  { MEDIA_FILE_TYPE_OPUS, "send_audio.opus", 48000, 1 },
+};
+
+typedef struct {
+  int64_t frames;
+  int64_t bytes;
+  int64_t ns;
+  int64_t allocs;
+  int passes;
+} result_t;
+
+#ifdef BENCH_COUNT_ALLOCS
+// linked with -Wl,--wrap=malloc,... so the parser's own allocations land here
+static int64_t gs_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+  gs_allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+  gs_allocs++;
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+  gs_allocs++;
+  return __real_realloc(ptr, size);
+}
+#define ALLOC_COUNT() gs_allocs
+#else
+#define ALLOC_COUNT() 0
+#endif
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void drop_page_cache(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+// One pass over the file, from open to close
+static int run_pass(const media_parser_t *tmpl, const char *path, const parser_cfg_t *cfg, result_t *res)
+{
+  media_parser_t parser;
+  frame_t frame;
+  int64_t start, allocs;
+  int64_t frames = 0;
+  int64_t bytes = 0;
+
+  memcpy(&parser, tmpl, sizeof(media_parser_t));
+  memcpy(&parser.parser_cfg, cfg, sizeof(parser_cfg_t));
+  parser.p_index = NULL;
+  parser.p_prefetch = NULL;
+  parser.is_stream = false;
+  parser.p_ctx = NULL;
+
+  allocs = ALLOC_COUNT();
+  start = now_ns();
+  if (parser.open(&parser, path) < 0) {
+    return -1;
+  }
+  while (frames < MAX_FRAMES_PER_PASS) {
+    memset(&frame, 0, sizeof(frame));
+    if (parser.obtain_frame(&parser, &frame) < 0) {
+      break;
+    }
+    frames++;
+    bytes += frame.len;
+    parser.release_frame(&parser, &frame);
+  }
+  parser.close(&parser);
+
+  res->ns += now_ns() - start;
+  res->allocs += ALLOC_COUNT() - allocs;
+  res->frames += frames;
+  res->bytes += bytes;
+  res->passes++;
+  return 0;
+}
+
+static void sample_cfg(const sample_t *sample, parser_cfg_t *cfg)
+{
+  memset(cfg, 0, sizeof(parser_cfg_t));
+  if (fp_is_video_codec(sample->codec)) {
+    cfg->u.video_cfg.fps = FP_DEFAULT_FPS;
+  } else {
+    cfg->u.audio_cfg.sampleRateHz = sample->sample_rate;
+    cfg->u.audio_cfg.numberOfChannels = sample->channels;
+    cfg->u.audio_cfg.framePeriodMs = 20;
+  }
+}
+
+// Frames in rounds of API_BATCH through the public calls, the file looping
+static int bench_api(const char *path, const sample_t *sample, bool batch, bool prefetch, result_t *res)
+{
+  frame_t frames[API_BATCH];
+  parser_cfg_t cfg;
+  int64_t start;
+  void *parser;
+  int i, n, round;
+
+  sample_cfg(sample, &cfg);
+  // with the nal list the demo sender asks for
+  if (fp_is_video_codec(sample->codec)) {
+    cfg.u.video_cfg.list_nals = true;
+  }
+  memset(res, 0, sizeof(result_t));
+  parser = create_file_parser(sample->codec, path, &cfg);
+  if (!parser) {
+    return -1;
+  }
+  if (prefetch && file_parser_start_prefetch(parser, API_BATCH) < 0) {
+    destroy_file_parser(parser);
+    return -1;
+  }
+
+  start = now_ns();
+  do {
+    for (round = 0; round < API_ROUNDS_PER_CLOCK; round++) {
+      if (batch) {
+        n = file_parser_obtain_frames(parser, frames, API_BATCH, 0);
+      } else {
+        for (n = 0; n < API_BATCH && file_parser_obtain_frame(parser, &frames[n]) == 0; n++) {
+        }
+      }
+      if (n < API_BATCH) {
+        destroy_file_parser(parser);
+        return -1;
+      }
+      for (i = 0; i < n; i++) {
+        res->bytes += frames[i].len;
+      }
+      res->frames += n;
+      if (batch) {
+        file_parser_release_frames(parser, frames, n);
+      } else {
+        for (i = 0; i < n; i++) {
+          file_parser_release_frame(parser, &frames[i]);
+        }
+      }
+    }
+    res->ns = now_ns() - start;
+  } while (res->ns < MIN_RUN_NS);
+  res->passes = 1;
+
+  destroy_file_parser(parser);
+  return 0;
+}
+
+static int bench_one(const media_parser_t *tmpl, const char *path, const sample_t *sample, bool cold, result_t *res)
+{
+  parser_cfg_t cfg;
+
+  sample_cfg(sample, &cfg);
+  memset(res, 0, sizeof(result_t));
+
+  if (cold) {
+    int i;
+    for (i = 0; i < COLD_PASSES; i++) {
+      drop_page_cache(path);
+      if (run_pass(tmpl, path, &cfg, res) < 0) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  // the first pass only pulls the file into the cache
+  if (run_pass(tmpl, path, &cfg, res) < 0) {
+    return -1;
+  }
+  memset(res, 0, sizeof(result_t));
+  do {
+    if (run_pass(tmpl, path, &cfg, res) < 0) {
+      return -1;
+    }
+  } while (res->ns < MIN_RUN_NS);
+  return 0;
+}
+
+static void print_result(FILE *out, const char *name, const char *file, const char *mode, const result_t *res,
+                         bool json, bool *first)
+{
+  double secs = res->ns / 1e9;
+  double fps = secs > 0 ? res->frames / secs : 0;
+  double mbps = secs > 0 ? res->bytes / secs / (1024 * 1024) : 0;
+  double ns_per_frame = res->frames ? (double)res->ns / res->frames : 0;
+#ifdef BENCH_COUNT_ALLOCS
+  double allocs_per_frame = res->frames ? (double)res->allocs / res->frames : 0;
+#else
+  double allocs_per_frame = -1;
+#endif
+
+  if (json) {
+    fprintf(out, "%s\n  {\"parser\": \"%s\", \"file\": \"%s\", \"mode\": \"%s\", \"passes\": %d, \"frames\": %lld, "
+            "\"bytes\": %lld, \"frames_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"ns_per_frame\": %.1f, "
+            "\"allocs_per_frame\": %.4f}",
+            *first ? "" : ",", name, file, mode, res->passes, (long long)res->frames,
+            (long long)res->bytes, fps, mbps, ns_per_frame, allocs_per_frame);
+  } else {
+    fprintf(out, "%-6s %-24s %-11s %12.0f frames/s %10.2f MB/s %10.1f ns/frame %8.3f allocs/frame\n", name, file,
+            mode, fps, mbps, ns_per_frame, allocs_per_frame);
+  }
+  *first = false;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *dir = "out";
+  static const char *const api_modes[] = { "single", "batch", "single+pf", "batch+pf" };
+  bool warm = true, cold = true, api = true, json = false;
+  bool first = true;
+  FILE *out = stdout;
+  const media_parser_t *tmpl;
+  char path[1024];
+  int i, j, m;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--warm") == 0) {
+      cold = api = false;
+    } else if (strcmp(argv[i], "--cold") == 0) {
+      warm = api = false;
+    } else if (strcmp(argv[i], "--api") == 0) {
+      warm = cold = false;
+    } else if (strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else {
+      dir = argv[i];
+    }
+  }
+
+  if (json) {
+    // keep the parsers' log lines out of the json
+    int fd = dup(STDOUT_FILENO);
+    if (fd < 0 || (out = fdopen(fd, "w")) == NULL || !freopen("/dev/null", "w", stdout)) {
+      return 1;
+    }
+    fprintf(out, "[");
+  }
+  for (i = 0; (tmpl = fp_parser_at(i)) != NULL; i++) {
+    // stubs of parsers that aren't built have no open
+    if (!tmpl->open) {
+      if (!json) {
+        fprintf(out, "%-6s skipped, not built\n", tmpl->name);
+      }
+      continue;
+    }
+
+    bool found = false;
+    for (j = 0; j < (int)(sizeof(gs_samples) / sizeof(gs_samples[0])); j++) {
+      const sample_t *sample = &gs_samples[j];
+      if (sample->codec != tmpl->codec) {
+        continue;
+      }
+      snprintf(path, sizeof(path), "%s/%s", dir, sample->file);
+      if (access(path, R_OK) != 0) {
+        continue;
+      }
+      found = true;
+
+      for (m = 0; m < 2; m++) {
+        result_t res;
+        if ((m == 0 && !warm) || (m == 1 && !cold)) {
+          continue;
+        }
+        if (bench_one(tmpl, path, sample, m == 1, &res) < 0) {
+          fprintf(stderr, "%s: failed to parse %s\n", tmpl->name, path);
+          break;
+        }
+        print_result(out, tmpl->name, sample->file, m == 1 ? "cold" : "warm", &res, json, &first);
+      }
+      for (m = 0; api && m < 4; m++) {
+        result_t res;
+        if (bench_api(path, sample, (m & 1) != 0, m >= 2, &res) < 0) {
+          fprintf(stderr, "%s: failed to read %s through the api\n", tmpl->name, path);
+          break;
+        }
+        print_result(out, tmpl->name, sample->file, api_modes[m], &res, json, &first);
+      }
+    }
+    if (!found && !json) {
+      fprintf(out, "%-6s skipped, no sample file in %s\n", tmpl->name, dir);
+    }
+  }
+  if (json) {
+    fprintf(out, "\n]\n");
+  }
+  fclose(out);
+  return 0;
+}
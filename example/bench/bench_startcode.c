@@ -0,0 +1,133 @@
+/*************************************************************
+ * Module:	Agora SD-RTN SDK RTC C API demo application.
+ *
+ * Microbenchmark for the Annex-B start code scanners.
+ * Usage: bench_startcode [annexb_file]
+ * Without a file a synthetic 64 MB bitstream is scanned.
+ *
+ * This is a part of the Agora RTC Service SDK.
+ * Copyright (C) 2020 Agora IO
+ * All rights reserved.
+ *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "file_parser_priv.h"
+
+#define SYNTH_SIZE (64 * 1024 * 1024)
+#define SYNTH_NAL_SIZE (4 * 1024)
+#define MIN_RUN_NS (500 * 1000 * 1000LL)
+
+static int64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint8_t *make_synthetic(size_t size)
+{
+  uint8_t *buf = (uint8_t *)malloc(size);
+  uint32_t seed = 0x12345678;
+  size_t i;
+
+  if (!buf) {
+    return NULL;
+  }
+  for (i = 0; i < size; i++) {
+    seed = seed * 1664525 + 1013904223;
+    buf[i] = seed >> 24;
+    // emulation prevention keeps real payloads free of 00 00 0x
+    if (i >= 2 && buf[i - 1] == 0 && buf[i - 2] == 0 && buf[i] <= 3) {
+      buf[i] = 3;
+    }
+  }
+  for (i = 0; i + 5 < size; i += SYNTH_NAL_SIZE) {
+    buf[i] = 0;
+    buf[i + 1] = 0;
+    buf[i + 2] = 0;
+    buf[i + 3] = 1;
+    buf[i + 4] = 0x41;
+  }
+  return buf;
+}
+
+static uint8_t *load_file(const char *path, size_t *size)
+{
+  FILE *f = fopen(path, "rb");
+  uint8_t *buf = NULL;
+  long len;
+
+  if (!f) {
+    return NULL;
+  }
+  fseek(f, 0L, SEEK_END);
+  len = ftell(f);
+  fseek(f, 0L, SEEK_SET);
+  if (len > 0 && (buf = (uint8_t *)malloc(len)) != NULL) {
+    if (fread(buf, 1, len, f) != (size_t)len) {
+      free(buf);
+      buf = NULL;
+    }
+  }
+  fclose(f);
+  *size = len > 0 ? (size_t)len : 0;
+  return buf;
+}
+
+static long count_startcodes(fp_startcode_fn fn, const uint8_t *buf, size_t size)
+{
+  const uint8_t *p = buf;
+  const uint8_t *end = buf + size;
+  long n = 0;
+
+  while ((p = fn(p, end)) != end) {
+    n++;
+    p += 3;
+  }
+  return n;
+}
+
+int main(int argc, char *argv[])
+{
+  const fp_startcode_impl_t *impls[8];
+  size_t size = SYNTH_SIZE;
+  uint8_t *buf;
+  long ref_count = -1;
+  int i, n;
+
+  buf = argc > 1 ? load_file(argv[1], &size) : make_synthetic(size);
+  if (!buf) {
+    fprintf(stderr, "failed to prepare input\n");
+    return 1;
+  }
+
+  n = fp_startcode_impls(impls, 8);
+  printf("input: %s, %zu bytes, runtime dispatch selects \"%s\"\n", argc > 1 ? argv[1] : "synthetic", size,
+         fp_startcode_impl_name());
+
+  for (i = n - 1; i >= 0; i--) {
+    int64_t start = now_ns(), elapsed;
+    long count = 0;
+    int loops = 0;
+
+    do {
+      count = count_startcodes(impls[i]->fn, buf, size);
+      loops++;
+      elapsed = now_ns() - start;
+    } while (elapsed < MIN_RUN_NS);
+
+    if (ref_count < 0) {
+      ref_count = count;
+    }
+    printf("%-6s %8.2f GB/s  %ld start codes%s\n", impls[i]->name, (double)size * loops / elapsed, count,
+           count == ref_count ? "" : "  MISMATCH");
+  }
+
+  free(buf);
+  return 0;
+}
@@ -16,6 +16,8 @@
  #include <strings.h>
  #include "rtnlite_engine_api.h" // Our main API
  #include "pacer.h" // For controlling frame send rate
+ #include "g711.h" // For sending PCM files as G.711
+ #include "resampler.h" // For converting PCM to the rate and channels sent
  #include "3rd/file_parser/include/file_parser.h" // For reading media files
  
  // Demo utilities (conceptual, replace with actual implementations)
@@ -24,6 +26,7 @@
  #define DEFAULT_AUDIO_FILE "../../../media/opusSampleFrames/" // Needs to be a directory for file_parser
  #define DEFAULT_VIDEO_FPS 25
  #define DEFAULT_AUDIO_FRAME_DURATION_MS 20 // For Opus
+ #define DEFAULT_PREFETCH_DEPTH 8 // Frames read ahead per parser, 0 disables
  
  // Application-specific context
  typedef struct {
@@ -37,6 +40,18 @@
      char video_file_path[256];
      char audio_file_path[256];
      int  video_fps;
+     int  prefetch_depth;
+     rtnlite_video_codec_type_e video_codec;
+     video_stream_info_t video_info; // 从SPS解析的分辨率和帧率
+     rtnlite_audio_codec_type_e audio_codec;
+     int  audio_sample_rate;
+     int  audio_channels;
+     rtnlite_audio_codec_type_e pcm_g711_codec; // PCM 文件编码成的 G.711 (-g)
+     bool audio_encode_g711; // 发送前把 16 位 PCM 编码成 pcm_g711_codec
+     int  pcm_in_channels; // PCM 文件的声道数
+     void *audio_resampler; // PCM 转换到发送的采样率和声道, 两者都相同时为 NULL
+     int16_t* pcm_buffer; // 转换后的 PCM, 按最大帧预先分配
+     uint64_t media_start_us; // wall clock time of pts 0, shared by audio and video
  
      // Media sending state
      void *video_file_parser;
@@ -52,6 +67,12 @@
     volatile bool rtc_connected_flag;
      int           sent_video_frames;
      int           sent_audio_frames;
+     int           dropped_video_frames;
+
+     // 拥塞丢帧: 0 全部发送, 1 丢弃可丢弃帧, 2 只发关键帧
+     int           video_drop_level;
+     int           video_ok_streak;  // 连续发送成功的帧数, 满一秒恢复一级
+     int           video_drop_tid;   // 丢过的最低时域层 (>0), 到下一个关键帧前同层及以上都不发
  
  } app_context_t;
  
@@ -67,7 +88,7 @@
  }
  
  static void print_usage(const char* app_name) {
-     printf("Usage: %s -u <user_id> -s <signaling_url> -r <room_id> [-v <video_file_dir>] [-a <audio_file_dir>] [-f <fps>]\n", app_name);
+     printf("Usage: %s -u <user_id> -s <signaling_url> -r <room_id> [-v <video_file_dir>] [-a <audio_file_dir>] [-f <fps>] [-p <depth>] [-g <pcmu|pcma>]\n", app_name);
      printf("Options:\n");
      printf("  -u <user_id>         : Local user identifier (required).\n");
      printf("  -s <signaling_url>   : WebSocket signaling server URL (e.g., wss://host:port/path) (required).\n");
@@ -75,7 +96,10 @@
      printf("  -v <video_file_dir>  : Directory path for H.264 frame files (default: %s).\n", DEFAULT_VIDEO_FILE);
      printf("  -a <audio_file_dir>  : Directory path for Opus frame files (default: %s).\n", DEFAULT_AUDIO_FILE);
      printf("  -f <fps>             : Video frames per second for sending (default: %d).\n", DEFAULT_VIDEO_FPS);
-     printf("  -h                   : Show this help message.\n");
+     printf("  -p <depth>           : Frames each parser reads ahead on its own thread, 0 disables (default: %d).\n", DEFAULT_PREFETCH_DEPTH);
+     printf("  -g <pcmu|pcma>       : G.711 law PCM and WAV audio is encoded to before sending (default: pcma).\n");
+     printf("  Media paths may also be a FIFO, or - for stdin, to stream from an encoder process.\n");
+    printf("  -h                   : Show this help message.\n");
  }
  
  static int parse_arguments(int argc, char* argv[], app_context_t* ctx) {
@@ -86,12 +110,14 @@
     strcpy(ctx->signaling_url, "wss://localhost:9081"); // 默认信令服务器: wss://localhost:9081
     strcpy(ctx->room_id, "666");                   // 默认房间ID: 666
     strcpy(ctx->video_file_path, "out/send_video.h264"); // 默认视频文件
-    strcpy(ctx->audio_file_path, "out/send_audio_16k_1ch.pcm"); // 默认音频文件
+    strcpy(ctx->audio_file_path, "out/send_audio.opus"); // 默认音频文件
     ctx->video_fps = 20;                             // 默认帧率: 20fps
+    ctx->prefetch_depth = DEFAULT_PREFETCH_DEPTH;    // 默认预读深度
+    ctx->pcm_g711_codec = RTNLITE_AUDIO_CODEC_PCM_A8; // PCM 默认编码成 A-law
 
     // 不需要跟踪是否设置这些参数，因为已有默认值
 
-    while ((opt = getopt(argc, argv, "u:s:r:v:a:f:h")) != -1) {
+    while ((opt = getopt(argc, argv, "u:s:r:v:a:f:p:g:h")) != -1) {
          switch (opt) {
              case 'u':
                  strncpy(ctx->local_user_id, optarg, sizeof(ctx->local_user_id) - 1);
@@ -118,6 +144,22 @@
                      ctx->video_fps = DEFAULT_VIDEO_FPS;
                  }
                  break;
+             case 'p':
+                 ctx->prefetch_depth = atoi(optarg);
+                 if (ctx->prefetch_depth < 0) {
+                     ctx->prefetch_depth = 0;
+                 }
+                 break;
+             case 'g':
+                 if (strcasecmp(optarg, "pcmu") == 0) {
+                     ctx->pcm_g711_codec = RTNLITE_AUDIO_CODEC_PCM_U8;
+                 } else if (strcasecmp(optarg, "pcma") == 0) {
+                     ctx->pcm_g711_codec = RTNLITE_AUDIO_CODEC_PCM_A8;
+                 } else {
+                     fprintf(stderr, "Unknown G.711 law '%s', expected pcmu or pcma.\n", optarg);
+                     return -2;
+                 }
+                 break;
              case 'h':
                  print_usage(argv[0]);
                  return -1; // Indicate help was shown, exit
@@ -135,6 +177,7 @@
     printf("  Video file: %s\n", ctx->video_file_path);
     printf("  Audio file: %s\n", ctx->audio_file_path);
     printf("  Video FPS: %d\n", ctx->video_fps);
+    printf("  Prefetch depth: %d\n", ctx->prefetch_depth);
      return 0;
  }
  
@@ -154,12 +197,35 @@
  
  static int initialize_media_sources(app_context_t* ctx) {
     printf("Initializing video source: %s\n", ctx->video_file_path);
-    // For H264 video, parser_cfg can often be NULL if not specifically needed by the parser implementation.
-    ctx->video_file_parser = create_file_parser(MEDIA_FILE_TYPE_H264, ctx->video_file_path, NULL);
+    // H.264 unless the content says H.265 or VP8; streams can't be probed and stay H.264
+    media_file_type_e video_type = MEDIA_FILE_TYPE_H264;
+    parser_cfg_t video_p_cfg;
+    if (file_parser_probe(ctx->video_file_path, &video_type, &video_p_cfg) != 0 ||
+        (video_type != MEDIA_FILE_TYPE_H264 && video_type != MEDIA_FILE_TYPE_H265 && video_type != MEDIA_FILE_TYPE_VP8)) {
+        video_type = MEDIA_FILE_TYPE_H264;
+    }
+    // frame rate for streams without timing info of their own
+    memset(&video_p_cfg, 0, sizeof(parser_cfg_t));
+    video_p_cfg.u.video_cfg.fps = ctx->video_fps;
+    // 让中途加入的接收端在下一个关键帧就能解码
+    video_p_cfg.u.video_cfg.prepend_param_sets = true;
+    // 按 NAL 列表组帧, 不再重新扫描起始码
+    video_p_cfg.u.video_cfg.list_nals = true;
+    if (video_type == MEDIA_FILE_TYPE_VP8) {
+        ctx->video_codec = RTNLITE_VIDEO_CODEC_VP8;
+    } else {
+        ctx->video_codec = video_type == MEDIA_FILE_TYPE_H265 ? RTNLITE_VIDEO_CODEC_H265 : RTNLITE_VIDEO_CODEC_H264;
+    }
+    printf("  Video codec: %s\n", video_type == MEDIA_FILE_TYPE_VP8 ? "VP8" : (video_type == MEDIA_FILE_TYPE_H265 ? "H.265" : "H.264"));
+    ctx->video_file_parser = create_file_parser(video_type, ctx->video_file_path, &video_p_cfg);
     if (!ctx->video_file_parser) {
         fprintf(stderr, "Failed to create video file parser for path: %s\n", ctx->video_file_path);
         return -1;
     }
+    if (file_parser_get_video_info(ctx->video_file_parser, &ctx->video_info) == 0) {
+        printf("  Video stream: %dx%d, %.2f fps\n", ctx->video_info.width, ctx->video_info.height,
+               (double)ctx->video_info.fps_num / ctx->video_info.fps_den);
+    }
     printf("Initializing audio source: %s\n", ctx->audio_file_path);
     parser_cfg_t audio_p_cfg;
     memset(&audio_p_cfg, 0, sizeof(parser_cfg_t));
@@ -167,8 +233,16 @@
     // 根据文件名确定音频类型和参数
     media_file_type_e audio_type = MEDIA_FILE_TYPE_OPUS; // 默认值
     
-    // 获取文件后缀名以判断类型
-    const char* file_ext = strrchr(ctx->audio_file_path, '.');
+    // Headers tell the real format when there are any (ADTS, Ogg, WAV)
+    bool probed = file_parser_probe_audio(ctx->audio_file_path, &audio_type, &audio_p_cfg) == 0;
+    if (probed) {
+        printf("  Detected from content: type %d, %d Hz, %d channel(s), %d ms frames\n", audio_type,
+               audio_p_cfg.u.audio_cfg.sampleRateHz, audio_p_cfg.u.audio_cfg.numberOfChannels,
+               audio_p_cfg.u.audio_cfg.framePeriodMs);
+    }
+
+    // 获取文件后缀名以判断类型 (headerless PCM can only be told by its name)
+    const char* file_ext = probed ? NULL : strrchr(ctx->audio_file_path, '.');
     if (file_ext) {
         file_ext++; // 跳过点号
         
@@ -210,6 +284,12 @@
             audio_p_cfg.u.audio_cfg.numberOfChannels = 1;  // 单声道
             audio_p_cfg.u.audio_cfg.framePeriodMs = 20;    // Opus帧间隔
             printf("  Opus格式, 采样率: 48000 Hz, 通道数: 1\n");
+        } else if (strcasecmp(file_ext, "pcma") == 0 || strcasecmp(file_ext, "pcmu") == 0) {
+            audio_type = MEDIA_FILE_TYPE_G711;
+            audio_p_cfg.u.audio_cfg.sampleRateHz = 8000;
+            audio_p_cfg.u.audio_cfg.numberOfChannels = 1;
+            audio_p_cfg.u.audio_cfg.framePeriodMs = 20;
+            printf("  G.711格式, 采样率: 8000 Hz, 通道数: 1\n");
         } else if (strcasecmp(file_ext, "aac") == 0) {
             audio_type = MEDIA_FILE_TYPE_AACLC;
             audio_p_cfg.u.audio_cfg.sampleRateHz = 44100; // AAC常用采样率
@@ -219,19 +299,83 @@
         }
     }
     
+    // SDK 只能发送 Opus 和 G.711, PCM 现场编码成 G.711, 其他格式不能冒充 Opus 发出去
+    if (audio_type == MEDIA_FILE_TYPE_OPUS) {
+        ctx->audio_codec = RTNLITE_AUDIO_CODEC_OPUS;
+        ctx->audio_sample_rate = 48000;
+    } else if (audio_type == MEDIA_FILE_TYPE_G711) {
+        // WAV 头里写明了 u-law 还是 A-law, 裸流只能看后缀
+        const char* ext = strrchr(ctx->audio_file_path, '.');
+        bool ulaw = probed ? audio_p_cfg.u.audio_cfg.g711Ulaw : (ext && strcasecmp(ext, ".pcmu") == 0);
+        ctx->audio_codec = ulaw ? RTNLITE_AUDIO_CODEC_PCM_U8 : RTNLITE_AUDIO_CODEC_PCM_A8;
+        ctx->audio_sample_rate = 8000;
+    } else if (audio_type == MEDIA_FILE_TYPE_PCM) {
+        // PCM 在发送时编码成 G.711, 其他采样率先转换到 G.711 的 8 kHz
+        audio_p_cfg.u.audio_cfg.convertToInt16 = true;
+        ctx->audio_codec = ctx->pcm_g711_codec;
+        ctx->audio_sample_rate = 8000;
+        ctx->audio_encode_g711 = true;
+        printf("  PCM encoded to %s on sending (%s)\n", ctx->audio_codec == RTNLITE_AUDIO_CODEC_PCM_U8 ? "PCMU" : "PCMA",
+               g711_impl_name());
+    } else {
+        fprintf(stderr, "Audio type %d can't be sent: the SDK carries Opus and G.711 only\n", audio_type);
+        destroy_file_parser(ctx->video_file_parser);
+        ctx->video_file_parser = NULL;
+        return -1;
+    }
+    ctx->audio_channels = audio_p_cfg.u.audio_cfg.numberOfChannels > 0 ? audio_p_cfg.u.audio_cfg.numberOfChannels : 1;
+
+    // G.711 是 8 kHz 单声道, 其他格式的 PCM 逐帧重采样和混音
+    if (ctx->audio_encode_g711) {
+        int in_rate = audio_p_cfg.u.audio_cfg.sampleRateHz;
+        int period_ms = audio_p_cfg.u.audio_cfg.framePeriodMs > 0 ? audio_p_cfg.u.audio_cfg.framePeriodMs : 20;
+        ctx->pcm_in_channels = ctx->audio_channels;
+        ctx->audio_channels = 1;
+        if (in_rate != ctx->audio_sample_rate || ctx->pcm_in_channels != ctx->audio_channels) {
+            ctx->audio_resampler = resampler_create(in_rate, ctx->pcm_in_channels, ctx->audio_sample_rate,
+                                                    ctx->audio_channels, in_rate * period_ms / 1000);
+            if (ctx->audio_resampler) {
+                ctx->pcm_buffer = (int16_t*)malloc((size_t)resampler_max_out_frames(ctx->audio_resampler) *
+                                                   ctx->audio_channels * sizeof(int16_t));
+            }
+            if (!ctx->pcm_buffer) {
+                fprintf(stderr, "Failed to set up PCM conversion from %d Hz, %d channel(s)\n", in_rate, ctx->pcm_in_channels);
+                resampler_destroy(ctx->audio_resampler);
+                ctx->audio_resampler = NULL;
+                destroy_file_parser(ctx->video_file_parser);
+                ctx->video_file_parser = NULL;
+                return -1;
+            }
+            printf("  PCM converted from %d Hz, %d channel(s) to %d Hz, %d channel(s) (%s)\n", in_rate,
+                   ctx->pcm_in_channels, ctx->audio_sample_rate, ctx->audio_channels, resampler_impl_name());
+        }
+    }
+
     ctx->audio_file_parser = create_file_parser(audio_type, ctx->audio_file_path, &audio_p_cfg);
     if (!ctx->audio_file_parser) {
         fprintf(stderr, "Failed to create audio file parser for path: %s\n", ctx->audio_file_path);
         destroy_file_parser(ctx->video_file_parser); // Clean up already created parser
         ctx->video_file_parser = NULL;
+        resampler_destroy(ctx->audio_resampler);
+        ctx->audio_resampler = NULL;
+        free(ctx->pcm_buffer);
+        ctx->pcm_buffer = NULL;
         return -1;
     }
     
+    // 在后台线程预读帧，避免缺页和磁盘IO阻塞发送循环
+    if (ctx->prefetch_depth > 0) {
+        if (file_parser_start_prefetch(ctx->video_file_parser, ctx->prefetch_depth) != 0 ||
+            file_parser_start_prefetch(ctx->audio_file_parser, ctx->prefetch_depth) != 0) {
+            fprintf(stderr, "Failed to start frame prefetch, reading synchronously\n");
+        }
+    }
+
     // 初始化pacer以控制音视频发送速率
     printf("Initializing media pacer\n");
-    // 设置音视频发送间隔，单位为微秒
+    // 设置音视频发送间隔，单位为微秒; 发送时按每帧的duration调整
     uint32_t audio_send_interval_us = 20000; // 20ms for audio
-    uint32_t video_send_interval_us = 33333; // ~30fps for video
+    uint32_t video_send_interval_us = 1000000 / ctx->video_fps;
     
     ctx->pacer_handle = pacer_create(audio_send_interval_us, video_send_interval_us);
     if (!ctx->pacer_handle) {
@@ -240,6 +384,10 @@
         destroy_file_parser(ctx->audio_file_parser);
         ctx->video_file_parser = NULL;
         ctx->audio_file_parser = NULL;
+        resampler_destroy(ctx->audio_resampler);
+        ctx->audio_resampler = NULL;
+        free(ctx->pcm_buffer);
+        ctx->pcm_buffer = NULL;
         return -1;
     }
     printf("Media pacer initialized successfully\n");
@@ -266,10 +414,92 @@ static void cleanup_media_sources(app_context_t* ctx) {
     free(ctx->audio_buffer);
     ctx->audio_buffer = NULL;
     ctx->audio_buffer_size = 0;
+    resampler_destroy(ctx->audio_resampler);
+    ctx->audio_resampler = NULL;
+    free(ctx->pcm_buffer);
+    ctx->pcm_buffer = NULL;
 }
 
 
+ // 按解析器给出的 NAL 列表组帧: 每个 NAL 前加 4 字节起始码, 不再重新扫描起始码.
+ // buf 为 NULL 时只计算长度
+ static uint32_t gather_video_nals(const frame_t* f, uint8_t* buf) {
+     static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+     const frame_ext_t* ext = f->ext;
+     uint32_t pos = 0;
+     int i;
+
+     // 缓存的参数集 (iov[0]) 放在最前面
+     if (ext->iov_cnt > 1) {
+         if (buf) {
+             memcpy(buf, ext->iov[0].ptr, ext->iov[0].len);
+         }
+         pos += ext->iov[0].len;
+     }
+     for (i = 0; i < ext->nal_cnt; i++) {
+         if (buf) {
+             memcpy(buf + pos, start_code, sizeof(start_code));
+             memcpy(buf + pos + sizeof(start_code), f->ptr + ext->nals[i].offset, ext->nals[i].len);
+         }
+         pos += sizeof(start_code) + ext->nals[i].len;
+     }
+     return pos;
+ }
  
+ // 发送队列满或超时视为上行拥塞
+ static int is_video_backpressure(int ret) {
+     return ret == RTNLITE_ERR_TIMEDOUT || ret == RTNLITE_ERR_NO_MEMORY;
+ }
+
+ // 高时域层的帧可能被同层后续帧参考, 丢了它就要丢到下一个关键帧
+ static void note_video_layer_dropped(app_context_t* ctx, const frame_t* f) {
+     int tid = f->u.video.temporal_id;
+     if (tid > 0 && (ctx->video_drop_tid == 0 || tid < ctx->video_drop_tid)) {
+         ctx->video_drop_tid = tid;
+     }
+ }
+
+ static int should_drop_video_frame(app_context_t* ctx, const frame_t* f) {
+     if (f->u.video.frame_class == VIDEO_FRAME_CLASS_KEY) {
+         // 关键帧之后不再依赖任何丢掉的帧
+         ctx->video_drop_tid = 0;
+         if (ctx->video_drop_level > 1) {
+             ctx->video_drop_level = 1;
+         }
+         return 0;
+     }
+     if (ctx->video_drop_level > 1) {
+         return 1;
+     }
+     if (ctx->video_drop_tid > 0 && f->u.video.temporal_id >= ctx->video_drop_tid) {
+         return 1;
+     }
+     if (ctx->video_drop_level == 1 && f->u.video.frame_class == VIDEO_FRAME_CLASS_DISPOSABLE) {
+         note_video_layer_dropped(ctx, f);
+         return 1;
+     }
+     return 0;
+ }
+
+ static void update_video_drop_level(app_context_t* ctx, const frame_t* f, int ret) {
+     if (is_video_backpressure(ret)) {
+         ctx->video_ok_streak = 0;
+         if (f->u.video.frame_class == VIDEO_FRAME_CLASS_DISPOSABLE) {
+             note_video_layer_dropped(ctx, f);
+             if (ctx->video_drop_level < 1) {
+                 ctx->video_drop_level = 1;
+             }
+         } else {
+             // 关键帧或参考帧没发出去, 后面的帧都解不了, 等下一个关键帧
+             ctx->video_drop_level = 2;
+         }
+         printf("Video uplink congested (ret %d), drop level %d\n", ret, ctx->video_drop_level);
+     } else if (ret == RTNLITE_ERR_OK && ctx->video_drop_level > 0 && ++ctx->video_ok_streak >= ctx->video_fps) {
+         ctx->video_drop_level--;
+         ctx->video_ok_streak = 0;
+     }
+ }
+
  static int send_video_frame_from_file(app_context_t* ctx) {
      frame_t file_frame;
      if (file_parser_obtain_frame(ctx->video_file_parser, &file_frame) < 0) {
@@ -277,32 +507,68 @@ static void cleanup_media_sources(app_context_t* ctx) {
          // Looping removed as file_parser_reset is not available in current file_parser.h
          return -1; 
      }
+
+     // pace at the content's own rate, dropped frames included
+     pacer_set_video_interval(ctx->pacer_handle, file_frame.duration_us);
+     if (ctx->media_start_us == 0) {
+         ctx->media_start_us = get_current_time_us();
+     }
+     if (should_drop_video_frame(ctx, &file_frame)) {
+         file_parser_release_frame(ctx->video_file_parser, &file_frame);
+         ctx->dropped_video_frames++;
+         return RTNLITE_ERR_OK;
+     }
  
+     // 关键帧前可能带有缓存的参数集 (iov), 一起拷贝到发送缓冲区
+     const frame_ext_t* ext = file_frame.ext;
+     uint32_t frame_len = file_frame.len;
+     int i;
+     if (ext && ext->nal_cnt > 0) {
+         frame_len = gather_video_nals(&file_frame, NULL);
+     } else if (ext && ext->iov_cnt > 0) {
+         frame_len = 0;
+         for (i = 0; i < ext->iov_cnt; i++) {
+             frame_len += ext->iov[i].len;
+         }
+     }
+
      // Ensure buffer is large enough
-     if (file_frame.len > ctx->video_buffer_size) {
-         uint8_t* new_buf = (uint8_t*)realloc(ctx->video_buffer, file_frame.len);
+     if (frame_len > ctx->video_buffer_size) {
+         uint8_t* new_buf = (uint8_t*)realloc(ctx->video_buffer, frame_len);
          if (!new_buf) {
              fprintf(stderr, "Failed to realloc video buffer.\n");
              file_parser_release_frame(ctx->video_file_parser, &file_frame);
              return RTNLITE_ERR_NO_MEMORY;
          }
          ctx->video_buffer = new_buf;
-         ctx->video_buffer_size = file_frame.len;
+         ctx->video_buffer_size = frame_len;
+     }
+     if (ext && ext->nal_cnt > 0) {
+         gather_video_nals(&file_frame, ctx->video_buffer);
+     } else if (ext && ext->iov_cnt > 0) {
+         uint32_t pos = 0;
+         for (i = 0; i < ext->iov_cnt; i++) {
+             memcpy(ctx->video_buffer + pos, ext->iov[i].ptr, ext->iov[i].len);
+             pos += ext->iov[i].len;
+         }
+     } else {
+         memcpy(ctx->video_buffer, file_frame.ptr, file_frame.len);
      }
-     memcpy(ctx->video_buffer, file_frame.ptr, file_frame.len);
      
      rtnlite_video_frame_t frame_to_send;
      memset(&frame_to_send, 0, sizeof(rtnlite_video_frame_t));
-     frame_to_send.codec_type = RTNLITE_VIDEO_CODEC_H264;
+     frame_to_send.codec_type = ctx->video_codec;
      frame_to_send.frame_type = file_frame.u.video.is_key_frame ? RTNLITE_VIDEO_FRAME_TYPE_KEY : RTNLITE_VIDEO_FRAME_TYPE_DELTA;
      frame_to_send.buffer = ctx->video_buffer;
-     frame_to_send.length = file_frame.len;
-     // frame_to_send.width = ... ; // If available from file_parser metadata
-     // frame_to_send.height = ...;
-     frame_to_send.render_time_ms = get_current_time_us() / 1000;
+     frame_to_send.length = frame_len;
+     // 0 if the stream carries no SPS ahead of its first slice
+     frame_to_send.width = ctx->video_info.width;
+     frame_to_send.height = ctx->video_info.height;
+     frame_to_send.render_time_ms = (ctx->media_start_us + file_frame.pts_us) / 1000;
  
  
      int ret = rtnlite_send_video_frame(ctx->connection_handle, &frame_to_send);
+     update_video_drop_level(ctx, &file_frame, ret);
      file_parser_release_frame(ctx->video_file_parser, &file_frame);
      if (ret == RTNLITE_ERR_OK) {
          ctx->sent_video_frames++;
@@ -318,27 +584,61 @@ static void cleanup_media_sources(app_context_t* ctx) {
          return -1;
      }
  
-     if (file_frame.len > ctx->audio_buffer_size) {
-         uint8_t* new_buf = (uint8_t*)realloc(ctx->audio_buffer, file_frame.len);
+     // G.711 编码后每个 16 位样本占一个字节
+     const int16_t* pcm = (const int16_t*)file_frame.ptr;
+     size_t send_len = ctx->audio_encode_g711 ? file_frame.len / 2 : file_frame.len;
+     if (ctx->audio_resampler) {
+         int frames = resampler_process(ctx->audio_resampler, pcm, (int)(file_frame.len / 2 / ctx->pcm_in_channels),
+                                        ctx->pcm_buffer);
+         if (frames < 0) {
+             fprintf(stderr, "Audio frame of %u bytes is larger than the PCM conversion was set up for.\n", file_frame.len);
+             file_parser_release_frame(ctx->audio_file_parser, &file_frame);
+             return -1;
+         }
+         pcm = ctx->pcm_buffer;
+         send_len = (size_t)frames * ctx->audio_channels;
+     }
+     // 文件末尾的短帧可能转换不出样本
+     if (send_len == 0) {
+         file_parser_release_frame(ctx->audio_file_parser, &file_frame);
+         return RTNLITE_ERR_OK;
+     }
+     if (send_len > ctx->audio_buffer_size) {
+         uint8_t* new_buf = (uint8_t*)realloc(ctx->audio_buffer, send_len);
          if (!new_buf) {
              fprintf(stderr, "Failed to realloc audio buffer.\n");
              file_parser_release_frame(ctx->audio_file_parser, &file_frame);
              return RTNLITE_ERR_NO_MEMORY;
          }
          ctx->audio_buffer = new_buf;
-         ctx->audio_buffer_size = file_frame.len;
+         ctx->audio_buffer_size = send_len;
+     }
+     if (!ctx->audio_encode_g711) {
+         memcpy(ctx->audio_buffer, file_frame.ptr, file_frame.len);
+     } else if (ctx->audio_codec == RTNLITE_AUDIO_CODEC_PCM_U8) {
+         g711_ulaw_encode(pcm, ctx->audio_buffer, send_len);
+     } else {
+         g711_alaw_encode(pcm, ctx->audio_buffer, send_len);
+     }
+     pacer_set_audio_interval(ctx->pacer_handle, file_frame.duration_us);
+     if (ctx->media_start_us == 0) {
+         ctx->media_start_us = get_current_time_us();
      }
-     memcpy(ctx->audio_buffer, file_frame.ptr, file_frame.len);
  
      rtnlite_audio_frame_t frame_to_send;
      memset(&frame_to_send, 0, sizeof(rtnlite_audio_frame_t));
-     frame_to_send.codec_type = RTNLITE_AUDIO_CODEC_OPUS;
+     frame_to_send.codec_type = ctx->audio_codec;
      frame_to_send.buffer = ctx->audio_buffer;
-     frame_to_send.length = file_frame.len;
-     frame_to_send.samples_per_channel = 960; // Specific to 20ms Opus @ 48kHz
-     frame_to_send.sample_rate_hz = 48000;
-     frame_to_send.num_channels = 1;
-     frame_to_send.render_time_ms = get_current_time_us() / 1000;
+     frame_to_send.length = send_len;
+     // Opus 从 TOC 字节得出每包的时长, G.711 每样本一字节, 其他格式按帧时长换算
+     frame_to_send.samples_per_channel = ctx->audio_encode_g711
+         ? (int)(send_len / ctx->audio_channels)
+         : file_frame.u.audio.samples_per_channel
+         ? (int)file_frame.u.audio.samples_per_channel
+         : (int)((uint64_t)file_frame.duration_us * ctx->audio_sample_rate / 1000000);
+     frame_to_send.sample_rate_hz = ctx->audio_sample_rate;
+     frame_to_send.num_channels = ctx->audio_channels;
+     frame_to_send.render_time_ms = (ctx->media_start_us + file_frame.pts_us) / 1000;
  
      int ret = rtnlite_send_audio_frame(ctx->connection_handle, &frame_to_send);
      file_parser_release_frame(ctx->audio_file_parser, &file_frame);
@@ -566,7 +866,7 @@ static void cleanup_media_sources(app_context_t* ctx) {
 
             // Print stats periodically
             if (get_current_time_us() - last_stats_print_time >= 5 * 1000000) { // Every 5 seconds
-                printf("STATS: Sent Video Frames: %d, Sent Audio Frames: %d\n", g_app_ctx.sent_video_frames, g_app_ctx.sent_audio_frames);
+                printf("STATS: Sent Video Frames: %d, Dropped Video Frames: %d, Sent Audio Frames: %d\n", g_app_ctx.sent_video_frames, g_app_ctx.dropped_video_frames, g_app_ctx.sent_audio_frames);
                 last_stats_print_time = get_current_time_us();
             }
 